@@ -0,0 +1,433 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "argtable3/argtable3.h"
+#include "core/args.h"
+#include "core/iterators.h"
+
+#include "generate.h"
+#include "modelfile.h"
+#include "msql.h"
+#include "refcache.h"
+#include "storage.h"
+
+#define BENCH_PAGE_ROWS 60
+#define BENCH_OPERATION_US (5 * 1000000.0)
+
+char*               g_title;
+struct entity*      g_entities;
+struct translation* g_translations;
+
+/* -- OUTPUT -- */
+
+/* Results go to stdout as JSON, errors to stderr and the rest nowhere. */
+void
+$output_info(const char* fmt, ...)
+{
+}
+
+void
+$output_debug(const char* fmt, ...)
+{
+}
+
+void
+$output_error(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+/* -- SAMPLES -- */
+
+struct samples
+{
+    int       n;
+    double*   us;
+    long long rows;
+    double    total_us;
+};
+
+static double
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+add_sample(struct samples* s, double start, int rows)
+{
+    double us = now_us() - start;
+    s->us[s->n++] = us;
+    s->total_us += us;
+    s->rows += rows;
+}
+
+static int
+compare_samples(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void
+print_samples(const char* entity, const char* operation, struct samples* s)
+{
+    static bool first = true;
+    if (s->n == 0) return;
+    qsort(s->us, s->n, sizeof(double), compare_samples);
+    printf("%s\n    { \"entity\": \"%s\", \"operation\": \"%s\", "
+           "\"samples\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+           "\"rows_per_sec\": %.1f }",
+           first ? "" : ",",
+           entity,
+           operation,
+           s->n,
+           s->us[(s->n - 1) * 50 / 100],
+           s->us[(s->n - 1) * 99 / 100],
+           s->total_us > 0 ? s->rows * 1e6 / s->total_us : 0);
+    first       = false;
+    s->n        = 0;
+    s->rows     = 0;
+    s->total_us = 0;
+}
+
+/* -- OPERATIONS -- */
+
+struct bench
+{
+    sqlite3*       db;
+    int            iterations;
+    uint64_t       state;
+    struct samples samples;
+};
+
+/* Operations are sampled up to the given number of iterations, slow ones
+ * stop early once they used up their time. */
+static bool
+more_samples(struct bench* b)
+{
+    return b->samples.n < b->iterations &&
+           b->samples.total_us < BENCH_OPERATION_US;
+}
+
+static int
+random_key(struct bench* b, int max)
+{
+    b->state ^= b->state >> 12;
+    b->state ^= b->state << 25;
+    b->state ^= b->state >> 27;
+    return 1 + (b->state * 0x2545F4914F6CDD1DULL >> 33) % max;
+}
+
+static int
+count_keys(struct bench* b, const char* ename)
+{
+    sqlite3_stmt* res;
+    sds           sql =
+      sdscatprintf(sdsempty(), "SELECT IFNULL(MAX(Id), 0) FROM [%ss]", ename);
+    int max = 0;
+    if (sqlite3_prepare_v2(b->db, sql, -1, &res, 0) == SQLITE_OK) {
+        if (sqlite3_step(res) == SQLITE_ROW) max = sqlite3_column_int(res, 0);
+        sqlite3_finalize(res);
+    }
+    sdsfree(sql);
+    return max;
+}
+
+static void
+bench_list(struct bench* b, struct entity* e, const char* search_term)
+{
+    // Pages are fetched and formatted like the lookup lists do, starting
+    // over at the end of the list.
+    struct list_page page = { .limit = BENCH_PAGE_ROWS, .more = true };
+    char             value[FIELD_TEXT_SIZE];
+    while (more_samples(b)) {
+        if (!page.more) reset_list_page(&page);
+        double       start = now_us();
+        wrapped_stmt ws =
+          prepare_list_query(e, b->db, NULL, NULL, NULL, search_term, &page);
+        $onerror(ws) break;
+        int fetched = 0;
+        while (sqlite3_step(ws.v) == SQLITE_ROW) {
+            for (int j = 0; j < e->plan->n_fields; j++) {
+                const struct field_plan* fp = &e->plan->fields[j];
+                if (fp->list_column < 0) continue;
+                int len;
+                field_value_text(fp->base, ws.v, fp->list_column, value, &len);
+            }
+            advance_list_page(e, &page, ws.v);
+            fetched++;
+        }
+        release_cached_stmt(ws.v);
+        page.more = fetched == page.limit;
+        add_sample(&b->samples, start, fetched);
+    }
+    reset_list_page(&page);
+    print_samples(
+      e->name, search_term[0] ? "list_search" : "list", &b->samples);
+}
+
+static struct entity_value*
+create_entity_value(struct entity* e)
+{
+    struct entity_value* ev = calloc(1, sizeof(struct entity_value));
+    ev->base                = e;
+    ev->values              = calloc(e->n_fields, sizeof(struct field_value*));
+    $foreach_field(f, e)
+    {
+        struct field_value* fv = calloc(1, sizeof(struct field_value));
+        fv->base               = f;
+        fv->is_valid           = true;
+        ev->values[f->id]      = fv;
+        HASH_ADD_STR(ev->fields, base->name, fv);
+    }
+    return ev;
+}
+
+static void
+destroy_entity_value(struct entity_value* ev)
+{
+    struct field_value *fv, *tmp_fv;
+    HASH_ITER(hh, ev->fields, fv, tmp_fv)
+    {
+        HASH_DEL(ev->fields, fv);
+        free(fv->_init_value);
+        free(fv);
+    }
+    free(ev->values);
+    free(ev);
+}
+
+static void
+fill_form(struct bench* b, struct entity_value* ev)
+{
+    // The values a user could have typed into the form.
+    $foreach_hashed(struct field_value*, fv, ev->fields)
+    {
+        switch (fv->base->type) {
+            case REF:
+                fv->_kvalue = random_key(
+                  b, count_keys(b, fv->base->ref.eid) + 1);
+                break;
+            case BOOLEAN:
+                fv->_bool_value = 'X';
+                break;
+            case DATE:
+                fv->_ret_value = "2020-01-01";
+                break;
+            case INTEGER:
+            case REAL:
+                fv->_ret_value = "7";
+                break;
+            default:
+                fv->_ret_value = "bench";
+                break;
+        }
+    }
+}
+
+static void
+bench_obj(struct bench* b, struct entity* e, int keys)
+{
+    struct entity_value* ev = create_entity_value(e);
+    while (keys > 0 && more_samples(b)) {
+        double start = now_us();
+        init_fields(ev, b->db, random_key(b, keys));
+        add_sample(&b->samples, start, 1);
+    }
+    destroy_entity_value(ev);
+    print_samples(e->name, "init_fields", &b->samples);
+}
+
+static void
+bench_ref(struct bench* b, struct entity* e)
+{
+    $foreach_field(f, e)
+    {
+        if (f->type != REF) continue;
+        int keys = count_keys(b, f->ref.eid);
+        while (keys > 0 && more_samples(b)) {
+            int    key   = random_key(b, keys);
+            double start = now_us();
+            sdsfree(get_ref_value(b->db, key, &f->ref));
+            add_sample(&b->samples, start, 1);
+        }
+        sds name = sdscatprintf(sdsempty(), "%s.%s", e->name, f->name);
+        print_samples(name, "get_ref_value", &b->samples);
+        sdsfree(name);
+    }
+}
+
+static void
+bench_forms(struct bench* b, struct entity* e, int keys)
+{
+    // Records are archived among those the insert benchmark added, the
+    // generated ones stay for the other entities.
+    struct entity_value* ev         = create_entity_value(e);
+    int*                 inserted   = calloc(b->iterations, sizeof(int));
+    int                  n_inserted = 0;
+    fill_form(b, ev);
+    while (more_samples(b)) {
+        double      start = now_us();
+        wrapped_key wk    = apply_form(ev, b->db, -1);
+        add_sample(&b->samples, start, 1);
+        $ifvalid(wk) inserted[n_inserted++] = wk.v;
+    }
+    print_samples(e->name, "apply_form_insert", &b->samples);
+    while (keys > 0 && more_samples(b)) {
+        double start = now_us();
+        apply_form(ev, b->db, random_key(b, keys));
+        add_sample(&b->samples, start, 1);
+    }
+    print_samples(e->name, "apply_form_update", &b->samples);
+    for (int i = 0; i < n_inserted && more_samples(b); i++) {
+        double start = now_us();
+        archive_obj(e, b->db, inserted[i]);
+        add_sample(&b->samples, start, 1);
+    }
+    print_samples(e->name, "archive_obj", &b->samples);
+    free(inserted);
+    destroy_entity_value(ev);
+}
+
+/* -- MAIN -- */
+
+int
+main(int argc, const char** argv)
+{
+    struct arg_file* model =
+      arg_file1(NULL, "model", "<file>", "Model filename");
+    struct arg_file* database = arg_file0(
+      NULL, "db", "<file>", "Database file. Default is \"bench.db\"");
+    database->filename[0] = "bench.db";
+    struct arg_lit* force =
+      arg_lit0(NULL, "force", "Replace the database file if it exists");
+    struct arg_int* rows =
+      arg_int0(NULL, "rows", "<rows>", "Generated records per root entity");
+    rows->ival[0] = 1000;
+    struct arg_int* seed =
+      arg_int0(NULL, "seed", "<n>", "Seed of the generated records");
+    seed->ival[0] = 1;
+    struct arg_int* iterations =
+      arg_int0(NULL, "iterations", "<n>", "Samples per operation");
+    iterations->ival[0] = 200;
+    struct arg_str* as_of = arg_str0(
+      NULL, "as-of", "<YYYY-MM-DD>", "Last day of the generated dates");
+    as_of->sval[0] = GENERATE_LAST_DAY;
+    add_base_args();
+    arg_append(model);
+    arg_append(database);
+    arg_append(force);
+    arg_append(rows);
+    arg_append(seed);
+    arg_append(iterations);
+    arg_append(as_of);
+    parse_all_args(argc, argv, "Benchmarks the query layer on a model");
+
+    int exit_code = 1;
+    g_title       = sdsnew("TURBOBUILDER");
+    if $iserror (parse_model_file(model->filename[0], true)) goto cleanup_args;
+    if $iserror (compile_query_plans()) goto cleanup_model;
+    // Generated dates end on the as-of day, rolling windows have to end on
+    // it as well to sample any of them.
+    wrapped_time_t wt = parse_date_field(as_of->sval[0]);
+    if $iserror (wt.status) {
+        fprintf(stderr, "invalid --as-of date %s\n", as_of->sval[0]);
+        goto cleanup_model;
+    }
+    set_as_of_date(wt.v);
+
+    struct bench b = { .iterations = iterations->ival[0],
+                       .state      = ((uint64_t)seed->ival[0] << 1) | 1 };
+    b.samples.us   = calloc(b.iterations, sizeof(double));
+    // Records are generated into a fresh database, an existing file is only
+    // replaced when asked to.
+    const char* filename = database->filename[0];
+    if (access(filename, F_OK) == 0) {
+        if (force->count == 0) {
+            fprintf(stderr, "%s exists, use --force to replace it\n", filename);
+            goto cleanup_db;
+        }
+        sds journal = sdscatprintf(sdsempty(), "%s-wal", filename);
+        remove(journal);
+        sdsclear(journal);
+        journal = sdscatprintf(journal, "%s-shm", filename);
+        remove(journal);
+        sdsfree(journal);
+        remove(filename);
+    }
+    if (sqlite3_open(filename, &b.db) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(b.db));
+        goto cleanup_db;
+    }
+    wrapped_storage_profile wp = find_storage_profile("interactive");
+    if $iserror (apply_storage_profile(b.db, &wp.v)) goto cleanup_db;
+    if $iserror (create_tables_from_model(b.db)) goto cleanup_db;
+    watch_ref_values(b.db);
+
+    double       start = now_us();
+    wrapped_rows wr =
+      generate_records(b.db, rows->ival[0], seed->ival[0], NULL, 0);
+    $onerror(wr) goto cleanup_db;
+    printf("{\n  \"model\": \"%s\",\n  \"seed\": %d,\n  \"records\": %d,\n"
+           "  \"generate_rows_per_sec\": %.0f,\n  \"results\": [",
+           model->filename[0],
+           seed->ival[0],
+           wr.v,
+           wr.v * 1e6 / (now_us() - start));
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        int keys = count_keys(&b, e->name);
+        bench_list(&b, e, "");
+        bench_list(&b, e, "1");
+        bench_obj(&b, e, keys);
+        bench_ref(&b, e);
+        bench_forms(&b, e, keys);
+    }
+    printf("\n  ]\n}\n");
+    exit_code = 0;
+
+cleanup_db:
+    stop_storage_checkpoints();
+    finalize_stmt_cache(b.db);
+    sqlite3_close(b.db);
+    clear_ref_cache();
+    free(b.samples.us);
+cleanup_model:
+    cleanup_query_plans();
+    cleanup_translations(g_translations);
+    cleanup_entities(g_entities);
+cleanup_args:
+    sdsfree(g_title);
+    arg_freeall();
+    return exit_code;
+}
@@ -8,17 +8,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #include "newt.h"
 #include "newt_pr.h"
 
 
-/* Linked list of items in the listbox */
+/* Array of items in the listbox */
 struct items {
     char * text;
     const void *data;
     unsigned char isSelected;
-    struct items *next;
+    unsigned char isBorrowed; /* text is owned by the caller */
 };
 
 /* Holds all the relevant information for this listbox */
@@ -36,6 +37,10 @@ struct listbox {
 		     to do things even when they are supposed to be for
 		     another button/whatever */
     struct items *boxItems;
+    int itemsAlloced;
+    int *keyIndex; /* open addressing table of item indexes, by data */
+    int keyIndexSize;
+    int keyIndexStale; /* set when items moved, rebuilt on next lookup */
     int grow;
     int flags; /* flags for this listbox, right now just
 		  NEWT_FLAG_RETURNEXIT */
@@ -49,6 +54,7 @@ static void listboxPlace(newtComponent co, int newLeft, int newTop);
 static inline void updateWidth(newtComponent co, struct listbox * li,
 				int maxField);
 static void listboxMapped(newtComponent co, int isMapped);
+static int keyIndexFind(struct listbox * li, const void * key);
 
 static struct componentOps listboxOps = {
     listboxDraw,
@@ -90,6 +96,10 @@ newtComponent newtListbox(int left, int top, int height, int flags) {
     }
 
     li->boxItems = NULL;
+    li->itemsAlloced = 0;
+    li->keyIndex = NULL;
+    li->keyIndexSize = 0;
+    li->keyIndexStale = 0;
     li->numItems = 0;
     li->currItem = 0;
     li->numSelected = 0;
@@ -149,16 +159,83 @@ static inline void updateWidth(newtComponent co, struct listbox * li,
 	li->sb->left = co->left + co->width - li->bdxAdjust - 1;
 }
 
+static inline unsigned int keyHash(const void * key, int size) {
+    return ((uintptr_t)key * 2654435761u) & (size - 1);
+}
+
+/* Adds item num to the key index, keeping the first item for duplicate
+   keys like the linear lookups used to. */
+static void keyIndexAdd(struct listbox * li, int num) {
+    unsigned int h = keyHash(li->boxItems[num].data, li->keyIndexSize);
+
+    while (li->keyIndex[h] != -1) {
+	if (li->boxItems[li->keyIndex[h]].data == li->boxItems[num].data)
+	    return;
+	h = (h + 1) & (li->keyIndexSize - 1);
+    }
+    li->keyIndex[h] = num;
+}
+
+static void keyIndexRebuild(struct listbox * li) {
+    int i, size = 16;
+
+    while (size < li->numItems * 2)
+	size *= 2;
+    if (size != li->keyIndexSize) {
+	free(li->keyIndex);
+	li->keyIndex = malloc(size * sizeof(int));
+	li->keyIndexSize = size;
+    }
+    for (i = 0; i < size; i++)
+	li->keyIndex[i] = -1;
+    for (i = 0; i < li->numItems; i++)
+	keyIndexAdd(li, i);
+    li->keyIndexStale = 0;
+}
+
+static int keyIndexFind(struct listbox * li, const void * key) {
+    unsigned int h;
+
+    if (li->keyIndexStale || li->keyIndex == NULL)
+	keyIndexRebuild(li);
+
+    h = keyHash(key, li->keyIndexSize);
+    while (li->keyIndex[h] != -1) {
+	if (li->boxItems[li->keyIndex[h]].data == key)
+	    return li->keyIndex[h];
+	h = (h + 1) & (li->keyIndexSize - 1);
+    }
+    return -1;
+}
+
+static void itemFreeText(struct items * item) {
+    if (!item->isBorrowed)
+	free(item->text);
+}
+
+/* Makes room for one more item, returns the new item at position num */
+static struct items * itemsInsert(struct listbox * li, int num) {
+    if (li->numItems == li->itemsAlloced) {
+	li->itemsAlloced = li->itemsAlloced ? li->itemsAlloced * 2 : 16;
+	li->boxItems = realloc(li->boxItems,
+			       li->itemsAlloced * sizeof(struct items));
+    }
+    if (num < li->numItems) {
+	memmove(li->boxItems + num + 1, li->boxItems + num,
+		(li->numItems - num) * sizeof(struct items));
+	li->keyIndexStale = 1;
+    }
+    li->numItems++;
+    return li->boxItems + num;
+}
+
 void newtListboxSetCurrentByKey(newtComponent co, void * key) {
     struct listbox * li = co->data;
-    struct items * item;
     int i;
 
-    item = li->boxItems, i = 0;
-    while (item && item->data != key)
-	item = item->next, i++;
+    i = keyIndexFind(li, key);
 
-    if (item)
+    if (i >= 0)
 	newtListboxSetCurrent(co, i);
 }
 
@@ -208,14 +285,9 @@ void newtListboxSetWidth(newtComponent co, int width) {
 
 void * newtListboxGetCurrent(newtComponent co) {
     struct listbox * li = co->data;
-    int i;
-    struct items *item;
-
-    for(i = 0, item = li->boxItems; item != NULL && i < li->currItem;
-	i++, item = item->next);
 
-    if (item)
-	return (void *)item->data;
+    if (li->currItem >= 0 && li->currItem < li->numItems)
+	return (void *)li->boxItems[li->currItem].data;
     else
 	return NULL;
 }
@@ -227,11 +299,10 @@ void newtListboxSelectItem(newtComponent co, const void * key,
     int i;
     struct items * item;
 
-    item = li->boxItems, i = 0;
-    while (item && item->data != key)
-	item = item->next, i++;
+    i = keyIndexFind(li, key);
 
-    if (!item) return;
+    if (i < 0) return;
+    item = li->boxItems + i;
 
     if (item->isSelected)
 	li->numSelected--;
@@ -253,12 +324,11 @@ void newtListboxSelectItem(newtComponent co, const void * key,
 
 void newtListboxClearSelection(newtComponent co)
 {
-    struct items *item;
     struct listbox * li = co->data;
+    int i;
 
-    for(item = li->boxItems; item != NULL;
-	item = item->next)
-	item->isSelected = 0;
+    for(i = 0; i < li->numItems; i++)
+	li->boxItems[i].isSelected = 0;
     li->numSelected = 0;
     listboxDraw(co);
 }
@@ -267,9 +337,8 @@ void newtListboxClearSelection(newtComponent co)
 void ** newtListboxGetSelection(newtComponent co, int *numitems)
 {
     struct listbox * li;
-    int i;
+    int i, j;
     void **retval;
-    struct items *item;
 
     if(!co || !numitems) return NULL;
 
@@ -277,27 +346,24 @@ void ** newtListboxGetSelection(newtComponent co, int *numitems)
     if(!li || !li->numSelected) return NULL;
 
     retval = malloc(li->numSelected * sizeof(void *));
-    for(i = 0, item = li->boxItems; item != NULL;
-	item = item->next)
-	if(item->isSelected)
-	    retval[i++] = (void *)item->data;
+    for(i = 0, j = 0; j < li->numItems; j++)
+	if(li->boxItems[j].isSelected)
+	    retval[i++] = (void *)li->boxItems[j].data;
     *numitems = li->numSelected;
     return retval;
 }
 
 void newtListboxSetEntry(newtComponent co, int num, const char * text) {
     struct listbox * li = co->data;
-    int i;
     struct items *item;
 
-    for(i = 0, item = li->boxItems; item != NULL && i < num;
-	i++, item = item->next);
-
-    if(!item)
+    if(num < 0 || num >= li->numItems)
 	return;
     else {
-	free(item->text);
+	item = li->boxItems + num;
+	itemFreeText(item);
 	item->text = strdup(text);
+	item->isBorrowed = 0;
     }
     if (li->userHasSetWidth == 0 && wstrlen(text,-1) > li->curWidth) {
 	updateWidth(co, li, wstrlen(text,-1));
@@ -309,78 +375,78 @@ void newtListboxSetEntry(newtComponent co, int num, const char * text) {
 
 void newtListboxSetData(newtComponent co, int num, void * data) {
     struct listbox * li = co->data;
-    int i;
-    struct items *item;
 
-    for(i = 0, item = li->boxItems; item != NULL && i < num;
-	i++, item = item->next);
-
-    if (item)
-	item->data = data;
+    if (num >= 0 && num < li->numItems) {
+	li->boxItems[num].data = data;
+	li->keyIndexStale = 1;
+    }
 }
 
-int newtListboxAppendEntry(newtComponent co, const char * text,
-	                const void * data) {
+static int listboxAppend(newtComponent co, char * text, const void * data,
+			 unsigned char borrowed) {
     struct listbox * li = co->data;
     struct items *item;
 
-    if(li->boxItems) {
-	for (item = li->boxItems; item->next != NULL; item = item->next);
-
-	item = item->next = malloc(sizeof(struct items));
-    } else {
-	item = li->boxItems = malloc(sizeof(struct items));
-    }
+    item = itemsInsert(li, li->numItems);
 
     if (!li->userHasSetWidth && text && (wstrlen(text,-1) > li->curWidth))
 	updateWidth(co, li, wstrlen(text,-1));
 
-    item->text = strdup(text); item->data = data; item->next = NULL;
+    item->text = text; item->data = data;
     item->isSelected = 0;
+    item->isBorrowed = borrowed;
 
     if (li->grow)
 	co->height++, li->curHeight++;
-    li->numItems++;
+
+    /* the key index is kept at most half full, past that it is rebuilt
+       larger on the next lookup */
+    if (!li->keyIndexStale && li->keyIndex &&
+	li->numItems * 2 <= li->keyIndexSize)
+	keyIndexAdd(li, li->numItems - 1);
+    else
+	li->keyIndexStale = 1;
 
     return 0;
 }
 
+int newtListboxAppendEntry(newtComponent co, const char * text,
+	                const void * data) {
+    return listboxAppend(co, strdup(text), data, 0);
+}
+
+/* The text is not copied, it must outlive the entry: until it is deleted,
+   the listbox is cleared or destroyed. */
+int newtListboxAppendBorrowedEntry(newtComponent co, const char * text,
+				   const void * data) {
+    return listboxAppend(co, (char *) text, data, 1);
+}
+
 int newtListboxInsertEntry(newtComponent co, const char * text,
 	                   const void * data, void * key) {
     struct listbox * li = co->data;
-    struct items *item, *t;
-
-    if (li->boxItems) {
-	if (key) {
-	    item = li->boxItems;
-	    while (item && item->data != key) item = item->next;
+    struct items *item;
+    int num = 0;
 
-	    if (!item) return 1;
+    if (key) {
+	if (li->numItems <= 0) return 1;
 
-	    t = item->next;
-	    item = item->next = malloc(sizeof(struct items));
-	    item->next = t;
-	} else {
-	    t = li->boxItems;
-	    item = li->boxItems = malloc(sizeof(struct items));
-	    item->next = t;
-	}
-    } else if (key) {
-	return 1;
-    } else {
-	item = li->boxItems = malloc(sizeof(struct items));
-	item->next = NULL;
+	num = keyIndexFind(li, key);
+	if (num < 0) return 1;
+	num++;
     }
+    item = itemsInsert(li, num);
+    li->keyIndexStale = 1;
 
     if (!li->userHasSetWidth && text && (wstrlen(text,-1) > li->curWidth))
 	updateWidth(co, li, wstrlen(text,-1));
 
     item->text = strdup(text?text:"(null)"); item->data = data;
     item->isSelected = 0;
+    item->isBorrowed = 0;
 
     if (li->sb)
 	li->sb->left = co->left + co->width - li->bdxAdjust - 1;
-    li->numItems++;
 
     listboxDraw(co);
 
@@ -389,38 +455,27 @@ int newtListboxInsertEntry(newtComponent co, const char * text,
 
 int newtListboxDeleteEntry(newtComponent co, void * key) {
     struct listbox * li = co->data;
-    int widest = 0, t;
-    struct items *item, *item2 = NULL;
+    int widest = 0, t, i;
     int num;
 
     if (li->boxItems == NULL || li->numItems <= 0)
 	return 0;
 
-    num = 0;
+    num = keyIndexFind(li, key);
 
-    item2 = NULL, item = li->boxItems;
-    while (item && item->data != key) {
-	item2 = item;
-	item = item->next;
-	num++;
-    }
-
-    if (!item)
+    if (num < 0)
 	return -1;
 
-    if (item2)
-	item2->next = item->next;
-    else
-	li->boxItems = item->next;
-
-    free(item->text);
-    free(item);
+    itemFreeText(li->boxItems + num);
+    memmove(li->boxItems + num, li->boxItems + num + 1,
+	    (li->numItems - num - 1) * sizeof(struct items));
     li->numItems--;
+    li->keyIndexStale = 1;
 
     if (!li->userHasSetWidth) {
 	widest = 0;
-	for (item = li->boxItems; item != NULL; item = item->next)
-	    if ((t = wstrlen(item->text,-1)) > widest) widest = t;
+	for (i = 0; i < li->numItems; i++)
+	    if ((t = wstrlen(li->boxItems[i].text,-1)) > widest) widest = t;
     }
 
     if (li->currItem >= num)
@@ -438,16 +493,13 @@ int newtListboxDeleteEntry(newtComponent co, void * key) {
 void newtListboxClear(newtComponent co)
 {
     struct listbox * li;
-    struct items *anitem, *nextitem;
+    int i;
     if(co == NULL || (li = co->data) == NULL)
 	return;
-    for(anitem = li->boxItems; anitem != NULL; anitem = nextitem) {
-	nextitem = anitem->next;
-	free(anitem->text);
-	free(anitem);
-    }
+    for(i = 0; i < li->numItems; i++)
+	itemFreeText(li->boxItems + i);
     li->numItems = li->numSelected = li->currItem = li->startShowItem = 0;
-    li->boxItems = NULL;
+    li->keyIndexStale = 1;
     if (!li->userHasSetWidth)
 	updateWidth(co, li, 5);
 }
@@ -462,10 +514,8 @@ int newtListboxItemCount(newtComponent co)
    goes for the data. */
 void newtListboxGetEntry(newtComponent co, int num, char **text, void **data) {
     struct listbox * li = co->data;
-    int i;
-    struct items *item;
 
-    if (!li->boxItems || num >= li->numItems) {
+    if (!li->boxItems || num < 0 || num >= li->numItems) {
 	if(text)
 	    *text = NULL;
 	if(data)
@@ -473,18 +523,10 @@ void newtListboxGetEntry(newtComponent co, int num, char **text, void **data) {
 	return;
     }
 
-    i = 0;
-    item = li->boxItems;
-    while (item && i < num) {
-	i++, item = item->next;
-    }
-
-    if (item) {
-	if (text)
-	    *text = item->text;
-	if (data)
-	    *data = (void *)item->data;
-    }
+    if (text)
+	*text = li->boxItems[num].text;
+    if (data)
+	*data = (void *)li->boxItems[num].data;
 }
 
 static void listboxDraw(newtComponent co)
@@ -511,12 +553,10 @@ static void listboxDraw(newtComponent co)
 
     SLsmg_set_color(NEWT_COLORSET_LISTBOX);
 
-    for(i = 0, item = li->boxItems; item != NULL && i < li->startShowItem;
-	i++, item = item->next);
-
-    j = i;
+    j = li->startShowItem;
 
-    for (i = 0; item != NULL && i < li->curHeight; i++, item = item->next) {
+    for (i = 0; j + i < li->numItems && i < li->curHeight; i++) {
+	item = li->boxItems + j + i;
 	if (!item->text) continue;
 
 	newtGotorc(co->top + i + li->bdyAdjust, co->left + li->bdxAdjust);
@@ -649,20 +689,19 @@ static struct eventResult listboxEvent(newtComponent co, struct event ev) {
 	  default:
 	      if (li->numItems <= 0) break;
               if (ev.u.key < NEWT_KEY_EXTRA_BASE && isalpha(ev.u.key)) {
-		  for(i = 0, item = li->boxItems; item != NULL &&
-			  i < li->currItem; i++, item = item->next);
+		  i = li->currItem;
+		  item = i < li->numItems ? li->boxItems + i : NULL;
 
 		  if (item && item->text && (toupper(*item->text) == toupper(ev.u.key))) {
-		      item = item->next;
 		      i++;
 		  } else { 
-		      item = li->boxItems;
 		      i = 0;
 		  }
+		  item = i < li->numItems ? li->boxItems + i : NULL;
 		  while (item && item->text &&
 			 toupper(*item->text) != toupper(ev.u.key)) {
-		      item = item->next;
 		      i++;
+		      item = i < li->numItems ? li->boxItems + i : NULL;
 		  }
 		  if (item) {
 		      li->currItem = i;
@@ -756,16 +795,12 @@ static struct eventResult listboxEvent(newtComponent co, struct event ev) {
 
 static void listboxDestroy(newtComponent co) {
     struct listbox * li = co->data;
-    struct items * item, * nextitem;
-
-    nextitem = item = li->boxItems;
+    int i;
 
-    while (item != NULL) {
-	nextitem = item->next;
-	free(item->text);
-	free(item);
-	item = nextitem;
-    }
+    for (i = 0; i < li->numItems; i++)
+	itemFreeText(li->boxItems + i);
+    free(li->boxItems);
+    free(li->keyIndex);
 
     if (li->sb) li->sb->ops->destroy(li->sb);
 
@@ -172,6 +172,9 @@ void newtListboxSetWidth(newtComponent co, int width);
 void newtListboxSetData(newtComponent co, int num, void * data);
 int newtListboxAppendEntry(newtComponent co, const char * text, 
 			   const void * data);
+/* Appends without copying text, which must outlive the entry */
+int newtListboxAppendBorrowedEntry(newtComponent co, const char * text,
+				   const void * data);
 /* Send the key to insert after, or NULL to insert at the top */
 int newtListboxInsertEntry(newtComponent co, const char * text, const void * data, void * key);
 int newtListboxDeleteEntry(newtComponent co, void * data);
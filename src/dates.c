@@ -0,0 +1,167 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dates.h"
+
+/* UTC offsets of the local time zone at the start of every month from
+ * ZONE_FIRST_YEAR on, looked up once, as zones change theirs over the
+ * years and not only for daylight saving time. */
+#define ZONE_FIRST_YEAR 1900
+#define ZONE_MONTHS (300 * 12)
+
+static int32_t        g_zone[ZONE_MONTHS + 1];
+static pthread_once_t g_zone_once = PTHREAD_ONCE_INIT;
+
+static int64_t
+days_from_civil(int64_t y, int m, int d);
+
+static void
+init_local_zone()
+{
+    for (int i = 0; i <= ZONE_MONTHS; i++) {
+        struct tm tm;
+        time_t    t = days_from_civil(ZONE_FIRST_YEAR + i / 12, i % 12 + 1, 1) *
+                   SECONDS_PER_DAY;
+        localtime_r(&t, &tm);
+        g_zone[i] = tm.tm_gmtoff;
+    }
+}
+
+/* Returns the offset of the month, or false if it changes by more than
+ * daylight saving time ever does before the next one or the month is out
+ * of the table. */
+static bool
+find_zone_offset(int64_t y, int m, long* offset)
+{
+    int64_t i = (y - ZONE_FIRST_YEAR) * 12 + m - 1;
+    pthread_once(&g_zone_once, init_local_zone);
+    if (i < 0 || i >= ZONE_MONTHS) return false;
+    *offset = g_zone[i];
+    return labs(g_zone[i + 1] - g_zone[i]) < SECONDS_PER_DAY / 4;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date, and back. Years are
+ * shifted to start in March so that leap days end them. */
+static int64_t
+days_from_civil(int64_t y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void
+civil_from_days(int64_t z, int64_t* y, int* m, int* d)
+{
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp  = (5 * doy + 2) / 153;
+    *d          = doy - (153 * mp + 2) / 5 + 1;
+    *m          = mp < 10 ? mp + 3 : mp - 9;
+    *y          = yoe + era * 400 + (*m <= 2);
+}
+
+static int64_t
+floor_div(int64_t a, int64_t b)
+{
+    return a / b - (a % b < 0);
+}
+
+static char*
+put_digits(char* p, int64_t v, int n)
+{
+    for (int i = n - 1; i >= 0; i--, v /= 10) p[i] = '0' + v % 10;
+    return p + n;
+}
+
+static const char*
+get_digits(const char* p, int max, int* v)
+{
+    int n = 0;
+    *v    = 0;
+    while (n < max && p[n] >= '0' && p[n] <= '9') *v = *v * 10 + p[n++] - '0';
+    return n > 0 ? p + n : NULL;
+}
+
+/* -- DATE CODEC -- */
+
+int
+format_date(time_t t, char* buf)
+{
+    // Midnights are off by an hour or two from the month's offset once
+    // daylight saving time starts or ends, so days are rounded to the
+    // nearest one rather than truncated.
+    int64_t y;
+    int     m, d;
+    long    offset;
+    civil_from_days(floor_div(t, SECONDS_PER_DAY), &y, &m, &d);
+    if (!find_zone_offset(y, m, &offset)) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        offset = tm.tm_gmtoff;
+    }
+    int64_t local = (int64_t)t + offset + SECONDS_PER_DAY / 2;
+    civil_from_days(floor_div(local, SECONDS_PER_DAY), &y, &m, &d);
+    if (y < 0 || y > 9999) y = 0;
+    char* p = put_digits(buf, y, 4);
+    *p++    = '-';
+    p       = put_digits(p, m, 2);
+    *p++    = '-';
+    p       = put_digits(p, d, 2);
+    *p      = '\0';
+    return p - buf;
+}
+
+int
+parse_date(const char* str, time_t* t)
+{
+    int  y, m, d;
+    long offset = 0;
+    while (*str == ' ') str++;
+    if ((str = get_digits(str, 4, &y)) == NULL || *str++ != '-' ||
+        (str = get_digits(str, 2, &m)) == NULL || *str++ != '-' ||
+        (str = get_digits(str, 2, &d)) == NULL || m < 1 || m > 12 || d < 1) {
+        return -1;
+    }
+    // Stored dates must match exactly, so the month's offset is checked
+    // against the one in effect at that midnight. Midnights skipped by
+    // daylight saving time resolve to the end of the gap, as mktime() does.
+    int64_t utc = days_from_civil(y, m, d) * SECONDS_PER_DAY;
+    find_zone_offset(y, m, &offset);
+    struct tm tm;
+    *t = utc - offset;
+    localtime_r(t, &tm);
+    if (tm.tm_gmtoff != offset) {
+        time_t first = *t;
+        *t           = utc - tm.tm_gmtoff;
+        localtime_r(t, &tm);
+        if (utc - tm.tm_gmtoff != *t && first > *t) *t = first;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_DATES_H_
+#define _TURBOBUILDER_DATES_H_
+
+#include <time.h>
+
+#define SECONDS_PER_DAY 86400
+
+/* "YYYY-MM-DD" and its terminator. */
+#define DATE_TEXT_SIZE 11
+
+/* -- DATE CODEC -- */
+
+/* DATE fields hold the timestamp of the local midnight starting their day.
+ * Both functions work on the calendar in integer arithmetic, with the UTC
+ * offsets of the local time zone looked up once per process, and are safe
+ * to call from any thread. */
+
+/* Writes the date of a DATE value as YYYY-MM-DD and a terminator into buf,
+ * which holds at least DATE_TEXT_SIZE bytes, and returns its length. */
+int
+format_date(time_t t, char* buf);
+
+/* Parses YYYY-MM-DD into the DATE value of that day. Days past the end of
+ * the month carry over into the next one. Returns -1 on malformed text. */
+int
+parse_date(const char* str, time_t* t);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coastguard/coastguard.h"
+#include "core/iterators.h"
+#include "sds/sds.h"
+
+#include "export.h"
+#include "msql.h"
+
+typedef enum
+{
+    EXPORT_CSV,
+    EXPORT_TSV,
+    EXPORT_JSONL
+} export_format;
+
+/* -- OUTPUT BUFFER -- */
+
+/* Rows are formatted straight into a fixed buffer which is written out
+ * whenever it fills up. */
+struct export_buffer
+{
+    FILE*  out;
+    size_t len;
+    char   data[EXPORT_BUFFER_SIZE];
+};
+
+static void
+flush_export(struct export_buffer* b)
+{
+    fwrite(b->data, 1, b->len, b->out);
+    b->len = 0;
+}
+
+static void
+put_char(struct export_buffer* b, char c)
+{
+    if (b->len == EXPORT_BUFFER_SIZE) flush_export(b);
+    b->data[b->len++] = c;
+}
+
+static void
+put_bytes(struct export_buffer* b, const char* s, size_t n)
+{
+    while (n > 0) {
+        if (b->len == EXPORT_BUFFER_SIZE) flush_export(b);
+        size_t m = EXPORT_BUFFER_SIZE - b->len;
+        if (m > n) m = n;
+        memcpy(b->data + b->len, s, m);
+        b->len += m;
+        s += m;
+        n -= m;
+    }
+}
+
+static void
+put_delimited_text(struct export_buffer* b, const char* s, int n, char sep)
+{
+    // Values holding the separator, quotes or line breaks are quoted.
+    bool quote = false;
+    for (int i = 0; i < n && !quote; i++) {
+        quote = s[i] == sep || s[i] == '"' || s[i] == '\n' || s[i] == '\r';
+    }
+    if (!quote) {
+        put_bytes(b, s, n);
+        return;
+    }
+    put_char(b, '"');
+    for (int i = 0; i < n; i++) {
+        if (s[i] == '"') put_char(b, '"');
+        put_char(b, s[i]);
+    }
+    put_char(b, '"');
+}
+
+static void
+put_json_text(struct export_buffer* b, const char* s, int n)
+{
+    put_char(b, '"');
+    for (int i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            put_char(b, '\\');
+            put_char(b, c);
+        } else if (c == '\n') {
+            put_bytes(b, "\\n", 2);
+        } else if (c == '\r') {
+            put_bytes(b, "\\r", 2);
+        } else if (c == '\t') {
+            put_bytes(b, "\\t", 2);
+        } else if (c < 0x20) {
+            char esc[8];
+            put_bytes(b, esc, snprintf(esc, sizeof(esc), "\\u%04x", c));
+        } else {
+            put_char(b, c);
+        }
+    }
+    put_char(b, '"');
+}
+
+/* -- EXPORT -- */
+
+static void
+put_value(struct export_buffer* b,
+          export_format         format,
+          const struct field*   f,
+          sqlite3_stmt*         res,
+          int                   index)
+{
+    // Values are written the way the UI displays them, REF columns hold
+    // the value of the field they display.
+    const char* s;
+    int         n;
+    char        buf[64];
+    bool        text = false;
+    bool        json = format == EXPORT_JSONL;
+    if (sqlite3_column_type(res, index) == SQLITE_NULL) {
+        if (json) put_bytes(b, "null", 4);
+        return;
+    }
+    switch (f->type) {
+        case BOOLEAN:
+            s = sqlite3_column_int(res, index) ? (json ? "true" : "1")
+                                               : (json ? "false" : "0");
+            n = strlen(s);
+            break;
+        case DATE:
+            n    = format_date(sqlite3_column_int64(res, index), buf);
+            s    = buf;
+            text = true;
+            break;
+        case REAL:
+            n = snprintf(
+              buf, sizeof(buf), "%.2f", sqlite3_column_double(res, index));
+            s = buf;
+            break;
+        case AUTO:
+            n = snprintf(buf,
+                         sizeof(buf),
+                         f->format ? f->format : "%.2f",
+                         sqlite3_column_double(res, index));
+            s = buf;
+            break;
+        default:
+            // Numbers typed into a form may be stored as text.
+            text = f->type == TEXT ||
+                   sqlite3_column_type(res, index) == SQLITE_TEXT;
+            s    = (const char*)sqlite3_column_text(res, index);
+            n    = sqlite3_column_bytes(res, index);
+            break;
+    }
+    if (json && text) {
+        put_json_text(b, s, n);
+    } else if (json) {
+        put_bytes(b, s, n);
+    } else {
+        put_delimited_text(b, s, n, format == EXPORT_TSV ? '\t' : ',');
+    }
+}
+
+wrapped_rows
+export_records(sqlite3*       db,
+               struct entity* e,
+               const char*    format,
+               FILE*          out)
+{
+    wrapped_rows  ret = { 0 };
+    export_format fmt;
+    if (strcmp(format, "csv") == 0) {
+        fmt = EXPORT_CSV;
+    } else if (strcmp(format, "tsv") == 0) {
+        fmt = EXPORT_TSV;
+    } else if (strcmp(format, "jsonl") == 0) {
+        fmt = EXPORT_JSONL;
+    } else {
+        return $invalid(wrapped_rows, "unknown export format");
+    }
+    char sep = fmt == EXPORT_TSV ? '\t' : ',';
+
+    struct export_buffer* b   = NULL;
+    sqlite3_stmt*         res = NULL;
+    wrapped_sql           sql = build_export_query(e);
+    $inspect(sql, ret.status, cleanup);
+    if (sqlite3_prepare_v2(db, sql.v, -1, &res, 0) != SQLITE_OK) {
+        $log_error("%s", sqlite3_errmsg(db));
+        ret = $invalid(wrapped_rows, "unable to prepare export query");
+        goto cleanup;
+    }
+    bind_as_of_date(res);
+
+    b      = malloc(sizeof(struct export_buffer));
+    b->out = out;
+    b->len = 0;
+    if (fmt != EXPORT_JSONL) {
+        bool first = true;
+        $foreach_field(f, e)
+        {
+            if (!first) put_char(b, sep);
+            put_delimited_text(b, f->name, strlen(f->name), sep);
+            first = false;
+        }
+        put_char(b, '\n');
+    }
+
+    // The Id leads the columns, the fields follow in declaration order.
+    int rows = 0;
+    int rc;
+    while ((rc = sqlite3_step(res)) == SQLITE_ROW) {
+        int index = 1;
+        if (fmt == EXPORT_JSONL) put_char(b, '{');
+        $foreach_field(f, e)
+        {
+            if (index > 1) put_char(b, fmt == EXPORT_JSONL ? ',' : sep);
+            if (fmt == EXPORT_JSONL) {
+                put_json_text(b, f->name, strlen(f->name));
+                put_char(b, ':');
+            }
+            const struct field_plan* fp = find_field_plan(e, f);
+            put_value(b,
+                      fmt,
+                      fp->value_field ? fp->value_field : f,
+                      res,
+                      index++);
+        }
+        if (fmt == EXPORT_JSONL) put_char(b, '}');
+        put_char(b, '\n');
+        rows++;
+    }
+    flush_export(b);
+    if (rc != SQLITE_DONE) {
+        $log_error("%s", sqlite3_errmsg(db));
+        ret = $invalid(wrapped_rows, "unable to read records");
+    } else if (ferror(out)) {
+        ret = $invalid(wrapped_rows, "unable to write records");
+    } else {
+        ret = (wrapped_rows){ rows };
+    }
+cleanup:
+    free(b);
+    sqlite3_finalize(res);
+    sdsfree(sql.v);
+    return ret;
+}
@@ -0,0 +1,42 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_EXPORT_H_
+#define _TURBOBUILDER_EXPORT_H_
+
+#include <stdio.h>
+
+#include "coastguard/coastguard.h"
+#include "sqlite/sqlite3.h"
+
+#include "msql.h"
+
+#define EXPORT_BUFFER_SIZE 65536
+
+/* -- EXPORT -- */
+
+/* Writes every active record of the entity to out as CSV, TSV or JSONL and
+ * returns the number of records written. REF fields are written as the
+ * value they display and AUTO fields are computed, rows are formatted into
+ * a fixed buffer so memory use does not grow with the table. */
+wrapped_rows
+export_records(sqlite3*       db,
+               struct entity* e,
+               const char*    format,
+               FILE*          out);
+
+#endif
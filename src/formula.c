@@ -0,0 +1,746 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coastguard/coastguard.h"
+#include "core/iterators.h"
+#include "sds/sds.h"
+
+#include "formula.h"
+#include "model.h"
+#include "msql.h"
+
+/* Every entity a formula visits gets its own scope, so a formula can read
+ * from the same table at different levels without ambiguous columns. */
+struct formula_scope
+{
+    struct entity*       e;
+    sds                  alias;
+    int                  n_steps;
+    struct formula_step  steps[MAX_FORMULA_DEPTH];
+    struct formula_from* from;
+    const char*          ids;
+};
+
+struct formula_compiler
+{
+    struct formula* fm;
+    int             next_alias;
+    bool            batch;
+};
+
+/* Batches compute a formula for a whole set of rows with joins instead of
+ * correlated subqueries. Every REF field is joined once per FROM clause and
+ * every aggregated relation becomes a single grouped derived table, shared
+ * by all the aggregates over the same rows. */
+struct formula_ref
+{
+    sds            key;
+    sds            alias;
+    sds            ids;
+    struct entity* e;
+};
+
+struct formula_from
+{
+    sds                    joins;
+    int                    n_refs;
+    struct formula_ref*    refs;
+    int                    n_groups;
+    struct formula_group** groups;
+};
+
+struct formula_group
+{
+    sds                  key;
+    sds                  alias;
+    sds                  parent;
+    sds                  outer;
+    const char*          outer_ids;
+    const char*          fk;
+    sds                  ids;
+    sds                  where;
+    int                  n_columns;
+    sds*                 columns;
+    struct formula_from  from;
+    struct formula_scope child;
+};
+
+struct formula_batch
+{
+    sds                     ids;
+    struct formula_from     from;
+    struct formula_compiler c;
+};
+
+static wrapped_sql
+compile_func(struct formula_compiler*    c,
+             const struct formula_scope* s,
+             struct func*                f);
+
+static wrapped_sql
+compile_batch_ref(struct formula_compiler*    c,
+                  const struct formula_scope* s,
+                  struct field*               rf,
+                  const char*                 name);
+
+static wrapped_sql
+compile_batch_agg(struct formula_compiler*    c,
+                  const struct formula_scope* s,
+                  struct func*                f,
+                  struct relation*            r);
+
+/* -- DEPENDENCIES -- */
+
+static bool
+same_steps(const struct formula_dep* d, const struct formula_scope* s)
+{
+    if (d->e != s->e || d->n_steps != s->n_steps) return false;
+    for (int i = 0; i < s->n_steps; i++) {
+        if (d->steps[i].child != s->steps[i].child ||
+            d->steps[i].to != s->steps[i].to ||
+            strcmp(d->steps[i].column, s->steps[i].column) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void
+add_dep(struct formula_compiler*    c,
+        const struct formula_scope* s,
+        const char*                 column)
+{
+    struct formula*     fm = c->fm;
+    struct formula_dep* d  = NULL;
+    if (fm == NULL) return;
+    for (int i = 0; i < fm->n_deps && d == NULL; i++) {
+        if (same_steps(&fm->deps[i], s)) d = &fm->deps[i];
+    }
+    if (d == NULL) {
+        fm->deps = realloc(fm->deps, (fm->n_deps + 1) * sizeof(*fm->deps));
+        d        = &fm->deps[fm->n_deps++];
+        *d       = (struct formula_dep){ .e = s->e, .n_steps = s->n_steps };
+        memcpy(d->steps, s->steps, s->n_steps * sizeof(struct formula_step));
+    }
+    for (int i = 0; i < d->n_columns; i++) {
+        if (strcmp(d->columns[i], column) == 0) return;
+    }
+    d->columns = realloc(d->columns, (d->n_columns + 1) * sizeof(char*));
+    d->columns[d->n_columns++] = column;
+}
+
+static $status
+enter_scope(struct formula_compiler*    c,
+            const struct formula_scope* s,
+            struct formula_scope*       next,
+            bool                        child,
+            struct entity*              to,
+            const char*                 column)
+{
+    $check(s->n_steps < MAX_FORMULA_DEPTH, "formula nested too deep", error);
+    $check(to != NULL, error);
+    *next       = *s;
+    next->e     = to;
+    next->alias = sdscatprintf(sdsempty(), "[t%d]", c->next_alias++);
+    next->steps[next->n_steps++] =
+      (struct formula_step){ child, s->e, to, column };
+    return $okay;
+error:
+    return $error("unable to resolve formula reference");
+}
+
+sds
+formula_affected_ids(const struct formula_dep* d, const char* row)
+{
+    // Walks the steps back from the changed row to the rows of the entity
+    // owning the formula, the last step reads the changed row directly.
+    sds ids = sdscatprintf(sdsempty(), "%s.Id", row);
+    for (int i = d->n_steps - 1; i >= 0; i--) {
+        const struct formula_step* step = &d->steps[i];
+        sds                        next;
+        if (step->child && i == d->n_steps - 1) {
+            next = sdscatprintf(sdsempty(), "%s.[%s]", row, step->column);
+        } else if (step->child) {
+            next = sdscatprintf(sdsempty(),
+                                "SELECT [%s] FROM [%ss] WHERE Id IN (%s)",
+                                step->column,
+                                step->to->name,
+                                ids);
+        } else {
+            next = sdscatprintf(sdsempty(),
+                                "SELECT Id FROM [%ss] WHERE [%s] IN (%s)",
+                                step->from->name,
+                                step->column,
+                                ids);
+        }
+        sdsfree(ids);
+        ids = next;
+    }
+    return ids;
+}
+
+/* -- EXPRESSIONS -- */
+
+static wrapped_sql
+compile_field_value(struct formula_compiler*    c,
+                    const struct formula_scope* s,
+                    const char*                 name)
+{
+    struct field* f;
+    $check(find_field(s->e->fields, name, &f) == 0, error);
+    if (f->type == AUTO && f->materialized == false) {
+        return compile_func(c, s, f->autofunc);
+    }
+    add_dep(c, s, f->name);
+    return (wrapped_sql){ sdscatprintf(
+      sdsempty(), "%s.[%s]", s->alias, f->name) };
+error:
+    $log_error("unknown field %s.%s in formula", s->e->name, name);
+    return $invalid(wrapped_sql);
+}
+
+static wrapped_sql
+compile_ref(struct formula_compiler*    c,
+            const struct formula_scope* s,
+            struct field*               rf,
+            const char*                 name)
+{
+    // A reference through a REF field reads a single row of the referenced
+    // entity.
+    struct formula_scope next = { 0 };
+    wrapped_sql          value;
+    if (c->batch) return compile_batch_ref(c, s, rf, name);
+    $onerror2(enter_scope(c, s, &next, false, rf->ref.entity, rf->name))
+    {
+        goto error;
+    }
+    add_dep(c, s, rf->name);
+    value = compile_field_value(c, &next, name);
+    $inspect(value, error);
+    sds sql = sdscatprintf(sdsempty(),
+                           "(SELECT %s FROM [%ss] AS %s WHERE %s.Id = %s.[%s])",
+                           value.v,
+                           next.e->name,
+                           next.alias,
+                           next.alias,
+                           s->alias,
+                           rf->name);
+    sdsfree(value.v);
+    sdsfree(next.alias);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(next.alias);
+    return $invalid(wrapped_sql);
+}
+
+static wrapped_sql
+compile_arg(struct formula_compiler*    c,
+            const struct formula_scope* s,
+            struct arg*                 arg)
+{
+    if (arg->type == ATFUNC) return compile_func(c, s, arg->atfunc);
+    if (arg->type == ATFIELD) return compile_field_value(c, s, arg->atfield);
+
+    $check(arg->ref != NULL, error);
+    return compile_ref(c, s, arg->ref, arg->atfield);
+error:
+    $log_error("%s.%s is not a field reference of %s",
+               arg->atentity,
+               arg->atfield,
+               s->e->name);
+    return $invalid(wrapped_sql);
+}
+
+static wrapped_sql
+compile_cond_arg(struct formula_compiler*    c,
+                 const struct formula_scope* s,
+                 const struct formula_scope* child,
+                 struct func*                f,
+                 struct arg*                 arg)
+{
+    // Condition arguments naming the aggregated relation are read from the
+    // aggregated rows, anything else from the formula's own row.
+    if (arg->type != ATREF ||
+        strcmp(arg->atentity, f->args[0]->atentity) != 0) {
+        return compile_arg(c, s, arg);
+    }
+    struct field* cf;
+    if (find_field(child->e->fields, arg->atfield, &cf) == 0) {
+        return compile_field_value(c, child, arg->atfield);
+    }
+
+    // The relation name may also stand for the [<Entity>s] table of a row
+    // the aggregated rows reference, e.g. Sessions.Date when aggregating
+    // the exercises of sessions.
+    $foreach_field(rf, child->e)
+    {
+        if (rf->type != REF) continue;
+        size_t len = strlen(rf->ref.eid);
+        if (strncmp(arg->atentity, rf->ref.eid, len) == 0 &&
+            strcmp(arg->atentity + len, "s") == 0) {
+            return compile_ref(c, child, rf, arg->atfield);
+        }
+    }
+    return compile_field_value(c, child, arg->atfield);
+}
+
+static bool
+is_child_arg(struct func* f, struct arg* arg)
+{
+    return arg->type == ATREF &&
+           strcmp(arg->atentity, f->args[0]->atentity) == 0;
+}
+
+static wrapped_sql
+compile_filter(struct formula_compiler*    c,
+               const struct formula_scope* s,
+               const struct formula_scope* child,
+               struct func*                f)
+{
+    wrapped_sql arg1 = { 0 }, arg2 = { 0 };
+    sds         sql  = NULL;
+    fkind       kind = FUNCS[f->op].kind;
+    if (kind == FUNC_AGG) return (wrapped_sql){ sdsempty() };
+    arg1 = compile_cond_arg(c, s, child, f, f->args[1]);
+    $inspect(arg1, error);
+    if (kind == FUNC_AGG_DAYS) {
+        sql = sdscatprintf(sdsempty(),
+                           " AND %s >= @as_of - %lld AND %s < @as_of + %d",
+                           arg1.v,
+                           atoll(f->args[2]->atfield) * SECONDS_PER_DAY,
+                           arg1.v,
+                           SECONDS_PER_DAY);
+    } else {
+        arg2 = compile_cond_arg(c, s, child, f, f->args[2]);
+        $inspect(arg2, error);
+        sql = sdscatprintf(sdsempty(), " AND %s = %s", arg1.v, arg2.v);
+    }
+    sdsfree(arg1.v);
+    sdsfree(arg2.v);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(arg1.v);
+    return $invalid(wrapped_sql);
+}
+
+static wrapped_sql
+compile_agg(struct formula_compiler*    c,
+            const struct formula_scope* s,
+            struct func*                f)
+{
+    struct formula_scope child = { 0 };
+    wrapped_sql          value = { 0 }, where = { 0 };
+    sds                  sql   = NULL;
+    struct arg*          arg   = f->args[0];
+    struct relation*     r     = arg->relation;
+    $check(arg->type == ATREF && r != NULL, error);
+    if (c->batch) return compile_batch_agg(c, s, f, r);
+
+    // Rolling windows depend on the current date, no row change would ever
+    // tell us to refresh them.
+    if (FUNCS[f->op].kind == FUNC_AGG_DAYS) {
+        $log_error("formula function %s cannot be compiled into a stored value",
+                   f->name);
+        return $invalid(wrapped_sql);
+    }
+    $onerror2(enter_scope(c, s, &child, true, r->fk.entity, r->fk.fid))
+    {
+        goto error;
+    }
+    add_dep(c, &child, r->fk.fid);
+    add_dep(c, &child, "_archived");
+    value = compile_field_value(c, &child, arg->atfield);
+    $inspect(value, error);
+    where = compile_filter(c, s, &child, f);
+    $inspect(where, error);
+    sql = sdscatprintf(sdsempty(),
+                       "(SELECT %s(%s) FROM [%ss] AS %s WHERE %s.[%s] = %s.Id "
+                       "AND %s._archived IS NULL%s)",
+                       FUNCS[f->op].sql,
+                       value.v,
+                       child.e->name,
+                       child.alias,
+                       child.alias,
+                       r->fk.fid,
+                       s->alias,
+                       child.alias,
+                       where.v);
+    sdsfree(value.v);
+    sdsfree(where.v);
+    sdsfree(child.alias);
+    return (wrapped_sql){ sql };
+error:
+    $log_error("%s.%s is not a relation field of %s",
+               arg->atentity,
+               arg->atfield,
+               s->e->name);
+    sdsfree(value.v);
+    sdsfree(child.alias);
+    return $invalid(wrapped_sql);
+}
+
+static wrapped_sql
+compile_op(struct formula_compiler*    c,
+           const struct formula_scope* s,
+           struct func*                f)
+{
+    wrapped_sql arg0 = compile_arg(c, s, f->args[0]);
+    $inspect(arg0, error);
+    wrapped_sql arg1 = compile_arg(c, s, f->args[1]);
+    $inspect(arg1, error);
+    sds sql = sdscatprintf(
+      sdsempty(), "(%s %s %s)", arg0.v, FUNCS[f->op].sql, arg1.v);
+    sdsfree(arg0.v);
+    sdsfree(arg1.v);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(arg0.v);
+    return $invalid(wrapped_sql);
+}
+
+static wrapped_sql
+compile_func(struct formula_compiler*    c,
+             const struct formula_scope* s,
+             struct func*                f)
+{
+    switch (FUNCS[f->op].kind) {
+        case FUNC_VALUE:
+            return compile_arg(c, s, f->args[0]);
+        case FUNC_ARITH:
+            return compile_op(c, s, f);
+        case FUNC_AGG:
+        case FUNC_AGG_EQ:
+        case FUNC_AGG_DAYS:
+            return compile_agg(c, s, f);
+        default:
+            break;
+    }
+
+    $log_error("unknown formula function %s", f->name);
+    return $invalid(wrapped_sql);
+}
+
+/* -- FORMULAS -- */
+
+wrapped_formula
+compile_formula(struct entity* e, struct field* f)
+{
+    struct formula*         fm   = calloc(1, sizeof(struct formula));
+    struct formula_compiler c    = { .fm = fm };
+    struct formula_scope    root = {
+        .e     = e,
+        .alias = sdscatprintf(sdsempty(), "[%ss]", e->name),
+    };
+    wrapped_sql sql = compile_func(&c, &root, f->autofunc);
+    sdsfree(root.alias);
+    $inspect(sql, error);
+    fm->sql = sql.v;
+    return (wrapped_formula){ fm };
+error:
+    $log_error("unable to compile formula of field %s.%s", e->name, f->name);
+    free_formula(fm);
+    return $invalid(wrapped_formula);
+}
+
+void
+free_formula(struct formula* fm)
+{
+    if (fm == NULL) return;
+    for (int i = 0; i < fm->n_deps; i++) {
+        free(fm->deps[i].columns);
+    }
+    free(fm->deps);
+    sdsfree(fm->sql);
+    free(fm);
+}
+
+/* -- BATCHES -- */
+
+static wrapped_sql
+compile_batch_ref(struct formula_compiler*    c,
+                  const struct formula_scope* s,
+                  struct field*               rf,
+                  const char*                 name)
+{
+    struct formula_from* from = s->from;
+    struct formula_ref*  ref  = NULL;
+    struct formula_scope next = { 0 };
+    sds key = sdscatprintf(sdsempty(), "%s.[%s]", s->alias, rf->name);
+    $onerror2(enter_scope(c, s, &next, false, rf->ref.entity, rf->name))
+    {
+        sdsfree(key);
+        return $invalid(wrapped_sql);
+    }
+    for (int i = 0; i < from->n_refs && ref == NULL; i++) {
+        if (strcmp(from->refs[i].key, key) == 0) ref = &from->refs[i];
+    }
+    if (ref == NULL) {
+        from->refs =
+          realloc(from->refs, (from->n_refs + 1) * sizeof(*from->refs));
+        ref  = &from->refs[from->n_refs++];
+        *ref = (struct formula_ref){
+            .key   = key,
+            .alias = next.alias,
+            .e     = next.e,
+            .ids   = sdscatprintf(sdsempty(),
+                                "SELECT [%s] FROM [%ss] WHERE Id IN (%s)",
+                                rf->name,
+                                s->e->name,
+                                s->ids),
+        };
+        from->joins = sdscatprintf(from->joins,
+                                   " LEFT JOIN [%ss] AS %s ON %s.Id = %s.[%s]",
+                                   next.e->name,
+                                   next.alias,
+                                   next.alias,
+                                   s->alias,
+                                   rf->name);
+    } else {
+        sdsfree(key);
+        sdsfree(next.alias);
+    }
+    next.alias = ref->alias;
+    next.from  = from;
+    next.ids   = ref->ids;
+    return compile_field_value(c, &next, name);
+}
+
+static sds
+describe_arg(sds key, struct arg* arg)
+{
+    if (arg->type == ATREF)
+        return sdscatprintf(key, " %s.%s", arg->atentity, arg->atfield);
+    if (arg->type == ATFIELD) return sdscatprintf(key, " %s", arg->atfield);
+    return sdscatprintf(key, " %p", (void*)arg->atfunc);
+}
+
+static struct formula_group*
+new_formula_group(struct formula_compiler*    c,
+                  const struct formula_scope* s,
+                  struct func*                f,
+                  struct relation*            r,
+                  sds                         key)
+{
+    struct formula_group* g = calloc(1, sizeof(struct formula_group));
+    $onerror2(enter_scope(c, s, &g->child, true, r->fk.entity, r->fk.fid))
+    {
+        free(g);
+        sdsfree(key);
+        return NULL;
+    }
+    g->key        = key;
+    g->alias      = sdscatprintf(sdsempty(), "[t%d]", c->next_alias++);
+    g->outer      = sdsdup(s->alias);
+    g->outer_ids  = s->ids;
+    g->fk         = r->fk.fid;
+    g->ids        = sdscatprintf(
+      sdsempty(),
+      "SELECT Id FROM [%ss] WHERE [%s] IN (%s) AND _archived IS NULL",
+      g->child.e->name,
+      g->fk,
+      s->ids);
+    g->from.joins = sdsempty();
+    g->child.from = &g->from;
+    g->child.ids  = g->ids;
+
+    // Filters reading the formula's own row join that row again inside the
+    // derived table, which cannot see the rows it is joined to.
+    struct formula_scope parent = *s;
+    fkind                kind   = FUNCS[f->op].kind;
+    if ((kind != FUNC_AGG && !is_child_arg(f, f->args[1])) ||
+        (kind == FUNC_AGG_EQ && !is_child_arg(f, f->args[2]))) {
+        g->parent = sdscatprintf(sdsempty(), "[t%d]", c->next_alias++);
+        g->from.joins =
+          sdscatprintf(g->from.joins,
+                       " INNER JOIN [%ss] AS %s ON %s.Id = %s.[%s]",
+                       s->e->name,
+                       g->parent,
+                       g->parent,
+                       g->child.alias,
+                       g->fk);
+        parent.alias = g->parent;
+        parent.from  = &g->from;
+    }
+    wrapped_sql where = compile_filter(c, &parent, &g->child, f);
+    g->where          = where.v;
+
+    struct formula_from* from = s->from;
+    from->groups =
+      realloc(from->groups, (from->n_groups + 1) * sizeof(*from->groups));
+    from->groups[from->n_groups++] = g;
+    $inspect(where, error);
+    return g;
+error:
+    return NULL;
+}
+
+static wrapped_sql
+compile_batch_agg(struct formula_compiler*    c,
+                  const struct formula_scope* s,
+                  struct func*                f,
+                  struct relation*            r)
+{
+    // Aggregates over the same rows with the same filter share a derived
+    // table, each one adds a column to it.
+    struct formula_from*  from = s->from;
+    struct formula_group* g    = NULL;
+    fkind                 kind = FUNCS[f->op].kind;
+    sds key = sdscatprintf(sdsempty(), "%s [%s] %d", s->alias, r->name, kind);
+    if (kind != FUNC_AGG) {
+        key = describe_arg(key, f->args[1]);
+        key = describe_arg(key, f->args[2]);
+    }
+    for (int i = 0; i < from->n_groups && g == NULL; i++) {
+        if (strcmp(from->groups[i]->key, key) == 0) g = from->groups[i];
+    }
+    if (g == NULL) {
+        g = new_formula_group(c, s, f, r, key);
+        if (g == NULL) return $invalid(wrapped_sql);
+    } else {
+        sdsfree(key);
+    }
+    wrapped_sql value = compile_field_value(c, &g->child, f->args[0]->atfield);
+    $inspect(value, error);
+    sds column =
+      sdscatprintf(sdsempty(), "%s(%s)", FUNCS[f->op].sql, value.v);
+    sdsfree(value.v);
+    int i      = 0;
+    while (i < g->n_columns && strcmp(g->columns[i], column) != 0) i++;
+    if (i == g->n_columns) {
+        g->columns = realloc(g->columns, (i + 1) * sizeof(sds));
+        g->columns[g->n_columns++] = column;
+    } else {
+        sdsfree(column);
+    }
+    if (f->op == OP_COUNT || f->op == OP_COUNT_IF_EQ) {
+        return (wrapped_sql){ sdscatprintf(
+          sdsempty(), "IFNULL(%s.[v%d], 0)", g->alias, i) };
+    }
+    return (wrapped_sql){ sdscatprintf(
+      sdsempty(), "%s.[v%d]", g->alias, i) };
+error:
+    return $invalid(wrapped_sql);
+}
+
+static sds
+render_formula_from(sds sql, const struct formula_from* from)
+{
+    sql = sdscatsds(sql, from->joins);
+    for (int i = 0; i < from->n_groups; i++) {
+        const struct formula_group* g     = from->groups[i];
+        const char*                 alias = g->child.alias;
+        sql = sdscatprintf(
+          sql, " LEFT JOIN (SELECT %s.[%s] AS k", alias, g->fk);
+        for (int j = 0; j < g->n_columns; j++) {
+            sql = sdscatprintf(sql, ", %s AS [v%d]", g->columns[j], j);
+        }
+        sql = sdscatprintf(sql, " FROM [%ss] AS %s", g->child.e->name, alias);
+        sql = render_formula_from(sql, &g->from);
+        sql = sdscatprintf(sql,
+                           " WHERE %s.[%s] IN (%s) AND %s._archived IS NULL%s"
+                           " GROUP BY %s.[%s]) AS %s ON %s.k = %s.Id",
+                           alias,
+                           g->fk,
+                           g->outer_ids,
+                           alias,
+                           g->where,
+                           alias,
+                           g->fk,
+                           g->alias,
+                           g->alias,
+                           g->outer);
+    }
+    return sql;
+}
+
+static void
+cleanup_formula_from(struct formula_from* from)
+{
+    for (int i = 0; i < from->n_refs; i++) {
+        sdsfree(from->refs[i].key);
+        sdsfree(from->refs[i].alias);
+        sdsfree(from->refs[i].ids);
+    }
+    for (int i = 0; i < from->n_groups; i++) {
+        struct formula_group* g = from->groups[i];
+        cleanup_formula_from(&g->from);
+        sdsfree(g->key);
+        sdsfree(g->alias);
+        sdsfree(g->parent);
+        sdsfree(g->outer);
+        sdsfree(g->ids);
+        sdsfree(g->where);
+        for (int j = 0; j < g->n_columns; j++) {
+            sdsfree(g->columns[j]);
+        }
+        free(g->columns);
+        sdsfree(g->child.alias);
+        free(g);
+    }
+    sdsfree(from->joins);
+    free(from->refs);
+    free(from->groups);
+}
+
+struct formula_batch*
+new_formula_batch(const char* ids)
+{
+    struct formula_batch* b = calloc(1, sizeof(struct formula_batch));
+    b->ids                  = sdsnew(ids);
+    b->from.joins           = sdsempty();
+    b->c.batch              = true;
+    return b;
+}
+
+wrapped_sql
+compile_batch_formula(struct formula_batch* b,
+                      struct entity*        e,
+                      struct field*         f)
+{
+    struct formula_scope root = {
+        .e     = e,
+        .alias = sdscatprintf(sdsempty(), "[%ss]", e->name),
+        .from  = &b->from,
+        .ids   = b->ids,
+    };
+    wrapped_sql sql = compile_func(&b->c, &root, f->autofunc);
+    sdsfree(root.alias);
+    $inspect(sql, error);
+    return sql;
+error:
+    $log_error("unable to compile formula of field %s.%s", e->name, f->name);
+    return $invalid(wrapped_sql);
+}
+
+sds
+formula_batch_joins(const struct formula_batch* b)
+{
+    return render_formula_from(sdsempty(), &b->from);
+}
+
+void
+free_formula_batch(struct formula_batch* b)
+{
+    if (b == NULL) return;
+    cleanup_formula_from(&b->from);
+    sdsfree(b->ids);
+    free(b);
+}
@@ -0,0 +1,96 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_FORMULA_H_
+#define _TURBOBUILDER_FORMULA_H_
+
+#include "coastguard/coastguard.h"
+#include "sds/sds.h"
+
+#include "model.h"
+#include "msql.h"
+
+#define MAX_FORMULA_DEPTH 8
+
+/* -- FORMULA DEPENDENCIES -- */
+
+/* A step from the rows of one entity to the rows of another, either down a
+ * relation (`to` rows referencing `from` rows through `column`) or up a REF
+ * field (`from` rows referencing `to` rows through `column`). */
+struct formula_step
+{
+    bool           child;
+    struct entity* from;
+    struct entity* to;
+    const char*    column;
+};
+
+/* The columns a formula reads from the rows of one entity, reached from the
+ * formula's own row through the given steps. */
+struct formula_dep
+{
+    struct entity*      e;
+    int                 n_steps;
+    struct formula_step steps[MAX_FORMULA_DEPTH];
+    int                 n_columns;
+    const char**        columns;
+};
+
+/* -- FORMULAS -- */
+
+/* An AUTO field formula compiled into a single scalar SQL expression,
+ * correlated with the [<Entity>s] row it is computed for. */
+struct formula
+{
+    sds                 sql;
+    int                 n_deps;
+    struct formula_dep* deps;
+};
+
+$typedef(struct formula*) wrapped_formula;
+
+wrapped_formula
+compile_formula(struct entity* e, struct field* f);
+
+void
+free_formula(struct formula* fm);
+
+sds
+formula_affected_ids(const struct formula_dep* d, const char* row);
+
+/* -- BATCHES -- */
+
+/* Computes AUTO fields for a whole set of rows at once, the set is given as
+ * a query of their Ids. Every formula compiles into an expression over the
+ * [<Entity>s] row, reading the joins the batch accumulates. */
+struct formula_batch;
+
+struct formula_batch*
+new_formula_batch(const char* ids);
+
+wrapped_sql
+compile_batch_formula(struct formula_batch* b,
+                      struct entity*        e,
+                      struct field*         f);
+
+sds
+formula_batch_joins(const struct formula_batch* b);
+
+void
+free_formula_batch(struct formula_batch* b);
+
+#endif
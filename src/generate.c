@@ -0,0 +1,443 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coastguard/coastguard.h"
+#include "core/iterators.h"
+#include "sds/sds.h"
+
+#include "generate.h"
+#include "msql.h"
+#include "stmtcache.h"
+
+#define GENERATE_DAYS 365
+
+/* -- RANDOM VALUES -- */
+
+/* Values come from a xorshift generator, so a seed generates the same
+ * records on every platform. */
+static uint64_t
+next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+random_unit(uint64_t* state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+random_skewed(uint64_t* state, int n)
+{
+    // Low values are picked more often: a quarter of the picks fall in the
+    // first sixteenth of the range.
+    double u = random_unit(state);
+    return (int)(n * u * u);
+}
+
+/* -- GENERATED ENTITIES -- */
+
+struct gen_entity;
+
+/* Stored fields with their parameter in the insert statement. TEXT fields
+ * read by a formula are generated as numbers, TEXT fields displayed by a
+ * REF field get a value unique to the record. */
+struct gen_field
+{
+    struct field*      f;
+    int                idx;
+    struct gen_entity* target;
+    bool               numeric;
+    bool               unique;
+};
+
+struct gen_entity
+{
+    struct entity*    e;
+    int               first_id;
+    int               rows;
+    bool              done;
+    int               n_fields;
+    struct gen_field* fields;
+};
+
+struct generator
+{
+    uint64_t           state;
+    int                n;
+    int                fanout;
+    const char**       fanouts;
+    int                n_fanouts;
+    int                n_entities;
+    struct gen_entity* entities;
+    time_t             days[GENERATE_DAYS];
+};
+
+static struct gen_entity*
+find_gen_entity(struct generator* g, const struct entity* e)
+{
+    for (int i = 0; i < g->n_entities; i++) {
+        if (g->entities[i].e == e) return &g->entities[i];
+    }
+    return NULL;
+}
+
+static bool
+func_reads_field(const struct func* fn, const char* name)
+{
+    if (fn == NULL) return false;
+    for (int i = 0; i < fn->n_args; i++) {
+        const struct arg* a = fn->args[i];
+        if (a->type == ATFUNC) {
+            if (func_reads_field(a->atfunc, name)) return true;
+        } else if (a->atfield != NULL && strcmp(a->atfield, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+is_read_by_formula(const char* name)
+{
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        $foreach_field(f, e)
+        {
+            if (func_reads_field(f->autofunc, name)) return true;
+            if (func_reads_field(f->autocond, name)) return true;
+        }
+    }
+    return false;
+}
+
+static bool
+is_displayed_by_ref(const struct field* f)
+{
+    $foreach_hashed(struct entity*, r, g_entities)
+    {
+        $foreach_field(rf, r)
+        {
+            if (rf->type == REF && rf->ref.field == f) return true;
+        }
+    }
+    return false;
+}
+
+static int
+relation_fanout(const struct generator* g,
+                const struct entity*    parent,
+                const struct relation*  r)
+{
+    // Fan-outs given later override earlier ones.
+    int rows = g->fanout;
+    sds name = sdscatprintf(sdsempty(), "%s.%s=", parent->name, r->name);
+    for (int i = 0; i < g->n_fanouts; i++) {
+        if (strncmp(g->fanouts[i], name, sdslen(name)) == 0) {
+            rows = atoi(g->fanouts[i] + sdslen(name));
+        }
+    }
+    sdsfree(name);
+    return rows;
+}
+
+static $status
+parse_fanouts(struct generator* g)
+{
+    g->fanout = DEFAULT_GENERATE_FANOUT;
+    for (int i = 0; i < g->n_fanouts; i++) {
+        const char* s  = g->fanouts[i];
+        const char* eq = strchr(s, '=');
+        if (eq == NULL) {
+            g->fanout = atoi(s);
+            if (g->fanout <= 0) return $error("invalid fan-out");
+            continue;
+        }
+        if (atoi(eq + 1) <= 0) return $error("invalid fan-out");
+        const char* dot = memchr(s, '.', eq - s);
+        if (dot == NULL) return $error("invalid fan-out relation");
+        sds              ename = sdsnewlen(s, dot - s);
+        sds              rname = sdsnewlen(dot + 1, eq - dot - 1);
+        struct entity*   e     = NULL;
+        struct relation* r     = NULL;
+        if (find_entity(g_entities, ename, &e) == 0) {
+            HASH_FIND_STR(e->relations, rname, r);
+        }
+        if (r == NULL) $log_error("unknown relation %s.%s", ename, rname);
+        sdsfree(ename);
+        sdsfree(rname);
+        if (r == NULL) return $error("invalid fan-out relation");
+    }
+    return $okay;
+}
+
+static $status
+count_rows(struct generator* g, struct gen_entity* ge)
+{
+    // Children are scaled from their largest parent, self references and
+    // plain lookups do not multiply.
+    long long rows       = 0;
+    bool      has_parent = false;
+    for (int i = 0; i < ge->n_fields; i++) {
+        struct gen_entity* t = ge->fields[i].target;
+        if (t == NULL || t == ge) continue;
+        long long per = 1;
+        $foreach_hashed(struct relation*, r, t->e->relations)
+        {
+            if (r->fk.field == ge->fields[i].f) {
+                per = relation_fanout(g, t->e, r);
+            }
+        }
+        has_parent = true;
+        if (t->rows * per > rows) rows = t->rows * per;
+    }
+    if (!has_parent) rows = g->n;
+    if (rows > INT_MAX / 2) return $error("too many records to generate");
+    ge->rows = rows;
+    return $okay;
+}
+
+static void
+bind_generated_value(struct generator*  g,
+                     struct gen_entity* ge,
+                     struct gen_field*  gf,
+                     int                row,
+                     sqlite3_stmt*      res)
+{
+    char               text[64];
+    int                n;
+    struct gen_entity* t = gf->target;
+    switch (gf->f->type) {
+        case REF:
+            if (t == ge && row > 0) {
+                sqlite3_bind_int(
+                  res, gf->idx, ge->first_id + random_skewed(&g->state, row));
+            } else if (t != ge && t->rows > 0) {
+                sqlite3_bind_int(res,
+                                 gf->idx,
+                                 t->first_id +
+                                   random_skewed(&g->state, t->rows));
+            } else {
+                sqlite3_bind_null(res, gf->idx);
+            }
+            break;
+        case TEXT:
+            if (gf->numeric) {
+                n = snprintf(
+                  text, sizeof(text), "%d", 1 + random_skewed(&g->state, 20));
+            } else if (gf->unique) {
+                n = snprintf(text, sizeof(text), "%s %d", gf->f->name, row + 1);
+            } else {
+                n = snprintf(text,
+                             sizeof(text),
+                             "%s %d",
+                             gf->f->name,
+                             1 + random_skewed(&g->state, 100));
+            }
+            sqlite3_bind_text(res, gf->idx, text, n, SQLITE_TRANSIENT);
+            break;
+        case INTEGER:
+            sqlite3_bind_int(res, gf->idx, 1 + random_skewed(&g->state, 20));
+            break;
+        case REAL:
+            sqlite3_bind_double(
+              res, gf->idx, 1 + random_skewed(&g->state, 10000) / 100.0);
+            break;
+        case BOOLEAN:
+            sqlite3_bind_int(res, gf->idx, random_unit(&g->state) < 0.3);
+            break;
+        case DATE:
+            // Recent days are the most frequent, like in a log.
+            sqlite3_bind_int64(
+              res, gf->idx, g->days[random_skewed(&g->state, GENERATE_DAYS)]);
+            break;
+        default:
+            sqlite3_bind_null(res, gf->idx);
+            break;
+    }
+}
+
+static $status
+generate_entity(sqlite3* db, struct generator* g, struct gen_entity* ge)
+{
+    struct entity*  e   = ge->e;
+    struct stmt_key sk  = { .e = e, .kind = STMT_INSERT };
+    sqlite3_stmt*   res = find_cached_stmt(db, &sk);
+    if (res == NULL) {
+        wrapped_stmt ws = cache_stmt(db, &sk, e->plan->insert_sql);
+        if $iserror (ws.status) return ws.status;
+        res = ws.v;
+    }
+    for (int i = 0; i < ge->n_fields; i++) {
+        struct field* f   = ge->fields[i].f;
+        sds           p   = sdscatprintf(sdsempty(), "@%s", f->name);
+        ge->fields[i].idx = sqlite3_bind_parameter_index(res, p);
+        sdsfree(p);
+    }
+
+    // Records get consecutive Ids from the first one inserted.
+    for (int row = 0; row < ge->rows; row++) {
+        for (int i = 0; i < ge->n_fields; i++) {
+            bind_generated_value(g, ge, &ge->fields[i], row, res);
+        }
+        if (sqlite3_step(res) != SQLITE_DONE) {
+            $log_error("%s: %s", e->name, sqlite3_errmsg(db));
+            release_cached_stmt(res);
+            return $error("unable to insert generated record");
+        }
+        release_cached_stmt(res);
+        int key = sqlite3_last_insert_rowid(db);
+        if (row == 0) ge->first_id = key;
+        if (e->fulltext) {
+            $status ret = sync_fulltext_rows(db, e, NULL, key);
+            if $iserror (ret) return ret;
+        }
+    }
+    $log_info("generated %d %s records", ge->rows, e->name);
+    return $okay;
+}
+
+static $status
+init_gen_entities(struct generator* g)
+{
+    g->n_entities = HASH_COUNT(g_entities);
+    g->entities   = calloc(g->n_entities, sizeof(struct gen_entity));
+    int i         = 0;
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        g->entities[i++].e = e;
+    }
+    for (i = 0; i < g->n_entities; i++) {
+        struct gen_entity* ge = &g->entities[i];
+        ge->fields =
+          calloc(HASH_COUNT(ge->e->fields), sizeof(struct gen_field));
+        $foreach_field(f, ge->e)
+        {
+            if (f->type == AUTO) continue;
+            struct gen_field* gf = &ge->fields[ge->n_fields++];
+            gf->f                = f;
+
+            gf->numeric = f->type == TEXT && is_read_by_formula(f->name);
+            gf->unique  = f->type == TEXT && is_displayed_by_ref(f);
+            if (f->type == REF) {
+                gf->target = find_gen_entity(g, f->ref.entity);
+                if (gf->target == NULL) return $error("unknown REF entity");
+            }
+        }
+    }
+    return $okay;
+}
+
+static void
+init_gen_days(struct generator* g)
+{
+    // Dates end on the --as-of day, or on a fixed day so that a seed always
+    // generates the same records.
+    time_t    last = get_as_of_date();
+    struct tm today;
+    if (last == 0) parse_date(GENERATE_LAST_DAY, &last);
+    localtime_r(&last, &today);
+    for (int i = 0; i < GENERATE_DAYS; i++) {
+        struct tm day = today;
+        day.tm_mday -= i;
+        day.tm_hour  = 0;
+        day.tm_min   = 0;
+        day.tm_sec   = 0;
+        day.tm_isdst = -1;
+        g->days[i]   = mktime(&day);
+    }
+}
+
+static bool
+parents_done(const struct gen_entity* ge)
+{
+    for (int i = 0; i < ge->n_fields; i++) {
+        const struct gen_entity* t = ge->fields[i].target;
+        if (t != NULL && t != ge && !t->done) return false;
+    }
+    return true;
+}
+
+wrapped_rows
+generate_records(sqlite3*     db,
+                 int          n,
+                 unsigned     seed,
+                 const char** fanouts,
+                 int          n_fanouts)
+{
+    wrapped_rows     ret = { 0 };
+    struct generator g   = { .state     = ((uint64_t)seed << 1) | 1,
+                             .n         = n,
+                             .fanouts   = fanouts,
+                             .n_fanouts = n_fanouts };
+    ret.status = parse_fanouts(&g);
+    if $iserror (ret.status) goto cleanup;
+    ret.status = init_gen_entities(&g);
+    if $iserror (ret.status) goto cleanup;
+    init_gen_days(&g);
+
+    // Entities are generated after the ones their REF fields point to, so
+    // every reference picks an existing record.
+    int done = 0;
+    int rows = 0;
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    while (done < g.n_entities) {
+        bool progress = false;
+        for (int i = 0; i < g.n_entities; i++) {
+            struct gen_entity* ge = &g.entities[i];
+            if (ge->done || !parents_done(ge)) continue;
+            ret.status = count_rows(&g, ge);
+            if $iserror (ret.status) goto rollback;
+            ret.status = generate_entity(db, &g, ge);
+            if $iserror (ret.status) goto rollback;
+            ge->done = true;
+            rows += ge->rows;
+            done++;
+            progress = true;
+        }
+        if (!progress) {
+            ret.status = $error("REF fields form a cycle");
+            goto rollback;
+        }
+    }
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    ret = (wrapped_rows){ rows };
+    goto cleanup;
+
+rollback:
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+cleanup:
+    for (int i = 0; i < g.n_entities; i++) {
+        free(g.entities[i].fields);
+    }
+    free(g.entities);
+    return ret;
+}
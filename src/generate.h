@@ -0,0 +1,47 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_GENERATE_H_
+#define _TURBOBUILDER_GENERATE_H_
+
+#include "coastguard/coastguard.h"
+#include "sqlite/sqlite3.h"
+
+#include "msql.h"
+
+#define DEFAULT_GENERATE_FANOUT 5
+
+/* Dates are generated in the year ending on this day, unless an as-of date
+ * is set. */
+#define GENERATE_LAST_DAY "2020-12-31"
+
+/* -- GENERATION -- */
+
+/* Fills every entity with synthetic records and returns the number of
+ * records inserted. Entities without REF fields get n records, the others
+ * get as many as their parents times the fan-out of the relation the
+ * parent declares on the REF field. Fan-outs are given as "rows", setting
+ * the default, or as "Entity.Relation=rows". The same seed generates the
+ * same records. */
+wrapped_rows
+generate_records(sqlite3*     db,
+                 int          n,
+                 unsigned     seed,
+                 const char** fanouts,
+                 int          n_fanouts);
+
+#endif
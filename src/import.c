@@ -0,0 +1,564 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coastguard/coastguard.h"
+#include "core/iterators.h"
+#include "sds/sds.h"
+
+#include "import.h"
+#include "msql.h"
+#include "stmtcache.h"
+
+/* -- RECORD READERS -- */
+
+typedef enum
+{
+    IMPORT_CSV,
+    IMPORT_TSV,
+    IMPORT_JSONL
+} import_format;
+
+/* Records are read into buffers that are reused from one record to the
+ * next. Delimited files name their fields once in a header record, JSONL
+ * records name them in every object. A missing value is marked null. */
+struct import_reader
+{
+    FILE*         in;
+    import_format format;
+    int           line;
+    int           alloced;
+    int           n;
+    sds*          names;
+    sds*          values;
+    bool*         nulls;
+    sds           buf;
+};
+
+static void
+grow_reader(struct import_reader* r, int n)
+{
+    if (n <= r->alloced) return;
+    int alloced = r->alloced == 0 ? 16 : r->alloced * 2;
+    while (alloced < n) alloced *= 2;
+    r->names  = realloc(r->names, alloced * sizeof(sds));
+    r->values = realloc(r->values, alloced * sizeof(sds));
+    r->nulls  = realloc(r->nulls, alloced * sizeof(bool));
+    for (int i = r->alloced; i < alloced; i++) {
+        r->names[i]  = sdsempty();
+        r->values[i] = sdsempty();
+    }
+    r->alloced = alloced;
+}
+
+static $status
+open_reader(struct import_reader* r, const char* filename)
+{
+    const char* ext = strrchr(filename, '.');
+    if (ext != NULL && strcmp(ext, ".csv") == 0) {
+        r->format = IMPORT_CSV;
+    } else if (ext != NULL && strcmp(ext, ".tsv") == 0) {
+        r->format = IMPORT_TSV;
+    } else if (ext != NULL && strcmp(ext, ".jsonl") == 0) {
+        r->format = IMPORT_JSONL;
+    } else {
+        return $error("unknown import file format");
+    }
+    r->in = fopen(filename, "r");
+    if (r->in == NULL) return $error("unable to open file");
+    r->buf = sdsempty();
+    return $okay;
+}
+
+static void
+close_reader(struct import_reader* r)
+{
+    if (r->in != NULL) fclose(r->in);
+    for (int i = 0; i < r->alloced; i++) {
+        sdsfree(r->names[i]);
+        sdsfree(r->values[i]);
+    }
+    free(r->names);
+    free(r->values);
+    free(r->nulls);
+    sdsfree(r->buf);
+}
+
+/* Reads a record of a delimited file. Quoted values may hold separators,
+ * line breaks and doubled quotes, unquoted empty values are missing ones.
+ * Returns 1 for a record, 0 at the end of the file and -1 when a quote is
+ * never closed. */
+static int
+read_delimited(struct import_reader* r, char sep)
+{
+    int c;
+    while ((c = getc(r->in)) == '\n' || c == '\r') {
+        if (c == '\n') r->line++;
+    }
+    if (c == EOF) return 0;
+    r->line++;
+
+    int  n      = 0;
+    bool quoted = false;
+    grow_reader(r, 1);
+    sdsclear(r->values[0]);
+    r->nulls[0] = true;
+    for (;; c = getc(r->in)) {
+        char ch = c;
+        if (quoted) {
+            if (c == EOF) return -1;
+            if (c == '"' && (c = getc(r->in)) != '"') {
+                quoted = false;
+                ungetc(c, r->in);
+                continue;
+            }
+            if (c == '\n') r->line++;
+            r->values[n] = sdscatlen(r->values[n], &ch, 1);
+            continue;
+        }
+        if (c == '"' && r->nulls[n]) {
+            quoted      = true;
+            r->nulls[n] = false;
+            continue;
+        }
+        if (c == sep) {
+            grow_reader(r, ++n + 1);
+            sdsclear(r->values[n]);
+            r->nulls[n] = true;
+            continue;
+        }
+        if (c == '\r') continue;
+        if (c == '\n' || c == EOF) break;
+        r->values[n] = sdscatlen(r->values[n], &ch, 1);
+        r->nulls[n]  = false;
+    }
+    r->n = n + 1;
+    return 1;
+}
+
+static const char*
+skip_space(const char* p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+static bool
+read_hex4(const char* p, unsigned* cp)
+{
+    *cp = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)p[i])) return false;
+        *cp = *cp * 16 + (isdigit((unsigned char)p[i])
+                            ? p[i] - '0'
+                            : tolower((unsigned char)p[i]) - 'a' + 10);
+    }
+    return true;
+}
+
+static sds
+cat_utf8(sds s, unsigned cp)
+{
+    char b[4];
+    int  n;
+    if (cp < 0x80) {
+        b[0] = cp;
+        n    = 1;
+    } else if (cp < 0x800) {
+        b[0] = 0xC0 | (cp >> 6);
+        b[1] = 0x80 | (cp & 0x3F);
+        n    = 2;
+    } else if (cp < 0x10000) {
+        b[0] = 0xE0 | (cp >> 12);
+        b[1] = 0x80 | ((cp >> 6) & 0x3F);
+        b[2] = 0x80 | (cp & 0x3F);
+        n    = 3;
+    } else {
+        b[0] = 0xF0 | (cp >> 18);
+        b[1] = 0x80 | ((cp >> 12) & 0x3F);
+        b[2] = 0x80 | ((cp >> 6) & 0x3F);
+        b[3] = 0x80 | (cp & 0x3F);
+        n    = 4;
+    }
+    return sdscatlen(s, b, n);
+}
+
+/* Reads the JSON string starting at p into s and returns the position
+ * past its closing quote, or NULL if it is malformed. */
+static const char*
+read_json_string(const char* p, sds* s)
+{
+    sdsclear(*s);
+    for (p++;;) {
+        size_t len = strcspn(p, "\"\\");
+        *s         = sdscatlen(*s, p, len);
+        p += len;
+        if (*p == '\0') return NULL;
+        if (*p++ == '"') return p;
+        unsigned cp;
+        switch (*p++) {
+            case '"':
+                *s = sdscat(*s, "\"");
+                break;
+            case '\\':
+                *s = sdscat(*s, "\\");
+                break;
+            case '/':
+                *s = sdscat(*s, "/");
+                break;
+            case 'b':
+                *s = sdscat(*s, "\b");
+                break;
+            case 'f':
+                *s = sdscat(*s, "\f");
+                break;
+            case 'n':
+                *s = sdscat(*s, "\n");
+                break;
+            case 'r':
+                *s = sdscat(*s, "\r");
+                break;
+            case 't':
+                *s = sdscat(*s, "\t");
+                break;
+            case 'u':
+                if (!read_hex4(p, &cp)) return NULL;
+                p += 4;
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    // Characters outside the BMP come as a surrogate pair.
+                    unsigned lo;
+                    if (p[0] != '\\' || p[1] != 'u' || !read_hex4(p + 2, &lo) ||
+                        lo < 0xDC00 || lo > 0xDFFF) {
+                        return NULL;
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+                *s = cat_utf8(*s, cp);
+                break;
+            default:
+                return NULL;
+        }
+    }
+}
+
+/* Reads a flat JSON value, booleans are read as 1 and 0 like the database
+ * stores them. */
+static const char*
+read_json_value(const char* p, sds* value, bool* null)
+{
+    *null = false;
+    if (*p == '"') return read_json_string(p, value);
+    sdsclear(*value);
+    if (strncmp(p, "null", 4) == 0) {
+        *null = true;
+        return p + 4;
+    }
+    if (strncmp(p, "true", 4) == 0) {
+        *value = sdscat(*value, "1");
+        return p + 4;
+    }
+    if (strncmp(p, "false", 5) == 0) {
+        *value = sdscat(*value, "0");
+        return p + 5;
+    }
+    size_t len = strspn(p, "+-.0123456789eE");
+    if (len == 0) return NULL;
+    *value = sdscatlen(*value, p, len);
+    return p + len;
+}
+
+static bool
+read_line(struct import_reader* r)
+{
+    char chunk[4096];
+    sdsclear(r->buf);
+    while (fgets(chunk, sizeof(chunk), r->in) != NULL) {
+        r->buf = sdscat(r->buf, chunk);
+        if (r->buf[sdslen(r->buf) - 1] == '\n') return true;
+    }
+    return sdslen(r->buf) > 0;
+}
+
+/* Reads a JSONL record, an object of field names and flat values on a
+ * line of its own. Returns like read_delimited. */
+static int
+read_jsonl(struct import_reader* r)
+{
+    const char* p;
+    do {
+        if (!read_line(r)) return 0;
+        r->line++;
+        p = skip_space(r->buf);
+    } while (*p == '\0');
+
+    r->n = 0;
+    if (*p++ != '{') return -1;
+    p = skip_space(p);
+    while (*p != '}') {
+        grow_reader(r, r->n + 1);
+        if (*p != '"') return -1;
+        if ((p = read_json_string(p, &r->names[r->n])) == NULL) return -1;
+        p = skip_space(p);
+        if (*p++ != ':') return -1;
+        p = skip_space(p);
+        p = read_json_value(p, &r->values[r->n], &r->nulls[r->n]);
+        if (p == NULL) return -1;
+        r->n++;
+        p = skip_space(p);
+        if (*p == ',') p = skip_space(p + 1);
+        else if (*p != '}') return -1;
+    }
+    return *skip_space(p + 1) == '\0' ? 1 : -1;
+}
+
+static int
+read_record(struct import_reader* r)
+{
+    switch (r->format) {
+        case IMPORT_CSV:
+            return read_delimited(r, ',');
+        case IMPORT_TSV:
+            return read_delimited(r, '\t');
+        default:
+            return read_jsonl(r);
+    }
+}
+
+/* -- IMPORT -- */
+
+struct import_ref
+{
+    char*          value;
+    int            key;
+    UT_hash_handle hh;
+};
+
+/* Every field that is stored gets a column with its parameter in the
+ * insert statement. REF columns remember the keys of the values they have
+ * already resolved. */
+struct import_column
+{
+    struct field*      f;
+    int                idx;
+    struct import_ref* refs;
+    UT_hash_handle     hh;
+};
+
+static void
+cleanup_import_columns(struct import_column* columns)
+{
+    struct import_column *c, *tmp_c;
+    HASH_ITER(hh, columns, c, tmp_c)
+    {
+        struct import_ref *r, *tmp_r;
+        HASH_ITER(hh, c->refs, r, tmp_r)
+        {
+            HASH_DEL(c->refs, r);
+            free(r->value);
+            free(r);
+        }
+        HASH_DEL(columns, c);
+        free(c);
+    }
+}
+
+static $status
+bind_import_value(sqlite3*              db,
+                  sqlite3_stmt*         res,
+                  struct import_column* c,
+                  const char*           value,
+                  bool                  null)
+{
+    // Missing text is stored empty like the forms store it.
+    struct field* f = c->f;
+    if (null && f->type != TEXT) {
+        sqlite3_bind_null(res, c->idx);
+    } else if (f->type == REF) {
+        struct import_ref* r;
+        HASH_FIND_STR(c->refs, value, r);
+        if (r == NULL) {
+            wrapped_key wk = get_ref_key(db, value, &f->ref);
+            if $iserror (wk.status) {
+                $log_error("no %s record with %s %s", f->ref.eid, f->ref.fid,
+                           value);
+                return wk.status;
+            }
+            r        = malloc(sizeof(struct import_ref));
+            r->value = strdup(value);
+            r->key   = wk.v;
+            HASH_ADD_KEYPTR(hh, c->refs, r->value, strlen(r->value), r);
+        }
+        sqlite3_bind_int(res, c->idx, r->key);
+    } else if (f->type == BOOLEAN) {
+        bool set = strcmp(value, "1") == 0 || strcmp(value, "true") == 0 ||
+                   strcmp(value, "X") == 0 || strcmp(value, "x") == 0;
+        sqlite3_bind_int(res, c->idx, set ? 1 : 0);
+    } else if (f->type == DATE) {
+        wrapped_time_t wt = parse_date_field(value);
+        if $iserror (wt.status) {
+            $log_error("%s is not a date", value);
+            return $error("invalid date");
+        }
+        sqlite3_bind_int64(res, c->idx, wt.v);
+    } else {
+        // The buffers keep the value until the row is inserted.
+        sqlite3_bind_text(res, c->idx, null ? "" : value, -1, SQLITE_STATIC);
+    }
+    return $okay;
+}
+
+wrapped_rows
+import_records(sqlite3*       db,
+               struct entity* e,
+               const char*    filename,
+               int            batch_rows)
+{
+    wrapped_rows           ret     = { 0 };
+    struct import_reader   r       = { 0 };
+    struct import_column*  columns = NULL;
+    struct import_column** header  = NULL;
+    int                    rows    = 0;
+    int                    rc;
+    if (batch_rows <= 0) batch_rows = DEFAULT_IMPORT_BATCH_ROWS;
+
+    $onerror2(open_reader(&r, filename))
+    {
+        ret = $invalid(wrapped_rows, "unable to open import file");
+        goto cleanup;
+    }
+
+    // A single insert statement is bound and reset for every record.
+    struct stmt_key sk  = { .e = e, .kind = STMT_INSERT };
+    sqlite3_stmt*   res = find_cached_stmt(db, &sk);
+    if (res == NULL) {
+        wrapped_stmt ws = cache_stmt(db, &sk, e->plan->insert_sql);
+        res             = $unwrap(ws, ret.status, cleanup);
+    }
+    // Calculated fields are known so that exported files read back, their
+    // values are ignored.
+    $foreach_field(f, e)
+    {
+        sds                   name = sdscatprintf(sdsempty(), "@%s", f->name);
+        struct import_column* c    = calloc(1, sizeof(struct import_column));
+        c->f                       = f;
+        c->idx                     = sqlite3_bind_parameter_index(res, name);
+        HASH_ADD_KEYPTR(hh, columns, f->name, strlen(f->name), c);
+        sdsfree(name);
+    }
+
+    // The header of a delimited file maps its positions to columns once.
+    int n_header = 0;
+    if (r.format != IMPORT_JSONL) {
+        if (read_record(&r) <= 0) {
+            ret = $invalid(wrapped_rows, "missing header line");
+            goto cleanup;
+        }
+        n_header = r.n;
+        header   = calloc(n_header, sizeof(struct import_column*));
+        for (int i = 0; i < n_header; i++) {
+            HASH_FIND_STR(columns, r.values[i], header[i]);
+            if (header[i] == NULL) {
+                $log_error("%s has no field %s", e->name, r.values[i]);
+                ret = $invalid(wrapped_rows, "unknown field in header");
+                goto cleanup;
+            }
+        }
+    }
+
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    while ((rc = read_record(&r)) > 0) {
+        // Fields left out of a record are stored as missing.
+        struct import_column* c;
+        for (c = columns; c != NULL; c = c->hh.next) {
+            if (c->f->type == TEXT) {
+                sqlite3_bind_text(res, c->idx, "", 0, SQLITE_STATIC);
+            }
+        }
+        if (header != NULL && r.n != n_header) {
+            $log_error("line %d: %d values for %d fields", r.line, r.n,
+                       n_header);
+            ret = $invalid(wrapped_rows, "wrong number of values");
+            goto rollback;
+        }
+        for (int i = 0; i < r.n; i++) {
+            if (header != NULL) {
+                c = header[i];
+            } else {
+                HASH_FIND_STR(columns, r.names[i], c);
+                if (c == NULL) {
+                    $log_error("line %d: %s has no field %s", r.line,
+                               e->name, r.names[i]);
+                    ret = $invalid(wrapped_rows, "unknown field in record");
+                    goto rollback;
+                }
+            }
+            if (c->f->type == AUTO) continue;
+            $onerror2(bind_import_value(db, res, c, r.values[i], r.nulls[i]))
+            {
+                $log_error("line %d: unable to bind %s", r.line, c->f->name);
+                ret = $invalid(wrapped_rows, "invalid value in record");
+                goto rollback;
+            }
+        }
+        if (sqlite3_step(res) != SQLITE_DONE) {
+            $log_error("line %d: %s", r.line, sqlite3_errmsg(db));
+            ret = $invalid(wrapped_rows, "unable to insert record");
+            goto rollback;
+        }
+        release_cached_stmt(res);
+        if (e->fulltext) {
+            int key = sqlite3_last_insert_rowid(db);
+            $onerror2(sync_fulltext_rows(db, e, NULL, key))
+            {
+                ret = $invalid(wrapped_rows,
+                               "unable to update full-text index");
+                goto rollback;
+            }
+        }
+        if (++rows % batch_rows == 0) {
+            sqlite3_exec(db, "COMMIT", 0, 0, 0);
+            sqlite3_exec(db, "BEGIN", 0, 0, 0);
+            $log_info("imported %d %s records", rows, e->name);
+        }
+    }
+    if (rc < 0) {
+        $log_error("line %d: malformed record", r.line);
+        ret = $invalid(wrapped_rows, "malformed record");
+        goto rollback;
+    }
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    ret = (wrapped_rows){ rows };
+    goto cleanup;
+
+rollback:
+    // Batches committed before the failing record stay in the database.
+    release_cached_stmt(res);
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    $log_error("%d records were imported before the error",
+               rows - rows % batch_rows);
+cleanup:
+    free(header);
+    cleanup_import_columns(columns);
+    close_reader(&r);
+    return ret;
+}
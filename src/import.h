@@ -0,0 +1,41 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_IMPORT_H_
+#define _TURBOBUILDER_IMPORT_H_
+
+#include "coastguard/coastguard.h"
+#include "sqlite/sqlite3.h"
+
+#include "msql.h"
+
+#define DEFAULT_IMPORT_BATCH_ROWS 10000
+
+/* -- IMPORT -- */
+
+/* Inserts the records of a CSV, TSV or JSONL file into the entity's table,
+ * committing every batch_rows records, and returns the number of records
+ * inserted. CSV and TSV files start with a header line of field names,
+ * JSONL files hold one object per line. REF fields are given by the value
+ * they display, AUTO fields are skipped so that exports import back. */
+wrapped_rows
+import_records(sqlite3*       db,
+               struct entity* e,
+               const char*    filename,
+               int            batch_rows);
+
+#endif
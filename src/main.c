@@ -19,41 +19,35 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "argtable3/argtable3.h"
 #include "core/args.h"
 #include "core/iterators.h"
 
-#include "rdsl.h"
+#include "export.h"
+#include "generate.h"
+#include "import.h"
+#include "modelfile.h"
+#include "querylog.h"
+#include "refcache.h"
+#include "storage.h"
 #include "tui.h"
+#include "worker.h"
 
 char*               g_title;
 struct entity*      g_entities;
 struct translation* g_translations;
 
-$status
-parse_model_file(const char* filename)
-{
-    $status ret = $okay;
-    FILE*   in  = fopen(filename, "r");
-    if (!in) {
-        ret = $error("unable to open file");
-    } else {
-        struct t_parser parser = { 0 };
-        parser.in              = in;
-        prebase_context_t* ctx = prebase_create(&parser);
-        while (prebase_parse(ctx, NULL))
-            ;
-        prebase_destroy(ctx);
-        fclose(in);
-    }
-    return ret;
-}
-
 int
 main(int argc, const char** argv)
 {
     struct arg_lit* parse = arg_lit0(NULL, "parse", "Parse the model");
+    struct arg_lit* no_model_cache = arg_lit0(
+      NULL, "no-model-cache", "Parse the model without its compiled cache");
+    struct arg_str* lang =
+      arg_str0(NULL, "lang", "<language>", "Translation of the labels");
+    lang->sval[0] = "English";
     struct arg_lit* init =
       arg_lit0(NULL, "init", "Initialize a new database file");
     struct arg_lit* inmemdb =
@@ -63,23 +57,152 @@ main(int argc, const char** argv)
     struct arg_file* database = arg_file0(
       NULL, "db", "<output>", "Database file. Default is \"records.db\")");
     database->filename[0] = "records.db";
+    struct arg_str* import =
+      arg_str0(NULL, "import", "<entity>", "Import records into an entity");
+    struct arg_file* import_file =
+      arg_file0(NULL, NULL, "<file>", "CSV, TSV or JSONL file to import");
+    struct arg_int* batch = arg_int0(
+      NULL, "batch", "<rows>", "Records imported per transaction");
+    batch->ival[0] = DEFAULT_IMPORT_BATCH_ROWS;
+    struct arg_str* export = arg_str0(
+      NULL, "export", "<entity>", "Write the records of an entity to stdout");
+    struct arg_str* format =
+      arg_str0(NULL, "format", "<csv|tsv|jsonl>", "Export format");
+    format->sval[0] = "csv";
+    struct arg_int* generate = arg_int0(
+      NULL, "generate", "<rows>", "Fill the database with generated records");
+    struct arg_int* seed =
+      arg_int0(NULL, "seed", "<n>", "Seed of the generated records");
+    seed->ival[0] = 1;
+    struct arg_str* fanout =
+      arg_strn(NULL,
+               "fanout",
+               "<[Entity.Relation=]rows>",
+               0,
+               32,
+               "Generated records per parent record");
+    struct arg_str* storage = arg_str0(NULL,
+                                       "storage",
+                                       "<interactive|bulk|readonly>",
+                                       "Storage profile of the database");
+    struct arg_int* cache_size =
+      arg_int0(NULL, "cache-size", "<MiB>", "Page cache size");
+    struct arg_int* mmap_size =
+      arg_int0(NULL, "mmap-size", "<MiB>", "Memory-mapped database size");
+    struct arg_str* journal =
+      arg_str0(NULL, "journal", "<mode>", "Journal mode, e.g. wal or delete");
+    struct arg_str* as_of = arg_str0(
+      NULL, "as-of", "<YYYY-MM-DD>", "Last day of rolling date windows");
+    struct arg_int* slow_query = arg_int0(
+      NULL, "slow-query", "<ms>", "Log statements running this long or more");
+    struct arg_file* slow_query_log = arg_file0(
+      NULL, "slow-query-log", "<file>", "Write the slow-query log on exit");
     add_base_args();
     arg_append(model);
     arg_append(parse);
+    arg_append(no_model_cache);
+    arg_append(lang);
     arg_append(init);
     arg_append(inmemdb);
     arg_append(database);
+    arg_append(import);
+    arg_append(import_file);
+    arg_append(batch);
+    arg_append(export);
+    arg_append(format);
+    arg_append(generate);
+    arg_append(seed);
+    arg_append(fanout);
+    arg_append(storage);
+    arg_append(cache_size);
+    arg_append(mmap_size);
+    arg_append(journal);
+    arg_append(as_of);
+    arg_append(slow_query);
+    arg_append(slow_query_log);
     parse_all_args(argc, argv, "test");
 
-    g_title = sdsnew("TURBOBUILDER");
+    // Scripted runs, e.g. imports, tell their failures by the exit status.
+    int exit_code = EXIT_SUCCESS;
+    g_title       = sdsnew("TURBOBUILDER");
 
-    if $iserror (parse_model_file(model->filename[0])) {
+    if $iserror (parse_model_file(model->filename[0],
+                                  no_model_cache->count == 0)) {
+        exit_code = EXIT_FAILURE;
         goto cleanup_args;
     }
 
-    if (parse->count > 0) goto cleanup_args;
+    // Models without translations are labelled by their names, unless a
+    // language was asked for.
+    if (translate_model(g_entities, g_translations, lang->sval[0]) != 0 &&
+        lang->count > 0) {
+        $log_error("unknown language %s", lang->sval[0]);
+        exit_code = EXIT_FAILURE;
+        goto cleanup_model;
+    }
+
+    if (as_of->count > 0) {
+        wrapped_time_t wt = parse_date_field(as_of->sval[0]);
+        $ifvalid(wt)
+        {
+            set_as_of_date(wt.v);
+        } else {
+            $log_error("invalid --as-of date %s", as_of->sval[0]);
+            exit_code = EXIT_FAILURE;
+            goto cleanup_model;
+        }
+    }
+
+    if $iserror (compile_query_plans()) {
+        exit_code = EXIT_FAILURE;
+        goto cleanup_model;
+    }
+
+    if (parse->count > 0) goto cleanup_model;
 
-    init_tui();
+    // Only records generated into a fresh database default to the bulk
+    // profile, a crash can lose them all without losing anything else.
+    bool fresh = init->count > 0 && access(database->filename[0], F_OK) != 0;
+    bool bulk  = generate->count > 0 && (fresh || inmemdb->count > 0);
+
+    const char* profile_name = storage->count > 0 ? storage->sval[0]
+                               : bulk             ? "bulk"
+                                                  : "interactive";
+    wrapped_storage_profile wp = find_storage_profile(profile_name);
+    if $iserror (wp.status) {
+        exit_code = EXIT_FAILURE;
+        goto cleanup_model;
+    }
+    struct storage_profile profile = wp.v;
+    if (journal->count > 0) profile.journal = journal->sval[0];
+    if (cache_size->count > 0) profile.cache_size = cache_size->ival[0];
+    if (mmap_size->count > 0) profile.mmap_size = mmap_size->ival[0];
+
+    bool headless =
+      import->count > 0 || generate->count > 0 || export->count > 0;
+
+    struct entity* import_entity = NULL;
+    struct entity* export_entity = NULL;
+    if (import->count > 0) {
+        if (find_entity(g_entities, import->sval[0], &import_entity) != 0) {
+            fprintf(stderr, "unknown entity %s\n", import->sval[0]);
+            exit_code = EXIT_FAILURE;
+            goto cleanup_model;
+        }
+        if (import_file->count == 0) {
+            fprintf(stderr, "missing file to import\n");
+            exit_code = EXIT_FAILURE;
+            goto cleanup_model;
+        }
+    } else if (export->count > 0) {
+        if (find_entity(g_entities, export->sval[0], &export_entity) != 0) {
+            fprintf(stderr, "unknown entity %s\n", export->sval[0]);
+            exit_code = EXIT_FAILURE;
+            goto cleanup_model;
+        }
+    } else if (!headless) {
+        init_tui();
+    }
 
     sqlite3* db;
     int      rc;
@@ -96,19 +219,90 @@ main(int argc, const char** argv)
         sqlite3_close(db);
         goto cleanup;
     }
-    if (inmemdb->count > 0 || init->count > 0) {
-        create_tables_from_model(db);
+    if $iserror (apply_storage_profile(db, &profile)) {
+        exit_code = EXIT_FAILURE;
+        goto cleanup;
+    }
+    watch_ref_values(db);
+    bool query_log = slow_query->count > 0 || slow_query_log->count > 0;
+    if (query_log) {
+        start_query_log(db,
+                        slow_query->count > 0 ? slow_query->ival[0]
+                                              : DEFAULT_SLOW_QUERY_MS);
+    }
+    if (profile.query_only) {
+        $log_info("using the database as is, read-only");
+    } else {
+        $status created = inmemdb->count > 0 || init->count > 0
+                            ? create_tables_from_model(db)
+                            : create_indexes_from_model(db);
+        if $iserror (created) {
+            $log_error("database setup failed: %s", created.message);
+            exit_code = EXIT_FAILURE;
+        }
     }
 
-    run_tui(db);
+    if (exit_code != EXIT_SUCCESS) {
+        // Nothing runs on a database the model could not be set up in.
+    } else if (import_entity != NULL) {
+        wrapped_rows wr = import_records(
+          db, import_entity, import_file->filename[0], batch->ival[0]);
+        $ifvalid(wr)
+        {
+            printf("imported %d %s records\n", wr.v, import_entity->name);
+        } else {
+            fprintf(stderr, "import failed: %s\n", wr.status.message);
+            exit_code = EXIT_FAILURE;
+        }
+    } else if (export_entity != NULL) {
+        wrapped_rows wr =
+          export_records(db, export_entity, format->sval[0], stdout);
+        $ifvalid(wr)
+        {
+            fprintf(stderr,
+                    "exported %d %s records\n",
+                    wr.v,
+                    export_entity->name);
+        } else {
+            fprintf(stderr, "export failed: %s\n", wr.status.message);
+            exit_code = EXIT_FAILURE;
+        }
+    } else if (generate->count > 0) {
+        wrapped_rows wr = generate_records(
+          db, generate->ival[0], seed->ival[0], fanout->sval, fanout->count);
+        $ifvalid(wr)
+        {
+            printf("generated %d records\n", wr.v);
+        } else {
+            fprintf(stderr, "generation failed: %s\n", wr.status.message);
+            exit_code = EXIT_FAILURE;
+        }
+    } else if $iserror (start_query_worker(db)) {
+        $log_error("Cannot start the query worker");
+        exit_code = EXIT_FAILURE;
+    } else {
+        run_tui(db);
+        stop_query_worker();
+    }
+    if (query_log) {
+        if (slow_query_log->count > 0) {
+            write_query_log(db, slow_query_log->filename[0]);
+        }
+        stop_query_log(db);
+    }
 
 cleanup:
-    shutdown_tui();
+    if (!headless) shutdown_tui();
+    stop_storage_checkpoints();
+    finalize_stmt_cache(db);
     sqlite3_close(db);
+    clear_ref_cache();
+cleanup_model:
+    cleanup_query_plans();
     cleanup_translations(g_translations);
     cleanup_entities(g_entities);
     sdsfree(g_title);
 cleanup_args:
     arg_freeall();
-    return 0;
+    return exit_code;
 }
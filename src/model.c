@@ -15,7 +15,6 @@
  * You should have received a copy of the GNU General Public License along with
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <newt.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -88,16 +87,32 @@ reg_label(struct translation* e, struct label* l)
     HASH_ADD_STR(e->labels, term, l);
 }
 
-const char*
-_TR(const char* term)
+static const char*
+find_label(const struct translation* t, const char* term)
+{
+    struct label* wrapper = NULL;
+    if (t != NULL) HASH_FIND_STR(t->labels, term, wrapper);
+    return wrapper != NULL ? wrapper->label : term;
+}
+
+int
+translate_model(struct entity*            es,
+                const struct translation* ts,
+                const char*               language)
 {
     struct translation* t;
-    HASH_FIND_STR(g_translations, "English", t);
-    if (t == NULL) return term;
-    struct label* wrapper;
-    HASH_FIND_STR(t->labels, term, wrapper);
-    if (wrapper == NULL) return term;
-    return wrapper->label;
+    HASH_FIND_STR(ts, language, t);
+    $foreach_hashed(struct entity*, e, es)
+    {
+        e->label = find_label(t, e->name);
+        $foreach_field(f, e) f->label = find_label(t, f->name);
+        // Relations are labelled by the entity they list.
+        $foreach_hashed(struct relation*, r, e->relations)
+        {
+            r->label = find_label(t, r->fk.eid);
+        }
+    }
+    return t == NULL ? -1 : 0;
 }
 
 int
@@ -127,6 +142,115 @@ find_entity(const struct entity* es, const char* name, struct entity** e)
     return wrapper == NULL ? -1 : 0;
 }
 
+fop
+find_func(const char* name)
+{
+    for (fop op = OP_UNKNOWN + 1; op < N_FUNCS; op++)
+        if (strcmp(FUNCS[op].name, name) == 0) return op;
+    return OP_UNKNOWN;
+}
+
+/* -- RESOLUTION -- */
+
+static void
+resolve_fpath(const struct entity* es, struct fpath* p)
+{
+    p->entity = NULL;
+    p->field  = NULL;
+    if (p->eid == NULL || find_entity(es, p->eid, &p->entity) != 0) return;
+    if (p->fid != NULL) find_field(p->entity->fields, p->fid, &p->field);
+}
+
+static void
+resolve_func(struct entity* e, struct func* f);
+
+static void
+resolve_arg(struct entity* e, struct arg* a)
+{
+    a->field    = NULL;
+    a->ref      = NULL;
+    a->relation = NULL;
+    if (a->type == ATFUNC) {
+        resolve_func(e, a->atfunc);
+    } else if (a->type == ATFIELD) {
+        find_field(e->fields, a->atfield, &a->field);
+    } else {
+        // REF fields take precedence over relations of the same name.
+        if (find_field(e->fields, a->atentity, &a->ref) == 0 &&
+            a->ref->type != REF)
+            a->ref = NULL;
+        find_relation(e->relations, a->atentity, &a->relation);
+        struct entity* via = a->ref != NULL        ? a->ref->ref.entity
+                             : a->relation != NULL ? a->relation->fk.entity
+                                                   : NULL;
+        if (via != NULL) find_field(via->fields, a->atfield, &a->field);
+    }
+}
+
+static void
+resolve_func(struct entity* e, struct func* f)
+{
+    if (f == NULL) return;
+    for (int i = 0; i < f->n_args; i++) resolve_arg(e, f->args[i]);
+}
+
+int
+resolve_model(struct entity* es, const struct fpath** unresolved)
+{
+    // Fields are numbered in declaration order, which is the order uthash
+    // keeps them in, so query plans can be indexed by field id.
+    $foreach_hashed(struct entity*, e, es)
+    {
+        e->n_fields   = HASH_COUNT(e->fields);
+        e->field_list = realloc(e->field_list,
+                                (e->n_fields + 1) * sizeof(struct field*));
+        int i         = 0;
+        $foreach_hashed(struct field*, f, e->fields)
+        {
+            f->entity          = e;
+            f->id              = i;
+            e->field_list[i++] = f;
+        }
+    }
+    *unresolved = NULL;
+    $foreach_hashed(struct entity*, e, es)
+    {
+        $foreach_field(f, e)
+        {
+            resolve_fpath(es, &f->ref);
+            resolve_fpath(es, &f->order.fpath);
+            if (f->type == REF && f->ref.field == NULL && *unresolved == NULL)
+                *unresolved = &f->ref;
+        }
+        // A relation naming no foreign key only fails once it is opened.
+        $foreach_hashed(struct relation*, r, e->relations)
+        {
+            resolve_fpath(es, &r->fk);
+            resolve_fpath(es, &r->order.fpath);
+        }
+    }
+
+    // Formulas of AUTO fields read the record they belong to, the filter
+    // of a REF field compares a field of the referenced records with one
+    // reached from the record being edited.
+    $foreach_hashed(struct entity*, e, es)
+    {
+        $foreach_field(f, e)
+        {
+            if (f->type == AUTO) {
+                resolve_func(e, f->autofunc);
+                resolve_func(e, f->autocond);
+            }
+            if (f->type == REF && f->filter != NULL) {
+                resolve_func(e, f->filter);
+                if (f->ref.entity != NULL && f->filter->n_args > 0)
+                    resolve_arg(f->ref.entity, f->filter->args[0]);
+            }
+        }
+    }
+    return *unresolved == NULL ? 0 : -1;
+}
+
 /* -- MEMORY CLEANUP -- */
 
 void
@@ -202,6 +326,7 @@ cleanup_entities(struct entity* es)
             free(f);
         }
         sdsfree(e->name);
+        free(e->field_list);
         HASH_DEL(es, e);
         free(e);
     }
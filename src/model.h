@@ -43,10 +43,18 @@ typedef enum
 static const char* FTYPES[] = { "UNKNOWN", "TEXT",    "INTEGER", "INTEGER",
                                 "INTEGER", "REAL",    "INTEGER", "*******" };
 
+struct entity;
+struct field;
+struct relation;
+
+/* Paths are parsed as names and resolved to the entity and field they name
+ * once the whole model is known. */
 struct fpath
 {
-    char* eid;
-    char* fid;
+    char*          eid;
+    char*          fid;
+    struct entity* entity;
+    struct field*  field;
 };
 
 struct order
@@ -57,14 +65,82 @@ struct order
 
 struct arg;
 
+/* -- FORMULA FUNCTIONS -- */
+
+typedef enum
+{
+    OP_UNKNOWN,
+    OP_GET,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SUM,
+    OP_MIN,
+    OP_MAX,
+    OP_AVG,
+    OP_COUNT,
+    OP_AVG_IF_EQ,
+    OP_COUNT_IF_EQ,
+    OP_ROLLING_DAYS_AVG,
+    OP_ROLLING_DAYS_SUM,
+    OP_REF_EQ
+} fop;
+
+/* What a function compiles to: a single value, an arithmetic operator, an
+ * aggregate over a relation, optionally filtered by equality or by a date
+ * window, or a filter of REF choices. */
+typedef enum
+{
+    FUNC_NONE,
+    FUNC_VALUE,
+    FUNC_ARITH,
+    FUNC_AGG,
+    FUNC_AGG_EQ,
+    FUNC_AGG_DAYS,
+    FUNC_FILTER
+} fkind;
+
+struct func_spec
+{
+    const char* name;
+    int         n_args;
+    fkind       kind;
+    const char* sql;
+};
+
+/* Indexed by fop; sql is the operator or aggregate function generated. */
+static const struct func_spec FUNCS[] = {
+    [OP_UNKNOWN]          = { "", 0, FUNC_NONE, "" },
+    [OP_GET]              = { "Get", 1, FUNC_VALUE, "" },
+    [OP_SUB]              = { "Sub", 2, FUNC_ARITH, "-" },
+    [OP_MUL]              = { "Mul", 2, FUNC_ARITH, "*" },
+    [OP_DIV]              = { "Div", 2, FUNC_ARITH, "*1.0/" },
+    [OP_SUM]              = { "Sum", 1, FUNC_AGG, "SUM" },
+    [OP_MIN]              = { "Min", 1, FUNC_AGG, "MIN" },
+    [OP_MAX]              = { "Max", 1, FUNC_AGG, "MAX" },
+    [OP_AVG]              = { "Avg", 1, FUNC_AGG, "AVG" },
+    [OP_COUNT]            = { "Count", 1, FUNC_AGG, "COUNT" },
+    [OP_AVG_IF_EQ]        = { "AvgIfEq", 3, FUNC_AGG_EQ, "AVG" },
+    [OP_COUNT_IF_EQ]      = { "CountIfEq", 3, FUNC_AGG_EQ, "COUNT" },
+    [OP_ROLLING_DAYS_AVG] = { "RollingDaysAvg", 3, FUNC_AGG_DAYS, "AVG" },
+    [OP_ROLLING_DAYS_SUM] = { "RollingDaysSum", 3, FUNC_AGG_DAYS, "SUM" },
+    [OP_REF_EQ]           = { "RefEq", 2, FUNC_FILTER, "" }
+};
+
+#define N_FUNCS (sizeof(FUNCS) / sizeof(FUNCS[0]))
+
 #define MAX_ARGS 10
 struct func
 {
     char*       name;
+    fop         op;
     int         n_args;
     struct arg* args[MAX_ARGS];
 };
 
+/* Arguments resolve against the entity owning the formula: ATFIELD names
+ * one of its fields, ATREF a field reached through one of its REF fields or
+ * relations. */
 struct arg
 {
     enum t
@@ -73,9 +149,12 @@ struct arg
         ATFIELD,
         ATREF
     } type;
-    struct func* atfunc;
-    char*        atfield;
-    char*        atentity;
+    struct func*     atfunc;
+    char*            atfield;
+    char*            atentity;
+    struct field*    field;
+    struct field*    ref;
+    struct relation* relation;
 };
 
 typedef struct args_stack_element
@@ -97,9 +176,14 @@ struct field
     bool         listed;
     bool         hidden;
     bool         bar;
+    bool         materialized;
     struct func* filter;
     struct func* autofunc;
     struct func* autocond;
+
+    struct entity* entity;
+    int            id;
+    const char*    label;
 };
 
 struct relation
@@ -108,15 +192,23 @@ struct relation
     struct fpath   fk;
     struct order   order;
     UT_hash_handle hh;
+    const char*    label;
 };
 
+struct query_plan;
+
 struct entity
 {
     UT_hash_handle hh;
 
-    char*            name;
-    struct field*    fields;
-    struct relation* relations;
+    char*              name;
+    struct field*      fields;
+    struct relation*   relations;
+    bool               fulltext;
+    struct query_plan* plan;
+    struct field**     field_list;
+    int                n_fields;
+    const char*        label;
 };
 
 struct label
@@ -145,6 +237,19 @@ int
 find_entity(const struct entity* es, const char* name, struct entity** e);
 void
 cleanup_entities(struct entity* es);
+int
+resolve_model(struct entity* es, const struct fpath** unresolved);
+
+/* Walks the fields of a resolved entity in declaration order. */
+#define $foreach_field(V, E)                                                   \
+    for (struct field **V##_it = (E)->field_list, *V = NULL;                   \
+         V##_it < (E)->field_list + (E)->n_fields && (V = *V##_it) != NULL;    \
+         V##_it++)
+
+/* -- FUNCTION HELPERS -- */
+
+fop
+find_func(const char* name);
 
 /* -- FIELD HELPERS -- */
 
@@ -177,11 +282,16 @@ struct label*
 create_label();
 void
 reg_label(struct translation* e, struct label* l);
-const char*
-translate(const char*);
 void
 cleanup_translations(struct translation* ts);
-#define _TR translate
+
+/* Labels the entities, fields and relations of a resolved model with the
+ * terms of a language, falling back to their names. Returns -1 if there is
+ * no such language. */
+int
+translate_model(struct entity*            es,
+                const struct translation* ts,
+                const char*               language);
 
 /* -- EXTERN STORAGE -- */
 
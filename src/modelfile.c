@@ -0,0 +1,409 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/iterators.h"
+#include "sds/sds.h"
+
+#include "modelfile.h"
+#include "rdsl.h"
+
+static const char COMPILED_MODEL_MAGIC[4] = { 'T', 'B', 'M', 'C' };
+
+/* A compiled model starts with a header identifying the source it was
+ * compiled from, followed by the model as a flat sequence of integers and
+ * length-prefixed strings, in the order the parser registered it. */
+struct compiled_model_header
+{
+    char     magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t source_size;
+};
+
+static uint64_t
+hash_source(const char* buf, size_t size)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static sds
+compiled_model_filename(const char* filename)
+{
+    size_t n = strlen(filename);
+    if (n > 5 && strcmp(filename + n - 5, ".tbmf") == 0) n -= 5;
+    return sdscat(sdsnewlen(filename, n), ".tbmc");
+}
+
+/* -- WRITING -- */
+
+static void
+put_int(FILE* out, int32_t v)
+{
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+static void
+put_str(FILE* out, const char* s)
+{
+    // NULL strings are written with a length of -1.
+    if (s == NULL) {
+        put_int(out, -1);
+        return;
+    }
+    int32_t n = strlen(s);
+    put_int(out, n);
+    fwrite(s, 1, n, out);
+}
+
+static void
+put_func(FILE* out, const struct func* f)
+{
+    put_int(out, f != NULL);
+    if (f == NULL) return;
+    put_str(out, f->name);
+    put_int(out, f->n_args);
+    for (int i = 0; i < f->n_args; i++) {
+        const struct arg* a = f->args[i];
+        put_int(out, a->type);
+        put_str(out, a->atfield);
+        put_str(out, a->atentity);
+        put_func(out, a->atfunc);
+    }
+}
+
+static void
+put_fpath(FILE* out, const struct fpath* p)
+{
+    put_str(out, p->eid);
+    put_str(out, p->fid);
+}
+
+static void
+put_field(FILE* out, const struct field* f)
+{
+    put_str(out, f->name);
+    put_int(out, f->type);
+    put_int(out, f->length);
+    put_fpath(out, &f->ref);
+    put_fpath(out, &f->order.fpath);
+    put_int(out, f->order.asc);
+    put_str(out, f->format);
+    put_int(out, f->listed);
+    put_int(out, f->hidden);
+    put_int(out, f->bar);
+    put_int(out, f->materialized);
+    put_func(out, f->filter);
+    put_func(out, f->autofunc);
+    put_func(out, f->autocond);
+}
+
+static void
+put_relation(FILE* out, const struct relation* r)
+{
+    put_str(out, r->name);
+    put_fpath(out, &r->fk);
+    put_fpath(out, &r->order.fpath);
+    put_int(out, r->order.asc);
+}
+
+static void
+write_compiled_model(const char* filename, uint64_t hash, uint64_t size)
+{
+    // The cache is an optimization, a model that cannot be written is
+    // parsed again on the next run.
+    sds   cname = compiled_model_filename(filename);
+    sds   tname = sdscatprintf(sdsempty(), "%s.%d", cname, (int)getpid());
+    FILE* out   = fopen(tname, "wb");
+    if (out == NULL) goto cleanup;
+    struct compiled_model_header h = { .version     = COMPILED_MODEL_VERSION,
+                                       .source_hash = hash,
+                                       .source_size = size };
+    memcpy(h.magic, COMPILED_MODEL_MAGIC, sizeof(h.magic));
+    fwrite(&h, sizeof(h), 1, out);
+    put_str(out, g_title);
+    put_int(out, HASH_COUNT(g_entities));
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        put_str(out, e->name);
+        put_int(out, e->fulltext);
+        put_int(out, HASH_COUNT(e->fields));
+        $foreach_hashed(struct field*, f, e->fields) { put_field(out, f); }
+        put_int(out, HASH_COUNT(e->relations));
+        $foreach_hashed(struct relation*, r, e->relations)
+        {
+            put_relation(out, r);
+        }
+    }
+    put_int(out, HASH_COUNT(g_translations));
+    $foreach_hashed(struct translation*, t, g_translations)
+    {
+        put_str(out, t->language);
+        put_int(out, HASH_COUNT(t->labels));
+        $foreach_hashed(struct label*, l, t->labels)
+        {
+            put_str(out, l->term);
+            put_str(out, l->label);
+        }
+    }
+    // Renamed into place so that a concurrent run never reads half of it.
+    if (fclose(out) != 0 || rename(tname, cname) != 0) remove(tname);
+cleanup:
+    sdsfree(tname);
+    sdsfree(cname);
+}
+
+/* -- READING -- */
+
+struct model_reader
+{
+    const char* p;
+    const char* end;
+    bool        bad;
+};
+
+static int32_t
+get_int(struct model_reader* r)
+{
+    int32_t v = 0;
+    if (r->end - r->p < (ptrdiff_t)sizeof(v)) {
+        r->bad = true;
+        return 0;
+    }
+    memcpy(&v, r->p, sizeof(v));
+    r->p += sizeof(v);
+    return v;
+}
+
+static sds
+get_str(struct model_reader* r)
+{
+    int32_t n = get_int(r);
+    if (n < 0) return NULL;
+    if (r->end - r->p < n) {
+        r->bad = true;
+        return NULL;
+    }
+    sds s = sdsnewlen(r->p, n);
+    r->p += n;
+    return s;
+}
+
+static struct func*
+get_func(struct model_reader* r)
+{
+    if (!get_int(r)) return NULL;
+    struct func* f = calloc(1, sizeof(struct func));
+    f->name        = get_str(r);
+    f->op          = find_func(f->name);
+    int n_args     = get_int(r);
+    for (int i = 0; i < n_args && i < MAX_ARGS && !r->bad; i++) {
+        struct arg* a = calloc(1, sizeof(struct arg));
+        a->type       = get_int(r);
+        a->atfield    = get_str(r);
+        a->atentity   = get_str(r);
+        a->atfunc     = get_func(r);
+        f->args[i]    = a;
+        f->n_args++;
+    }
+    if (n_args > MAX_ARGS || f->op == OP_UNKNOWN) r->bad = true;
+    return f;
+}
+
+static void
+get_fpath(struct model_reader* r, struct fpath* p)
+{
+    p->eid = get_str(r);
+    p->fid = get_str(r);
+}
+
+static struct field*
+get_field(struct model_reader* r)
+{
+    struct field* f = create_field();
+    f->name         = get_str(r);
+    f->type         = get_int(r);
+    f->length       = get_int(r);
+    get_fpath(r, &f->ref);
+    get_fpath(r, &f->order.fpath);
+    f->order.asc    = get_int(r);
+    f->format       = get_str(r);
+    f->listed       = get_int(r);
+    f->hidden       = get_int(r);
+    f->bar          = get_int(r);
+    f->materialized = get_int(r);
+    f->filter       = get_func(r);
+    f->autofunc     = get_func(r);
+    f->autocond     = get_func(r);
+    return f;
+}
+
+static struct relation*
+get_relation(struct model_reader* r)
+{
+    struct relation* rel = create_relation();
+    rel->name            = get_str(r);
+    get_fpath(r, &rel->fk);
+    get_fpath(r, &rel->order.fpath);
+    rel->order.asc = get_int(r);
+    return rel;
+}
+
+static bool
+read_model(struct model_reader* r)
+{
+    sds title = get_str(r);
+    if (title != NULL) {
+        sdsfree(g_title);
+        g_title = title;
+    }
+    int n_entities = get_int(r);
+    for (int i = 0; i < n_entities && !r->bad; i++) {
+        struct entity* e = create_entity();
+        e->name          = get_str(r);
+        e->fulltext      = get_int(r);
+        int n_fields     = get_int(r);
+        for (int j = 0; j < n_fields && !r->bad; j++) {
+            reg_field(e, get_field(r));
+        }
+        int n_relations = get_int(r);
+        for (int j = 0; j < n_relations && !r->bad; j++) {
+            reg_relation(e, get_relation(r));
+        }
+        reg_entity(&g_entities, e);
+    }
+    int n_translations = get_int(r);
+    for (int i = 0; i < n_translations && !r->bad; i++) {
+        struct translation* t = create_translation();
+        t->language           = get_str(r);
+        int n_labels          = get_int(r);
+        for (int j = 0; j < n_labels && !r->bad; j++) {
+            struct label* l = create_label();
+            l->term         = get_str(r);
+            l->label        = get_str(r);
+            reg_label(t, l);
+        }
+        reg_translation(&g_translations, t);
+    }
+    return !r->bad && r->p == r->end;
+}
+
+static bool
+read_compiled_model(const char* filename, uint64_t hash, uint64_t size)
+{
+    // The whole file is read at once and rebuilt into the model. Files of
+    // another version or source are ignored, as are corrupt ones.
+    sds   cname = compiled_model_filename(filename);
+    FILE* in    = fopen(cname, "rb");
+    sdsfree(cname);
+    if (in == NULL) return false;
+    char* buf = NULL;
+    long  n   = 0;
+    bool  ok  = false;
+    if (fseek(in, 0, SEEK_END) == 0 && (n = ftell(in)) > 0 &&
+        fseek(in, 0, SEEK_SET) == 0 && (buf = malloc(n)) != NULL &&
+        fread(buf, 1, n, in) == (size_t)n) {
+        struct compiled_model_header h;
+        if (n >= (long)sizeof(h)) {
+            memcpy(&h, buf, sizeof(h));
+            ok = memcmp(h.magic, COMPILED_MODEL_MAGIC, sizeof(h.magic)) == 0 &&
+                 h.version == COMPILED_MODEL_VERSION &&
+                 h.source_hash == hash && h.source_size == size;
+        }
+    }
+    fclose(in);
+    if (ok) {
+        struct model_reader r = { buf + sizeof(struct compiled_model_header),
+                                  buf + n };
+        ok                    = read_model(&r);
+        if (!ok) {
+            cleanup_translations(g_translations);
+            cleanup_entities(g_entities);
+            g_translations = NULL;
+            g_entities     = NULL;
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+/* -- PARSING -- */
+
+$status
+parse_model_file(const char* filename, bool use_cache)
+{
+    // The source is mapped into memory and handed to the parser byte by
+    // byte.
+    $status     ret = $okay;
+    struct stat st;
+    int         fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        $log_error("unable to open model file %s", filename);
+        return $error("unable to open file");
+    }
+    size_t size = st.st_size;
+    char*  buf  = size > 0
+                    ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                    : NULL;
+    close(fd);
+    if (buf == MAP_FAILED) {
+        $log_error("unable to map model file %s", filename);
+        return $error("unable to map file");
+    }
+
+    uint64_t hash   = hash_source(buf, size);
+    bool     cached = use_cache && read_compiled_model(filename, hash, size);
+    if (!cached) {
+        struct t_parser parser = { .buf = buf, .size = size };
+        prebase_context_t* ctx = prebase_create(&parser);
+        while (prebase_parse(ctx, NULL))
+            ;
+        prebase_destroy(ctx);
+        if (parser.error != 0) {
+            $log_error("unable to parse model file %s", filename);
+            ret = $error("unable to parse the model");
+            goto cleanup;
+        }
+    }
+    const struct fpath* unresolved;
+    if (resolve_model(g_entities, &unresolved) != 0) {
+        $log_error("unknown reference %s.%s", unresolved->eid, unresolved->fid);
+        ret = $error("unable to resolve the model");
+        goto cleanup;
+    }
+    // Only models that parsed and resolved are worth caching.
+    if (use_cache && !cached) write_compiled_model(filename, hash, size);
+cleanup:
+    if (buf != NULL) munmap(buf, size);
+    return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_MODELFILE_H_
+#define _TURBOBUILDER_MODELFILE_H_
+
+#include <stdbool.h>
+
+#include "coastguard/coastguard.h"
+
+#define COMPILED_MODEL_VERSION 1
+
+/* -- MODEL FILES -- */
+
+/* Parses the model file into g_entities, g_translations and g_title and
+ * resolves the references between entities. With use_cache, a model
+ * compiled from the same source is loaded from the .tbmc file next to it
+ * instead, and a successful parse writes one. */
+$status
+parse_model_file(const char* filename, bool use_cache);
+
+#endif
@@ -15,7 +15,6 @@
  * You should have received a copy of the GNU General Public License along with
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <newt.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -27,28 +26,13 @@
 #include "core/iterators.h"
 #include "sds/sds.h"
 
+#include "formula.h"
 #include "model.h"
 #include "rdsl.h"
 
 #include "msql.h"
-
-struct query_extensions
-{
-    sds  select;
-    sds  from;
-    sds  join;
-    sds  where;
-    bool cmx;
-};
-$typedef(struct query_extensions) wrapped_qe;
-
-wrapped_qe
-augment_entity_query_inner(struct entity*          p,
-                           struct relation*        pr,
-                           struct entity*          e,
-                           struct field*           ff,
-                           struct func*            f,
-                           struct query_extensions pqe);
+#include "refcache.h"
+#include "stmtcache.h"
 
 /* -- DATABASE INITIALIZATION -- */
 
@@ -58,10 +42,13 @@ new_entity_columns(struct entity* e)
     sds sql;
     $check(sql = sdsempty(), error);
     $check(e, error);
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
-        if (f->type == AUTO) break;
-        sql = sdscatprintf(sql, ", [%s] %s", f->name, FTYPES[f->type]);
+        if (f->type == AUTO && f->materialized == false) continue;
+        if (f->type == AUTO)
+            sql = sdscatprintf(sql, ", [%s]", f->name);
+        else
+            sql = sdscatprintf(sql, ", [%s] %s", f->name, FTYPES[f->type]);
         $check(sql, error);
     }
     return (wrapped_sql){ sql };
@@ -89,609 +76,545 @@ error:
     return $invalid(wrapped_sql);
 }
 
-$status
-create_tables_from_model(sqlite3* db)
+sds
+new_index(sds sql, const struct field* f, const struct field* o)
 {
-    char* err_msg = 0;
-    $foreach_hashed(struct entity*, e, g_entities)
-    {
-        wrapped_sql sql = new_entity_table(e);
-        $inspect(sql, error);
-        if (sqlite3_exec(db, sql.v, 0, 0, &err_msg) != SQLITE_OK) {
-            $log_debug("%s", sql.v);
-            $log_error(
-              "Failed to create table for entity [%s]: %s", e->name, err_msg);
-            sqlite3_free(err_msg);
-        } else {
-            $log_info("Tables created successfully");
+    const char* ename = f->entity->name;
+    if (f->type == AUTO) return sql;
+    if (o != NULL && o->type != AUTO && o != f) {
+        // Relation views filter on the foreign key and sort on the order
+        // column, always over active records only.
+        return sdscatprintf(sql,
+                            "CREATE INDEX IF NOT EXISTS [idx_%ss_%s_%s] "
+                            "ON [%ss]([%s],[%s]) WHERE _archived IS NULL;",
+                            ename,
+                            f->name,
+                            o->name,
+                            ename,
+                            f->name,
+                            o->name);
+    }
+    return sdscatprintf(sql,
+                        "CREATE INDEX IF NOT EXISTS [idx_%ss_%s] "
+                        "ON [%ss]([%s]);",
+                        ename,
+                        f->name,
+                        ename,
+                        f->name);
+}
+
+sds
+new_order_index(sds sql, struct order* o)
+{
+    const struct field* f = o->fpath.field;
+    if (f == NULL || f->type == AUTO) return sql;
+    return sdscatprintf(sql,
+                        "CREATE INDEX IF NOT EXISTS [idx_%ss_%s_active] "
+                        "ON [%ss]([%s]) WHERE _archived IS NULL;",
+                        o->fpath.eid,
+                        o->fpath.fid,
+                        o->fpath.eid,
+                        o->fpath.fid);
+}
+
+/* Rolling windows read the records of a relation by foreign key and date
+ * range. Archived records are not excluded by every query reading them, so
+ * unlike the relation view index this one covers the whole table. */
+sds
+new_rolling_indexes(sds sql, const struct func* f)
+{
+    if (f == NULL) return sql;
+    if (FUNCS[f->op].kind == FUNC_AGG_DAYS) {
+        const struct relation* r = f->args[0]->relation;
+        const struct field*    d = f->args[1]->field;
+        if (r != NULL && r->fk.field != NULL && d != NULL &&
+            d->entity == r->fk.entity && d->type != AUTO) {
+            sql = sdscatprintf(sql,
+                               "CREATE INDEX IF NOT EXISTS "
+                               "[idx_%ss_%s_%s_window] ON [%ss]([%s],[%s]);",
+                               r->fk.eid,
+                               r->fk.fid,
+                               d->name,
+                               r->fk.eid,
+                               r->fk.fid,
+                               d->name);
         }
-        sdsfree(sql.v);
     }
-    return $okay;
-error:
-    return $error("failure creating model tables");
+    for (int i = 0; i < f->n_args && sql != NULL; i++) {
+        if (f->args[i]->type == ATFUNC)
+            sql = new_rolling_indexes(sql, f->args[i]->atfunc);
+    }
+    return sql;
 }
 
 wrapped_sql
-build_entity_query_joins(struct entity* e, bool listed_only)
+new_entity_indexes(struct entity* e)
 {
-    sds join;
-    $check(join = sdsempty());
-    $foreach_hashed(struct field*, f, e->fields)
+    sds sql;
+    $check(sql = sdsempty());
+    $foreach_field(f, e)
     {
-        if (listed_only && f->listed == false) break;
-        struct entity* next_entity = e;
-        struct field*  next_field  = f;
-        while (next_field->type == REF) {
-            $check(join =
-                     sdscatprintf(join,
-                                  " INNER JOIN [%ss] ON [%ss].Id = [%ss].[%s]",
-                                  next_field->ref.eid,
-                                  next_field->ref.eid,
-                                  next_entity->name,
-                                  next_field->name));
-            $check(find_entity(g_entities, next_field->ref.eid, &next_entity) ==
-                   0);
-            $check(find_field(next_entity->fields,
-                              next_field->ref.fid,
-                              &next_field) == 0);
+        if (f->type == REF) {
+            $check(sql = new_index(sql, f, NULL));
+            $check(sql = new_order_index(sql, &f->order));
+        }
+        if (f->type == AUTO) {
+            $check(sql = new_rolling_indexes(sql, f->autofunc));
         }
     }
-    return (wrapped_sql){ join };
+    $foreach_hashed(struct relation*, r, e->relations)
+    {
+        const struct field* o = NULL;
+        if (r->fk.field == NULL) continue;
+        if (r->order.fpath.entity == r->fk.entity) o = r->order.fpath.field;
+        $check(sql = new_index(sql, r->fk.field, o));
+        $check(sql = new_order_index(sql, &r->order));
+    }
+    return (wrapped_sql){ sql };
 error:
-    if (join != NULL) sdsfree(join);
+    if (sql != NULL) sdsfree(sql);
     return $invalid(wrapped_sql);
 }
 
-sds
-replace_string_in_sds(sds source, sds old, sds new)
+$status
+create_fulltext_index(sqlite3* db, struct entity* e)
 {
-    sds  newjoin = sdsempty();
-    sds* tokens;
-    int  count, j;
-    tokens  = sdssplitlen(source, sdslen(source), old, sdslen(old), &count);
-    newjoin = sdscatprintf(newjoin, "%s", tokens[0]);
-    for (j = 1; j < count; j++) {
-        newjoin = sdscatprintf(newjoin, "[%s]%s", new, tokens[j]);
+    char*         err_msg = 0;
+    sqlite3_stmt* res;
+    bool          exists;
+    $check(sqlite3_prepare_v2(db,
+                              "SELECT 1 FROM sqlite_master WHERE name = @name",
+                              -1,
+                              &res,
+                              0) == SQLITE_OK,
+           error);
+    sds name = sdscatprintf(sdsempty(), "%ss_fts", e->name);
+    sqlite3_bind_text(res, 1, name, sdslen(name), SQLITE_TRANSIENT);
+    exists = sqlite3_step(res) == SQLITE_ROW;
+    sqlite3_finalize(res);
+    sdsfree(name);
+    if (exists) return $okay;
+
+    // A new search index starts with every active record already in it.
+    if (sqlite3_exec(db, e->plan->fts_sql, 0, 0, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(db, e->plan->fts_insert_sql, 0, 0, &err_msg) !=
+          SQLITE_OK) {
+        $log_error("Failed to create full-text index for entity [%s]: %s",
+                   e->name,
+                   err_msg);
+        sqlite3_free(err_msg);
+        goto error;
     }
-    sdsfreesplitres(tokens, count);
-    sdsfree(source);
-    return newjoin;
+    return $okay;
+error:
+    return $error("failure creating full-text index");
 }
 
-struct efpair
+/* -- MATERIALIZED FIELDS -- */
+
+struct materialized
 {
-    struct field*  f;
-    struct entity* e;
-} find_relation_field(struct entity* p, const char* ename, const char* fname)
+    struct entity*  e;
+    struct field*   f;
+    struct formula* fm;
+    bool            done;
+};
+
+static sds
+build_materialized_update(const struct materialized* m)
 {
-    struct relation* p_relation = NULL;
-    struct field*    p_field    = NULL;
-    struct entity*   r_entity;
-    struct field*    r_field;
-    if (find_field(p->fields, ename, &p_field) != 0) {
-        if (find_relation(p->relations, ename, &p_relation) != 0)
-            return (struct efpair){ NULL, NULL };
-    }
-    if (p_relation != NULL) {
-        $check(find_entity(g_entities, p_relation->fk.eid, &r_entity) == 0);
-    } else {
-        $check(find_entity(g_entities, p_field->ref.eid, &r_entity) == 0);
-    }
-    $check(find_field(r_entity->fields, fname, &r_field) == 0);
-    return (struct efpair){ r_field, r_entity };
-error:
-    return (struct efpair){ NULL, NULL };
+    return sdscatprintf(sdsempty(),
+                        "UPDATE [%ss] SET [%s] = %s",
+                        m->e->name,
+                        m->f->name,
+                        m->fm->sql);
 }
 
-wrapped_qe
-augment_entity_query_agg(struct entity*          p,
-                         struct relation*        pr,
-                         struct entity*          e,
-                         struct field*           ff,
-                         struct func*            f,
-                         const char*             agg,
-                         struct query_extensions pqe)
-{
-    sds select = sdsempty();
-    sds from   = sdsempty();
-    sds gb     = sdscatprintf(sdsempty(), "GROUP BY [%ss].[Id]", e->name);
-    const char* template =
-      "(SELECT %s(%s) %s %s %s FROM %s %s %s %s %s %s) %s %s";
-    if (f->args[0]->type == ATREF) {
-        struct relation* r;
-        struct entity*   r_entity;
-        struct field*    r_field;
-        $check(find_relation(e->relations, f->args[0]->atentity, &r) == 0);
-        $check(find_entity(g_entities, r->fk.eid, &r_entity) == 0);
-        $check(find_field(r_entity->fields, f->args[0]->atfield, &r_field) ==
-               0);
-
-        // This is the Id we provide our caller to use in their SELECT
-        // statement.
-        sds uuid = sdscatprintf(
-          sdsempty(), "uuid%s%s%s", r_field->name, e->name, ff->name);
-        $check(select = sdscatprintf(select, "%s.%s", uuid, uuid));
-
-        wrapped_sql join = build_entity_query_joins(r_entity, false);
-
-        // This additional select fragments are required to allow for binding
-        // cascaded entities Ids in join statements.
-        sds more_selects = sdsempty();
-        $foreach_hashed(struct field*, f, e->fields)
-        {
-            if (f->type == REF) {
-                $check(
-                  more_selects = sdscatprintf(
-                    more_selects, ", [%ss].%s %s", e->name, f->name, f->name));
-            }
-        }
+static sds*
+add_trigger(sds* triggers, int* n, sds trigger)
+{
+    triggers       = realloc(triggers, (*n + 1) * sizeof(sds));
+    triggers[(*n)++] = trigger;
+    return triggers;
+}
 
-        // This join extension is required when the fields is a reference
-        // to a simple (non-AUTO) field.
-        sds join_with_ref =
-          sdscatprintf(sdsempty(),
-                       "INNER JOIN [%ss] ON [%ss].[%s]=[%ss].[Id] ",
-                       e->name,
-                       r->fk.eid,
-                       r->fk.fid,
-                       e->name);
-
-        // This prefix augments anything coming in from cascaded
-        // AUTO fields, basically ensuring we are considering only
-        // active and associated records.
-        sds where_prefix =
-          sdscatprintf(sdsempty(), " WHERE ([%ss]._archived IS NULL)", e->name);
-        if (p == NULL) {
-            where_prefix =
-              sdscatprintf(where_prefix, " AND [%ss].Id=@id", e->name);
+static sds*
+build_materialized_triggers(const struct materialized* m,
+                            sds*                       triggers,
+                            int*                       n)
+{
+    // Every change to a row the formula reads recomputes the value of the
+    // rows it contributes to, updates that leave the read columns as they
+    // were are skipped.
+    const char* ename  = m->e->name;
+    const char* fname  = m->f->name;
+    sds         update = build_materialized_update(m);
+    triggers           = add_trigger(
+      triggers,
+      n,
+      sdscatprintf(sdsempty(),
+                   "CREATE TRIGGER [mat_%s_%s_ins] AFTER INSERT ON [%ss] "
+                   "BEGIN %s WHERE Id = NEW.Id; END",
+                   ename,
+                   fname,
+                   ename,
+                   update));
+    for (int k = 0; k < m->fm->n_deps; k++) {
+        const struct formula_dep* d       = &m->fm->deps[k];
+        sds                       columns = sdsempty();
+        sds                       changed = sdsempty();
+        for (int i = 0; i < d->n_columns; i++) {
+            columns = sdscatprintf(
+              columns, "%s[%s]", i > 0 ? ", " : "", d->columns[i]);
+            changed = sdscatprintf(changed,
+                                   "%sOLD.[%s] IS NOT NEW.[%s]",
+                                   i > 0 ? " OR " : "",
+                                   d->columns[i],
+                                   d->columns[i]);
         }
-
-        wrapped_qe a;
-        if (r_field->type == AUTO) {
-            sds empty_where = sdsempty();
-            a               = augment_entity_query_inner(
-              e,
-              r,
-              r_entity,
-              r_field,
-              r_field->autofunc,
-              (struct query_extensions){
-                .where = empty_where, .join = join_with_ref, .cmx = pqe.cmx });
-            sdsfree(empty_where);
-            $inspect(a);
-            if (strcmp(a.v.from, "") == 0)
-                a.v.from = sdscatprintf(a.v.from, "[%ss]", r->fk.eid);
-
-            if (strstr(a.v.from, "SELECT") != NULL) {
-                sds searchstr =
-                  sdscatprintf(sdsempty(), "[%ss]", r_entity->name);
-                sds otheruuid =
+        if (d->n_steps == 0) {
+            triggers = add_trigger(
+              triggers,
+              n,
+              sdscatprintf(
+                sdsempty(),
+                "CREATE TRIGGER [mat_%s_%s_%d_upd] AFTER UPDATE OF %s ON "
+                "[%ss] WHEN %s BEGIN %s WHERE Id = NEW.Id; END",
+                ename,
+                fname,
+                k,
+                columns,
+                ename,
+                changed,
+                update));
+        } else {
+            sds new_ids = formula_affected_ids(d, "NEW");
+            sds old_ids = formula_affected_ids(d, "OLD");
+            triggers    = add_trigger(
+              triggers,
+              n,
+              sdscatprintf(sdsempty(),
+                           "CREATE TRIGGER [mat_%s_%s_%d_upd] AFTER UPDATE OF "
+                           "%s ON [%ss] WHEN %s BEGIN %s WHERE Id IN (%s) OR "
+                           "Id IN (%s); END",
+                           ename,
+                           fname,
+                           k,
+                           columns,
+                           d->e->name,
+                           changed,
+                           update,
+                           new_ids,
+                           old_ids));
+            // Rows only appear under, or disappear from, the rows of a
+            // relation, a referenced row has no referrers when inserted.
+            if (d->steps[d->n_steps - 1].child) {
+                triggers = add_trigger(
+                  triggers,
+                  n,
+                  sdscatprintf(sdsempty(),
+                               "CREATE TRIGGER [mat_%s_%s_%d_ins] AFTER INSERT "
+                               "ON [%ss] BEGIN %s WHERE Id IN (%s); END",
+                               ename,
+                               fname,
+                               k,
+                               d->e->name,
+                               update,
+                               new_ids));
+                triggers = add_trigger(
+                  triggers,
+                  n,
                   sdscatprintf(sdsempty(),
-                               "uuid%s%s%s",
-                               r_field->autofunc->args[0]->atfield,
-                               r_entity->name,
-                               r_field->name);
-                join.v = replace_string_in_sds(join.v, searchstr, otheruuid);
-                sdsfree(searchstr);
-                sdsfree(otheruuid);
+                               "CREATE TRIGGER [mat_%s_%s_%d_del] AFTER DELETE "
+                               "ON [%ss] BEGIN %s WHERE Id IN (%s); END",
+                               ename,
+                               fname,
+                               k,
+                               d->e->name,
+                               update,
+                               old_ids));
             }
+            sdsfree(new_ids);
+            sdsfree(old_ids);
         }
-        sds conditionals_selects = sdsempty();
-        $foreach_hashed(struct field*, f, r_entity->fields)
-        {
-            if (f->type == REF) {
-                $check(conditionals_selects = sdscatprintf(conditionals_selects,
-                                                           ", [%ss].%s %s",
-                                                           r_entity->name,
-                                                           f->name,
-                                                           f->name));
+        sdsfree(columns);
+        sdsfree(changed);
+    }
+    sdsfree(update);
+    return triggers;
+}
+
+static bool
+materialized_inputs_done(const struct materialized* m,
+                         const struct materialized* ms,
+                         int                        n)
+{
+    for (int k = 0; k < m->fm->n_deps; k++) {
+        const struct formula_dep* d = &m->fm->deps[k];
+        for (int i = 0; i < d->n_columns; i++) {
+            for (int j = 0; j < n; j++) {
+                if (ms[j].done == false && &ms[j] != m && ms[j].e == d->e &&
+                    strcmp(ms[j].f->name, d->columns[i]) == 0)
+                    return false;
             }
         }
-        sds base_select = sdsempty();
-        $check(base_select = sdscatprintf(
-                 base_select, "[%ss].%s", r->fk.eid, f->args[0]->atfield));
-        sds fr = sdscatprintf(sdsempty(), "%ss", r->fk.eid);
-        sds conditionals_join =
-          sdscatprintf(sdsempty(),
-                       "INNER JOIN [%ss] ON [%s].[%s]=[%ss].[Id] ",
-                       e->name,
-                       uuid,
-                       r->fk.fid,
-                       e->name);
-        bool is_deep              = p != NULL;
-        bool is_auto              = r_field->type == AUTO;
-        bool is_deep_auto         = is_auto && p != NULL;
-        bool is_deep_auto_in_cond = is_deep_auto && pqe.cmx;
-        $check(from =
-                 sdscatprintf(from,
-                              template,
-                              agg,
-                              is_auto ? a.v.select : base_select,
-                              uuid,
-                              more_selects,
-                              is_deep_auto_in_cond ? conditionals_selects : "",
-                              is_auto ? a.v.from : fr,
-                              is_auto ? join.v : join_with_ref,
-                              pqe.join,
-                              where_prefix,
-                              pqe.where,
-                              is_deep ? gb : "",
-                              uuid,
-                              is_deep_auto_in_cond ? conditionals_join : ""));
-        if (is_auto) {
-            sdsfree(a.v.where);
-            sdsfree(a.v.select);
-            sdsfree(a.v.from);
-        }
-        sdsfree(conditionals_selects);
-        sdsfree(conditionals_join);
-        sdsfree(base_select);
-        sdsfree(fr);
-        sdsfree(more_selects);
-        sdsfree(where_prefix);
-        sdsfree(join_with_ref);
-        sdsfree(uuid);
-    }
-    sdsfree(gb);
-    return (wrapped_qe){ (struct query_extensions){
-      select, from, .where = sdsempty() } };
-error:
-    sdsfree(gb);
-    sdsfree(from);
-    sdsfree(select);
-    return $invalid(wrapped_qe);
+    }
+    return true;
 }
 
-/* -- FORMULAS (AUTOMATIC FIELDS) -- */
+static $status
+recompute_materialized_fields(sqlite3* db, struct materialized* ms, int n)
+{
+    // Fields are computed after the materialized fields they read, a cycle
+    // leaves the remaining fields in model order.
+    char* err_msg = 0;
+    for (int left = n; left > 0; left--) {
+        int next = -1;
+        for (int j = 0; j < n && next < 0; j++) {
+            if (!ms[j].done && materialized_inputs_done(&ms[j], ms, n))
+                next = j;
+        }
+        for (int j = 0; j < n && next < 0; j++) {
+            if (!ms[j].done) next = j;
+        }
+        sds sql = build_materialized_update(&ms[next]);
+        int rc  = sqlite3_exec(db, sql, 0, 0, &err_msg);
+        sdsfree(sql);
+        if (rc != SQLITE_OK) {
+            $log_error("Failed to compute field [%s.%s]: %s",
+                       ms[next].e->name,
+                       ms[next].f->name,
+                       err_msg);
+            sqlite3_free(err_msg);
+            return $error("failure computing materialized fields");
+        }
+        ms[next].done = true;
+    }
+    return $okay;
+}
 
-wrapped_qe
-augment_entity_query_nocond_agg(struct entity*          p,
-                                struct relation*        pr,
-                                struct entity*          e,
-                                struct field*           ff,
-                                struct func*            f,
-                                const char*             agg,
-                                struct query_extensions pqe)
+static bool
+materialized_column_exists(sqlite3* db, const struct materialized* m)
 {
-    pqe.where     = sdsempty();
-    wrapped_qe qe = augment_entity_query_agg(p, pr, e, ff, f, agg, pqe);
-    $inspect(qe);
-error:
-    return qe;
+    sqlite3_stmt* res;
+    sds sql = sdscatprintf(
+      sdsempty(), "SELECT [%s] FROM [%ss] LIMIT 0", m->f->name, m->e->name);
+    bool exists = sqlite3_prepare_v2(db, sql, -1, &res, 0) == SQLITE_OK;
+    sqlite3_finalize(res);
+    sdsfree(sql);
+    return exists;
 }
 
-wrapped_qe
-augment_entity_query_get(struct entity*          p,
-                         struct relation*        pr,
-                         struct entity*          e,
-                         struct field*           ff,
-                         struct func*            f,
-                         struct query_extensions pqe)
-{
-    struct arg* arg    = f->args[0];
-    sds         select = sdsempty();
-    sds         from   = sdsempty();
-    sds         where  = sdsempty();
-    if (arg->type == ATREF) {
-        struct field*  er;
-        struct entity* r_entity;
-        struct field*  r_field;
-        $check(find_field(e->fields, arg->atentity, &er) == 0);
-        $check(find_entity(g_entities, er->ref.eid, &r_entity) == 0);
-        $check(find_field(r_entity->fields, arg->atfield, &r_field) == 0);
-        if (r_field->type == AUTO) {
-            wrapped_qe a;
-            a = augment_entity_query_inner(
-              e, pr, r_entity, r_field, r_field->autofunc, pqe);
-            $inspect(a);
-            select = a.v.select;
-            from   = a.v.from;
-            sdsfree(a.v.where);
-        } else {
-            if (p != NULL) {
-                from = sdscatprintf(from,
-                                    " INNER JOIN [%ss] ON [%ss].%s = [%ss].Id ",
-                                    r_entity->name,
-                                    e->name,
-                                    er->name,
-                                    r_entity->name);
+$status
+create_materialized_fields(sqlite3* db)
+{
+    // Stored values are only recomputed from scratch when the model changed
+    // them, that is when a column is missing or a trigger differs from the
+    // one the model generates.
+    $status             ret        = $okay;
+    struct materialized* ms        = NULL;
+    sds*                triggers   = NULL;
+    sds*                existing   = NULL;
+    int                 n          = 0;
+    int                 n_triggers = 0;
+    int                 n_existing = 0;
+    bool                stale      = false;
+    char*               err_msg    = 0;
+    sqlite3_stmt*       res;
+
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        for (int i = 0; i < e->plan->n_fields; i++) {
+            const struct field_plan* fp = &e->plan->fields[i];
+            if (fp->formula == NULL) continue;
+            struct materialized* grown =
+              realloc(ms, (n + 1) * sizeof(struct materialized));
+            $check(grown != NULL, "out of memory", error);
+            ms    = grown;
+            ms[n] = (struct materialized){ e, fp->base, fp->formula, false };
+            triggers =
+              build_materialized_triggers(&ms[n], triggers, &n_triggers);
+            if (!materialized_column_exists(db, &ms[n])) {
+                sds sql = sdscatprintf(sdsempty(),
+                                       "ALTER TABLE [%ss] ADD COLUMN [%s]",
+                                       e->name,
+                                       fp->base->name);
+                int rc  = sqlite3_exec(db, sql, 0, 0, 0);
+                sdsfree(sql);
+                if (rc != SQLITE_OK) {
+                    $log_error("Failed to add column for field [%s.%s]: %s",
+                               e->name,
+                               fp->base->name,
+                               sqlite3_errmsg(db));
+                    goto error;
+                }
+                stale = true;
             }
-            $check(select = sdscatprintf(
-                     select, "[%ss].%s", arg->atentity, arg->atfield));
+            n++;
         }
     }
-    return (
-      wrapped_qe){ (struct query_extensions){ select, from, .where = where } };
-error:
-    sdsfree(select);
-    sdsfree(from);
-    sdsfree(where);
-    return $invalid(wrapped_qe);
-}
 
-wrapped_qe
-augment_entity_query_if_cond_agg_arg(struct arg*             arg,
-                                     struct entity*          p,
-                                     struct relation*        pr,
-                                     struct entity*          e,
-                                     struct func*            f,
-                                     struct query_extensions pqe)
-{
-    wrapped_qe arg2qe;
-    arg2qe.v.select = sdsempty();
-    arg2qe.v.join   = sdsempty();
-    struct efpair arg2ef;
-    if (arg->type == ATFIELD) {
-        arg2qe.v.select =
-          sdscatprintf(arg2qe.v.select, "[%ss].%s", e->name, arg->atfield);
-    }
-    if (arg->type == ATREF) {
-        arg2ef = find_relation_field(e, arg->atentity, arg->atfield);
-        if (arg2ef.f->type == AUTO) {
-            arg2qe = augment_entity_query_inner(
-              e, pr, arg2ef.e, arg2ef.f, arg2ef.f->autofunc, pqe);
-            arg2qe.v.join =
-              sdscatprintf(arg2qe.v.from,
-                           " INNER JOIN [%ss] on [%ss].id = [%ss].%s ",
-                           arg2ef.e->name,
-                           arg2ef.e->name,
-                           e->name,
-                           arg->atentity);
-        } else {
-            if (strcmp(f->args[0]->atentity, arg->atentity) == 0) {
-                struct relation* r;
-                find_relation(e->relations, f->args[0]->atentity, &r);
-                arg2qe.v.select = sdscatprintf(
-                  arg2qe.v.select, "[%ss].%s", r->fk.eid, arg->atfield);
-            } else {
-                arg2qe.v.select = sdscatprintf(
-                  arg2qe.v.select, "[%ss].%s", arg2ef.e->name, arg->atfield);
-                arg2qe.v.join =
-                  sdscatprintf(arg2qe.v.join,
-                               " INNER JOIN [%ss] ON [%ss].Id = [%ss].%s ",
-                               arg2ef.e->name,
-                               arg2ef.e->name,
-                               e->name,
-                               arg->atentity);
-            }
+    $check(sqlite3_prepare_v2(db,
+                              "SELECT name, sql FROM sqlite_master WHERE type "
+                              "= 'trigger' AND name LIKE 'mat!_%' ESCAPE '!'",
+                              -1,
+                              &res,
+                              0) == SQLITE_OK,
+           sqlite3_errmsg(db),
+           error);
+    while (sqlite3_step(res) == SQLITE_ROW) {
+        const char* sql   = (const char*)sqlite3_column_text(res, 1);
+        bool        found = false;
+        for (int i = 0; i < n_triggers && !found; i++) {
+            found = sql != NULL && strcmp(triggers[i], sql) == 0;
+        }
+        stale      = stale || !found;
+        sds* grown = realloc(existing, (n_existing + 1) * sizeof(sds));
+        if (grown == NULL) {
+            sqlite3_finalize(res);
+            $log_error("out of memory");
+            goto error;
         }
+        existing               = grown;
+        existing[n_existing++] =
+          sdsnew((const char*)sqlite3_column_text(res, 0));
     }
-    return arg2qe;
-}
+    sqlite3_finalize(res);
+    stale = stale || n_existing != n_triggers;
+    if (!stale) goto cleanup;
 
-wrapped_qe
-augment_entity_query_if_cond_agg(struct entity*          p,
-                                 struct relation*        pr,
-                                 struct entity*          e,
-                                 struct field*           ff,
-                                 struct func*            f,
-                                 const char*             agg,
-                                 const char*             op,
-                                 struct query_extensions pqe)
-{
-    wrapped_qe arg1qe;
-    wrapped_qe arg2qe;
-    pqe.cmx              = true;
-    const char* template = " AND %s %s %s";
-    arg1qe = augment_entity_query_if_cond_agg_arg(f->args[1], p, pr, e, f, pqe);
-    arg2qe = augment_entity_query_if_cond_agg_arg(f->args[2], p, pr, e, f, pqe);
-    sds where_addition =
-      sdscatprintf(sdsempty(), template, arg1qe.v.select, op, arg2qe.v.select);
-    pqe.where = where_addition;
-    pqe.join  = sdscatprintf(sdsempty(), "%s %s", arg1qe.v.join, arg2qe.v.join);
-    wrapped_qe qe = augment_entity_query_agg(p, pr, e, ff, f, agg, pqe);
-    $inspect(qe);
-    sdsfree(arg1qe.v.join);
-    sdsfree(arg2qe.v.join);
-    sdsfree(arg1qe.v.select);
-    sdsfree(arg2qe.v.select);
-    sdsfree(pqe.where);
-    sdsfree(pqe.join);
+    $log_info("Computing materialized fields");
+    if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK) {
+        $log_error("Failed to compute materialized fields: %s",
+                   sqlite3_errmsg(db));
+        goto error;
+    }
+    for (int i = 0; i < n_existing; i++) {
+        sds sql = sdscatprintf(sdsempty(), "DROP TRIGGER [%s]", existing[i]);
+        sqlite3_exec(db, sql, 0, 0, 0);
+        sdsfree(sql);
+    }
+    ret = recompute_materialized_fields(db, ms, n);
+    for (int i = 0; i < n_triggers && $isokay(ret); i++) {
+        if (sqlite3_exec(db, triggers[i], 0, 0, &err_msg) != SQLITE_OK) {
+            $log_debug("%s", triggers[i]);
+            $log_error("Failed to create trigger: %s", err_msg);
+            sqlite3_free(err_msg);
+            ret = $error("failure creating materialized field triggers");
+        }
+    }
+    sqlite3_exec(db, $isokay(ret) ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+    goto cleanup;
 error:
-    return qe;
+    ret = $error("failure creating materialized fields");
+cleanup:
+    for (int i = 0; i < n_triggers; i++) sdsfree(triggers[i]);
+    for (int i = 0; i < n_existing; i++) sdsfree(existing[i]);
+    free(triggers);
+    free(existing);
+    free(ms);
+    return ret;
 }
 
-wrapped_qe
-augment_entity_query_date_cond_agg(struct entity*          p,
-                                   struct relation*        pr,
-                                   struct entity*          e,
-                                   struct field*           ff,
-                                   struct func*            f,
-                                   const char*             agg,
-                                   const char*             op,
-                                   const char*             tdelta_template,
-                                   struct query_extensions pqe)
-{
-    pqe.cmx              = true;
-    const char* template = " AND DATE([%s].%s,'unixepoch')%sDATE('now','%s')";
-    sds tdelta = sdscatprintf(sdsempty(), tdelta_template, f->args[2]->atfield);
-    sds where_addition = sdscatprintf(sdsempty(),
-                                      template,
-                                      f->args[1]->atentity,
-                                      f->args[1]->atfield,
-                                      op,
-                                      tdelta);
-    pqe.where          = where_addition;
-    wrapped_qe qe      = augment_entity_query_agg(p, pr, e, ff, f, agg, pqe);
-    $inspect(qe);
+$status
+create_indexes_from_model(sqlite3* db)
+{
+    char* err_msg = 0;
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        wrapped_sql sql = new_entity_indexes(e);
+        $inspect(sql, error);
+        if (sqlite3_exec(db, sql.v, 0, 0, &err_msg) != SQLITE_OK) {
+            $log_debug("%s", sql.v);
+            $log_error(
+              "Failed to create indexes for entity [%s]: %s", e->name, err_msg);
+            sqlite3_free(err_msg);
+            sdsfree(sql.v);
+            goto error;
+        }
+        sdsfree(sql.v);
+        if (e->fulltext) {
+            $status ret = create_fulltext_index(db, e);
+            if $iserror (ret) return ret;
+        }
+    }
+    return create_materialized_fields(db);
 error:
-    return qe;
+    return $error("failure creating model indexes");
 }
 
-wrapped_qe
-augment_entity_query_op_arg(struct arg*             arg,
-                            struct entity*          p,
-                            struct relation*        pr,
-                            struct entity*          e,
-                            struct field*           ff,
-                            struct query_extensions pqe)
-{
-    sds select = sdsempty();
-    sds from   = sdsempty();
-    sds where  = sdsempty();
-    if (arg->type == ATFUNC) {
-        wrapped_qe t =
-          augment_entity_query_inner(p, pr, e, ff, arg->atfunc, pqe);
-        $inspect(t);
-        $check(select = sdscatprintf(select, "%s", t.v.select));
-        $check(from = sdscatprintf(from, "%s", t.v.from));
-        sdsfree(t.v.where);
-        sdsfree(t.v.select);
-        sdsfree(t.v.from);
-    }
-    if (arg->type == ATFIELD) {
-        struct field* of;
-        $check(find_field(e->fields, arg->atfield, &of) == 0);
-        if (of->type == AUTO) {
-            wrapped_qe t =
-              augment_entity_query_inner(p, pr, e, of, of->autofunc, pqe);
-            $inspect(t);
-            $check(select = sdscatprintf(select, "%s", t.v.select));
-            sdsfree(t.v.where);
-            sdsfree(t.v.select);
-            sdsfree(t.v.from);
+$status
+create_tables_from_model(sqlite3* db)
+{
+    char* err_msg = 0;
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        wrapped_sql sql = new_entity_table(e);
+        $inspect(sql, error);
+        if (sqlite3_exec(db, sql.v, 0, 0, &err_msg) != SQLITE_OK) {
+            $log_debug("%s", sql.v);
+            $log_error(
+              "Failed to create table for entity [%s]: %s", e->name, err_msg);
+            sqlite3_free(err_msg);
         } else {
-            $check(select =
-                     sdscatprintf(select, "[%ss].%s", e->name, arg->atfield));
-            where = pqe.where;
+            $log_info("Tables created successfully");
         }
+        sdsfree(sql.v);
     }
-    if (arg->type == ATREF) {
-        struct field*  er;
-        struct entity* r_entity;
-        struct field*  r_field;
-        $check(find_field(e->fields, arg->atentity, &er) == 0);
-        $check(find_entity(g_entities, er->ref.eid, &r_entity) == 0);
-        $check(find_field(r_entity->fields, arg->atfield, &r_field) == 0);
-        if (r_field->type == AUTO) {
-            wrapped_qe a;
-            a = augment_entity_query_inner(
-              e, pr, r_entity, r_field, r_field->autofunc, pqe);
-            $inspect(a);
-            select = a.v.select;
-            from   = a.v.from;
-            sdsfree(a.v.where);
-        } else
-            $check(select = sdscatprintf(
-                     select, "[%ss].%s", arg->atentity, arg->atfield));
-    }
-    return (
-      wrapped_qe){ (struct query_extensions){ select, from, .where = where } };
+    return create_indexes_from_model(db);
 error:
-    sdsfree(select);
-    sdsfree(from);
-    return $invalid(wrapped_qe);
+    return $error("failure creating model tables");
 }
 
-wrapped_qe
-augment_entity_query_op(struct entity*          p,
-                        struct relation*        pr,
-                        struct entity*          e,
-                        struct field*           ff,
-                        struct func*            f,
-                        const char*             op,
-                        struct query_extensions pqe)
-{
-    sds select           = sdsempty();
-    sds from             = sdsempty();
-    sds where            = sdsempty();
-    const char* template = "(%s %s %s)";
-
-    wrapped_qe arg1, arg0;
-    arg1 = augment_entity_query_op_arg(f->args[0], p, pr, e, ff, pqe);
-    arg0 = augment_entity_query_op_arg(f->args[1], p, pr, e, ff, pqe);
-    $inspect(arg0, error);
-    $inspect(arg1, error);
-
-    $check(select =
-             sdscatprintf(select, template, arg1.v.select, op, arg0.v.select));
-    if (sdslen(arg1.v.from) > 0 && sdslen(arg0.v.from) > 0)
-        $check(from = sdscatprintf(from, "%s,%s", arg1.v.from, arg0.v.from));
-    if (sdslen(arg1.v.from) > 0 && sdslen(arg0.v.from) == 0)
-        $check(from = sdscatprintf(from, "%s", arg1.v.from));
-    if (sdslen(arg1.v.from) == 0 && sdslen(arg0.v.from) > 0)
-        $check(from = sdscatprintf(from, "%s", arg0.v.from));
-    $check(where = sdscatprintf(where, "%s%s", arg0.v.where, arg1.v.where));
-    // sdsfree(arg1.v.where);
-    // sdsfree(arg0.v.where);
-    sdsfree(arg1.v.select);
-    sdsfree(arg0.v.select);
-    sdsfree(arg1.v.from);
-    sdsfree(arg0.v.from);
-    return (
-      wrapped_qe){ (struct query_extensions){ select, from, .where = where } };
-
+wrapped_sql
+build_entity_query_joins(struct entity* e, bool listed_only)
+{
+    sds join;
+    $check(join = sdsempty());
+    $foreach_field(f, e)
+    {
+        if (listed_only && f->listed == false) continue;
+        struct entity* next_entity = e;
+        struct field*  next_field  = f;
+        while (next_field->type == REF) {
+            $check(join =
+                     sdscatprintf(join,
+                                  " INNER JOIN [%ss] ON [%ss].Id = [%ss].[%s]",
+                                  next_field->ref.eid,
+                                  next_field->ref.eid,
+                                  next_entity->name,
+                                  next_field->name));
+            next_entity = next_field->ref.entity;
+            next_field  = next_field->ref.field;
+        }
+    }
+    return (wrapped_sql){ join };
 error:
-    sdsfree(select);
-    sdsfree(from);
-    return $invalid(wrapped_qe);
-}
-
-wrapped_qe
-augment_entity_query_inner(struct entity*          p,
-                           struct relation*        pr,
-                           struct entity*          e,
-                           struct field*           ff,
-                           struct func*            f,
-                           struct query_extensions pqe)
-{
-    if (strcmp(f->name, "Get") == 0)
-        return augment_entity_query_get(p, pr, e, ff, f, pqe);
-    if (strcmp(f->name, "Sub") == 0)
-        return augment_entity_query_op(p, pr, e, ff, f, "-", pqe);
-    if (strcmp(f->name, "Mul") == 0)
-        return augment_entity_query_op(p, pr, e, ff, f, "*", pqe);
-    if (strcmp(f->name, "Div") == 0)
-        return augment_entity_query_op(p, pr, e, ff, f, "*1.0/", pqe);
-    if (strcmp(f->name, "Sum") == 0)
-        return augment_entity_query_nocond_agg(p, pr, e, ff, f, "SUM", pqe);
-    if (strcmp(f->name, "Min") == 0)
-        return augment_entity_query_nocond_agg(p, pr, e, ff, f, "MIN", pqe);
-    if (strcmp(f->name, "Max") == 0)
-        return augment_entity_query_nocond_agg(p, pr, e, ff, f, "MAX", pqe);
-    if (strcmp(f->name, "Avg") == 0)
-        return augment_entity_query_nocond_agg(p, pr, e, ff, f, "AVG", pqe);
-    if (strcmp(f->name, "RollingDaysAvg") == 0)
-        return augment_entity_query_date_cond_agg(
-          p, pr, e, ff, f, "AVG", ">=", "-%s days", pqe);
-    if (strcmp(f->name, "RollingDaysSum") == 0)
-        return augment_entity_query_date_cond_agg(
-          p, pr, e, ff, f, "Sum", ">=", "-%s days", pqe);
-    if (strcmp(f->name, "AvgIfEq") == 0)
-        return augment_entity_query_if_cond_agg(
-          p, pr, e, ff, f, "AVG", "=", pqe);
-    if (strcmp(f->name, "CountIfEq") == 0)
-        return augment_entity_query_if_cond_agg(
-          p, pr, e, ff, f, "Count", "=", pqe);
-    if (strcmp(f->name, "Count") == 0)
-        return augment_entity_query_nocond_agg(p, pr, e, ff, f, "COUNT", pqe);
-
-    $log_error("unknown auto field function %s", f->name);
-    return $invalid(wrapped_qe);
+    if (join != NULL) sdsfree(join);
+    return $invalid(wrapped_sql);
 }
 
 wrapped_sql
-build_entity_query_columns(struct entity* e, bool include_refid)
+build_entity_query_columns(struct entity*        e,
+                           bool                  listed_only,
+                           bool                  include_refid,
+                           struct formula_batch* batch)
 {
     sds columns = sdsempty();
     $check(columns = sdscatprintf(columns, "[%ss].Id", e->name));
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
-        if (f->listed == false && include_refid == false) break;
+        if (listed_only && f->listed == false) continue;
         struct entity* next_entity = e;
         struct field*  next_field  = f;
         struct entity* cur_entity  = next_entity;
         struct field*  cur_field   = next_field;
         if (next_field->type == REF) {
             while (next_field->type == REF) {
-                cur_entity = next_entity;
-                cur_field  = next_field;
-                $check(find_entity(
-                         g_entities, next_field->ref.eid, &next_entity) == 0);
-                $check(find_field(next_entity->fields,
-                                  next_field->ref.fid,
-                                  &next_field) == 0);
+                cur_entity  = next_entity;
+                cur_field   = next_field;
+                next_entity = next_field->ref.entity;
+                next_field  = next_field->ref.field;
             }
             if (include_refid) {
                 $check(columns =
@@ -708,24 +631,14 @@ build_entity_query_columns(struct entity* e, bool include_refid)
                                               cur_field->ref.eid,
                                               cur_field->ref.fid));
             }
-        } else if (f->type != AUTO) {
+        } else if (f->type != AUTO || f->materialized) {
             $check(columns =
                      sdscatprintf(columns, ",[%ss].[%s]", e->name, f->name));
-        } else if (include_refid == true) {
-            wrapped_qe a;
-            a = augment_entity_query_inner(
-              NULL,
-              NULL,
-              e,
-              f,
-              f->autofunc,
-              (struct query_extensions){
-                .where = sdsempty(), .join = sdsempty(), .cmx = false });
-            $inspect(a, error);
-            columns = sdscatprintf(columns, ",%s", a.v.select);
-            sdsfree(a.v.where);
-            sdsfree(a.v.select);
-            sdsfree(a.v.from);
+        } else {
+            wrapped_sql value = compile_batch_formula(batch, e, f);
+            $inspect(value, error);
+            columns = sdscatprintf(columns, ",%s", value.v);
+            sdsfree(value.v);
             $check(columns);
         }
     }
@@ -743,9 +656,9 @@ build_list_filters(struct entity* e)
 {
     const char* inner_template = " OR [%ss].[%s] LIKE @name";
     sds         w              = sdscatprintf(sdsempty(), "0");
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
-        if (f->listed) {
+        if (f->listed && f->type != AUTO) {
             if (f->type == REF) {
                 $check(w = sdscatprintf(
                          w, inner_template, f->ref.eid, f->ref.fid, "%s"));
@@ -762,242 +675,545 @@ error:
     return $invalid(wrapped_sql);
 }
 
-sds
-get_value_by_field_name(struct entity* e,
-                        sqlite3*       db,
-                        int            key,
-                        const char*    fname)
+static sds
+get_field_value(sqlite3* db, struct field* f, int key)
 {
     sds ret = sdsempty();
     if (key <= 0) return ret;
-    wrapped_sql sql = build_obj_query(e);
-    $inspect(sql, exit);
-    sqlite3_stmt* res;
-    $check(sqlite3_prepare_v2(db, sql.v, -1, &res, 0) == SQLITE_OK,
-           sqlite3_errmsg(db),
-           error);
+    struct entity*           e   = f->entity;
+    const struct field_plan* fp  = find_field_plan(e, f);
+    wrapped_stmt             ws  = prepare_obj_query(e, db);
+    sqlite3_stmt*            res = $unwrap(ws, exit);
     int idx = sqlite3_bind_parameter_index(res, "@id");
     sqlite3_bind_int(res, idx, key);
-    while (sqlite3_step(res) == SQLITE_ROW) {
-        int i = 1;
-        $foreach_hashed(struct field*, f, e->fields)
-        {
-            if (f->type == REF) {
-                if (strcmp(fname, f->name) == 0) {
-                    ret = sdscatprintf(ret, "%d", sqlite3_column_int(res, i));
-                    break;
-                }
-                i++;
-                i++;
-            }
-            if (strcmp(fname, f->name) == 0) {
-                ret = field_value_to_string(f, res, i);
-                break;
-            }
-            i++;
+    if (sqlite3_step(res) == SQLITE_ROW) {
+        if (f->type == REF) {
+            ret = sdscatprintf(ret, "%d", sqlite3_column_int(res, fp->obj_key));
+        } else {
+            sdsfree(ret);
+            ret = field_value_to_string(f, res, fp->obj_column);
         }
     }
-    sqlite3_reset(res);
-    sqlite3_finalize(res);
-error:
-    sdsfree(sql.v);
+    release_cached_stmt(res);
 exit:
     return ret;
 }
 
+static $status
+bind_field_value(sqlite3*      db,
+                 sqlite3_stmt* res,
+                 int           idx,
+                 struct field* f,
+                 int           key)
+{
+    // Stored fields are read from their column alone, with the type it
+    // holds, REF fields giving the key they refer to. AUTO fields need the
+    // whole object query.
+    if (f->type == AUTO) {
+        sds val = get_field_value(db, f, key);
+        sqlite3_bind_text(res, idx, val, sdslen(val), SQLITE_TRANSIENT);
+        sdsfree(val);
+        return $okay;
+    }
+    struct stmt_key sk   = { .e = f->entity, .kind = STMT_FIELD, .field = f };
+    sqlite3_stmt*   fres = find_cached_stmt(db, &sk);
+    if (fres == NULL) {
+        sds sql = sdscatprintf(sdsempty(),
+                               "SELECT [%s] FROM [%ss] WHERE Id = @id",
+                               f->name,
+                               f->entity->name);
+        wrapped_stmt ws = cache_stmt(db, &sk, sql);
+        sdsfree(sql);
+        fres = $unwrap(ws);
+    }
+    sqlite3_bind_int(fres, 1, key);
+    if (sqlite3_step(fres) == SQLITE_ROW) {
+        sqlite3_bind_value(res, idx, sqlite3_column_value(fres, 0));
+    } else {
+        sqlite3_bind_null(res, idx);
+    }
+    release_cached_stmt(fres);
+    return $okay;
+error:
+    return $error("unable to read the field value");
+}
+
 wrapped_sql
-build_list_query_context_filters(sqlite3*                   db,
-                                 struct context*            ctx,
+build_list_query_context_filters(struct context*            ctx,
                                  struct lookup_filter_data* lfd,
                                  struct entity*             e)
 {
     sds sql = sdsempty();
     if (ctx != NULL) {
         $check(sql = sdscatprintf(
-                 sql, " AND [%ss].[%s] = %d", e->name, ctx->fname, ctx->k));
+                 sql, " AND [%ss].[%s] = @ctx", e->name, ctx->field->name));
     }
     if (lfd != NULL && lfd->fv->base->filter != NULL) {
         struct func* f = lfd->fv->base->filter;
+        $check(sql = sdscatprintf(sql,
+                                  " AND [%ss].[%s] = @filter",
+                                  e->name,
+                                  f->args[0]->atfield));
+    }
+    return (wrapped_sql){ sql };
+error:
+    return $invalid(wrapped_sql);
+}
+
+$status
+bind_list_query_context_filters(sqlite3*                   db,
+                                sqlite3_stmt*              res,
+                                struct context*            ctx,
+                                struct lookup_filter_data* lfd)
+{
+    if (ctx != NULL) {
+        int idx = sqlite3_bind_parameter_index(res, "@ctx");
+        $check(sqlite3_bind_int(res, idx, ctx->k) == SQLITE_OK);
+    }
+    if (lfd != NULL && lfd->fv->base->filter != NULL) {
+        struct func* f   = lfd->fv->base->filter;
+        int          idx = sqlite3_bind_parameter_index(res, "@filter");
         $foreach_hashed(struct field_value*, fv, lfd->ev->fields)
         {
-            if (strcmp(fv->base->name, f->args[1]->atentity) == 0) {
-                struct entity* r_entity;
-                $check(find_entity(g_entities, fv->base->ref.eid, &r_entity) ==
-                       0);
-                sds val = get_value_by_field_name(
-                  r_entity, db, fv->_kvalue, f->args[1]->atfield);
-                const char* template = " AND [%ss].[%s] = '%s'";
-                $check(sql = sdscatprintf(
-                         sql, template, e->name, f->args[0]->atfield, val));
-                sdsfree(val);
+            if (fv->base == f->args[1]->ref) {
+                $check(f->args[1]->field != NULL);
+                $onerror2(bind_field_value(
+                  db, res, idx, f->args[1]->field, fv->_kvalue))
+                {
+                    goto error;
+                }
             }
         }
     }
-    return (wrapped_sql){ sql };
+    return $okay;
 error:
-    return $invalid(wrapped_sql);
+    return $error("unable to bind list query context filters");
 }
 
 wrapped_sql
-build_list_query(struct entity*             e,
-                 sqlite3*                   db,
-                 struct context*            ctx,
-                 struct lookup_filter_data* lfd,
-                 struct order*              order)
+build_list_query_from(struct entity* e)
 {
-    wrapped_sql ret;
-    const char* template =
-      "SELECT %s from [%ss] %s WHERE (([%ss]._archived IS NULL) AND (%s) %s)";
-    sds         sql     = sdsempty();
-    wrapped_sql columns = build_entity_query_columns(e, false);
-    wrapped_sql join    = build_entity_query_joins(e, true);
-    wrapped_sql filters = build_list_filters(e);
-    wrapped_sql context_filters =
-      build_list_query_context_filters(db, ctx, lfd, e);
+    const char* template = " from [%ss] %s WHERE ([%ss]._archived IS NULL)";
+    sds         sql      = sdsempty();
+    wrapped_sql join     = build_entity_query_joins(e, true);
 
-    $inspect(columns, error);
     $inspect(join, error);
-    $inspect(filters, error);
-    $inspect(context_filters, error);
 
-    $check(sql = sdscatprintf(sql,
-                              template,
-                              columns.v,
-                              e->name,
-                              join.v,
-                              e->name,
-                              filters.v,
-                              context_filters.v));
-
-    if (order != NULL) {
-        if (order->fpath.fid)
-            $check(sql = sdscatprintf(sql,
-                                      " ORDER BY [%ss].[%s] %s",
-                                      order->fpath.eid,
-                                      order->fpath.fid,
-                                      order->asc ? "ASC" : "DESC"));
-    }
-    ret = (wrapped_sql){ sql };
-    goto cleanup;
+    $check(sql = sdscatprintf(sql, template, e->name, join.v, e->name));
+    sdsfree(join.v);
+    return (wrapped_sql){ sql };
 error:
     sdsfree(sql);
-    ret = $invalid(wrapped_sql);
-cleanup:
-    sdsfree(columns.v);
     sdsfree(join.v);
-    sdsfree(filters.v);
-    sdsfree(context_filters.v);
-    return ret;
+    return $invalid(wrapped_sql);
 }
 
-wrapped_sql
-build_obj_query(struct entity* e)
+sds
+build_list_query_keyset(struct entity* e, const char* order_column, bool asc)
 {
-    const char* template = "SELECT %s from [%ss] %s %s WHERE [%ss].Id = @id;";
-    sds         sql      = sdsempty();
-    wrapped_sql columns  = build_entity_query_columns(e, true);
-    $inspect(columns, error);
-    wrapped_sql join = build_entity_query_joins(e, false);
-    $inspect(join, error2);
-    sds froms = sdsempty();
-    $foreach_hashed(struct field*, f, e->fields)
-    {
-        if (f->type == AUTO) {
-            wrapped_qe              a;
-            struct query_extensions pqe = { .select = sdsempty(),
-                                            .where  = sdsempty(),
-                                            .join   = sdsempty(),
-                                            .from   = sdsempty(),
-                                            .cmx    = false };
-            a = augment_entity_query_inner(NULL, NULL, e, f, f->autofunc, pqe);
-            $inspect(a, error);
-            if (strcmp(a.v.from, "") != 0) $check(froms = sdscat(froms, ","));
-            $check(froms = sdscat(froms, a.v.from));
-            sdsfree(pqe.select);
-            sdsfree(pqe.where);
-            sdsfree(pqe.join);
-            sdsfree(pqe.from);
-            sdsfree(a.v.select);
-            sdsfree(a.v.from);
+    // Pages continue after the last row fetched, identified by its order
+    // value and Id. NULL order values sort first in ascending lists and
+    // last in descending ones, hence the explicit NULL cases.
+    if (order_column == NULL) {
+        return sdscatprintf(
+          sdsempty(), " AND [%ss].Id > IFNULL(@after_key, 0)", e->name);
+    }
+    if (asc) {
+        return sdscatprintf(
+          sdsempty(),
+          " AND (@after_key IS NULL"
+          " OR (@after_order IS NULL AND (%s IS NOT NULL OR [%ss].Id > "
+          "@after_key))"
+          " OR %s > @after_order"
+          " OR (%s = @after_order AND [%ss].Id > @after_key))",
+          order_column,
+          e->name,
+          order_column,
+          order_column,
+          e->name);
+    }
+    return sdscatprintf(
+      sdsempty(),
+      " AND (@after_key IS NULL"
+      " OR (@after_order IS NULL AND %s IS NULL AND [%ss].Id < @after_key)"
+      " OR (@after_order IS NOT NULL AND (%s IS NULL OR %s < @after_order"
+      " OR (%s = @after_order AND [%ss].Id < @after_key))))",
+      order_column,
+      e->name,
+      order_column,
+      order_column,
+      order_column,
+      e->name);
+}
+
+sds
+build_list_query_order(struct entity* e, const char* order_column, bool asc)
+{
+    if (order_column == NULL) {
+        return sdscatprintf(sdsempty(), " ORDER BY [%ss].Id", e->name);
+    }
+    return sdscatprintf(sdsempty(),
+                        " ORDER BY %s %s, [%ss].Id %s",
+                        order_column,
+                        asc ? "ASC" : "DESC",
+                        e->name,
+                        asc ? "ASC" : "DESC");
+}
+
+wrapped_sql
+build_list_query_search(struct entity* e)
+{
+    if (e->fulltext) {
+        return (wrapped_sql){ sdscatprintf(
+          sdsempty(),
+          " AND [%ss].Id IN (SELECT rowid FROM [%ss_fts] "
+          "WHERE [%ss_fts] MATCH @name)",
+          e->name,
+          e->name,
+          e->name) };
+    }
+    wrapped_sql filters = build_list_filters(e);
+    $inspect(filters, error);
+    sds sql = sdscatprintf(sdsempty(), " AND (%s)", filters.v);
+    sdsfree(filters.v);
+    return (wrapped_sql){ sql };
+error:
+    return $invalid(wrapped_sql);
+}
+
+wrapped_sql
+build_list_query(struct entity*             e,
+                 struct context*            ctx,
+                 struct lookup_filter_data* lfd,
+                 struct order*              order,
+                 bool                       search)
+{
+    bool        batched      = e->plan->list_batch_sql != NULL;
+    bool        asc          = order == NULL || order->asc;
+    sds         sql          = sdsnew(batched ? "WITH [page] AS (" : "");
+    sds         order_column = NULL;
+    sds         order_by     = NULL;
+    wrapped_sql context_filters =
+      build_list_query_context_filters(ctx, lfd, e);
+    $inspect(context_filters, error);
+
+    // Ordered lists also select the order value, right after the listed
+    // fields, so the next page can continue from the last row.
+    if (order != NULL && order->fpath.fid) {
+        order_column = sdscatprintf(
+          sdsempty(), "[%ss].[%s]", order->fpath.eid, order->fpath.fid);
+    }
+    order_by = build_list_query_order(e, order_column, asc);
+    $check(sql = sdscat(sql, e->plan->list_select_sql));
+    if (order_column && !batched)
+        $check(sql = sdscatprintf(sql, ",%s", order_column));
+    $check(sql = sdscat(sql, e->plan->list_from_sql));
+    if (search) $check(sql = sdscat(sql, e->plan->search_sql));
+    $check(sql = sdscat(sql, context_filters.v));
+    sdsfree(context_filters.v);
+
+    // Unordered lists keep insertion order regardless of which index the
+    // planner picks for the filters.
+    sds keyset = build_list_query_keyset(e, order_column, asc);
+    $check(sql = sdscatsds(sql, keyset));
+    sdsfree(keyset);
+    $check(sql = sdscatsds(sql, order_by));
+    $check(sql = sdscat(sql, " LIMIT @limit"));
+
+    // Listed AUTO fields are computed once the page is picked, for all of
+    // its rows together.
+    if (batched) {
+        $check(sql = sdscatprintf(sql, ") %s", e->plan->list_batch_sql));
+        if (order_column)
+            $check(sql = sdscatprintf(sql, ",%s", order_column));
+        $check(sql = sdscat(sql, e->plan->list_batch_from_sql));
+        $check(sql = sdscatsds(sql, order_by));
+    }
+    sdsfree(order_column);
+    sdsfree(order_by);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(sql);
+    sdsfree(order_column);
+    sdsfree(order_by);
+    return $invalid(wrapped_sql);
+}
+
+sds
+build_fulltext_match(const char* search_term)
+{
+    // Every search word becomes a quoted prefix query, the words are
+    // implicitly AND-ed by FTS5.
+    int  count;
+    sds  match  = sdsempty();
+    sds* tokens = sdssplitlen(
+      search_term, strlen(search_term), " ", 1, &count);
+    for (int i = 0; i < count; i++) {
+        if (sdslen(tokens[i]) == 0) continue;
+        match = sdscat(match, sdslen(match) > 0 ? " \"" : "\"");
+        for (char* c = tokens[i]; *c; c++) {
+            match = *c == '"' ? sdscat(match, "\"\"") : sdscatlen(match, c, 1);
         }
+        match = sdscat(match, "\"*");
     }
+    sdsfreesplitres(tokens, count);
+    return match;
+}
 
-    $check(sql = sdscatprintf(
-             sql, template, columns.v, e->name, froms, join.v, e->name));
-    sdsfree(froms);
-    $log_info("----------------- build obj query");
-    $log_info("SQL is %s", sql);
+$status
+bind_list_query_search(struct entity* e,
+                       sqlite3_stmt*  res,
+                       const char*    search_term)
+{
+    int idx = sqlite3_bind_parameter_index(res, "@name");
+    if (idx == 0) return $okay;
+    sds term = e->fulltext ? build_fulltext_match(search_term)
+                           : sdscatprintf(sdsempty(), "%%%s%%", search_term);
+    int rc =
+      sqlite3_bind_text(res, idx, term, sdslen(term), SQLITE_TRANSIENT);
+    sdsfree(term);
+    if (rc != SQLITE_OK) return $error("unable to bind search term");
+    return $okay;
+}
+
+void
+bind_list_query_page(sqlite3_stmt* res, const struct list_page* page)
+{
+    // Without a page the whole list is returned.
+    sqlite3_bind_int(res,
+                     sqlite3_bind_parameter_index(res, "@limit"),
+                     page != NULL ? page->limit : -1);
+    if (page == NULL || page->rows == 0) return;
+    sqlite3_bind_int(
+      res, sqlite3_bind_parameter_index(res, "@after_key"), page->last_key);
+    int idx = sqlite3_bind_parameter_index(res, "@after_order");
+    if (idx != 0 && page->last_order != NULL)
+        sqlite3_bind_value(res, idx, page->last_order);
+}
+
+void
+advance_list_page(struct entity* e, struct list_page* page, sqlite3_stmt* res)
+{
+    page->rows++;
+    page->last_key = sqlite3_column_int(res, 0);
+    if (sqlite3_column_count(res) > e->plan->n_list_columns) {
+        sqlite3_value_free(page->last_order);
+        page->last_order =
+          sqlite3_value_dup(sqlite3_column_value(res, e->plan->n_list_columns));
+    }
+}
+
+void
+reset_list_page(struct list_page* page)
+{
+    sqlite3_value_free(page->last_order);
+    page->last_order = NULL;
+    page->last_key   = 0;
+    page->rows       = 0;
+    page->more       = true;
+}
+
+wrapped_stmt
+prepare_list_query(struct entity*             e,
+                   sqlite3*                   db,
+                   struct context*            ctx,
+                   struct lookup_filter_data* lfd,
+                   struct order*              order,
+                   const char*                search_term,
+                   const struct list_page*    page)
+{
+    // Full-text entities skip the search filter altogether when there is
+    // nothing to search for, LIKE entities keep matching '%%'.
+    bool search =
+      !e->fulltext || strspn(search_term, " ") < strlen(search_term);
+    struct stmt_key key = {
+        .e      = e,
+        .kind   = STMT_LIST,
+        .field  = ctx != NULL ? ctx->field : NULL,
+        .filter = lfd != NULL && lfd->fv->base->filter != NULL
+                    ? lfd->fv->base
+                    : NULL,
+        .order  = order,
+        .search = search
+    };
+    sqlite3_stmt* res = find_cached_stmt(db, &key);
+    if (res == NULL) {
+        wrapped_sql sql = build_list_query(e, ctx, lfd, order, search);
+        $inspect(sql, error);
+        wrapped_stmt ws = cache_stmt(db, &key, sql.v);
+        sdsfree(sql.v);
+        res = $unwrap(ws);
+    }
+    $onerror2(bind_list_query_context_filters(db, res, ctx, lfd))
+    {
+        release_cached_stmt(res);
+        goto error;
+    }
+    $onerror2(bind_list_query_search(e, res, search_term))
+    {
+        release_cached_stmt(res);
+        goto error;
+    }
+    bind_list_query_page(res, page);
+    bind_as_of_date(res);
+    return (wrapped_stmt){ res };
+error:
+    return $invalid(wrapped_stmt, "unable to prepare list query");
+}
+
+wrapped_sql
+build_obj_query(struct entity* e)
+{
+    // AUTO fields are computed like an export of the single object, every
+    // aggregated relation is grouped only over the rows of @id and joined
+    // to it.
+    sds                   sql   = NULL;
+    sds                   joins = NULL;
+    struct formula_batch* batch = new_formula_batch("SELECT @id");
+    wrapped_sql           ref_joins = build_entity_query_joins(e, false);
+    $inspect(ref_joins, error);
+    wrapped_sql columns = build_entity_query_columns(e, false, true, batch);
+    $inspect(columns, error);
+    joins = formula_batch_joins(batch);
+    $check(sql = sdscatprintf(sdsempty(),
+                              "SELECT %s FROM [%ss]%s%s WHERE [%ss].Id = @id;",
+                              columns.v,
+                              e->name,
+                              ref_joins.v,
+                              joins,
+                              e->name));
     sdsfree(columns.v);
-    sdsfree(join.v);
+    sdsfree(ref_joins.v);
+    sdsfree(joins);
+    free_formula_batch(batch);
     return (wrapped_sql){ sql };
-error2:
-    sdsfree(join.v);
 error:
+    sdsfree(ref_joins.v);
+    sdsfree(joins);
+    free_formula_batch(batch);
+    return $invalid(wrapped_sql);
+}
+
+wrapped_stmt
+prepare_obj_query(struct entity* e, sqlite3* db)
+{
+    struct stmt_key key = { .e = e, .kind = STMT_OBJ };
+    sqlite3_stmt*   res = find_cached_stmt(db, &key);
+    if (res == NULL) {
+        wrapped_stmt ws = cache_stmt(db, &key, e->plan->obj_sql);
+        res             = $unwrap(ws);
+    }
+    bind_as_of_date(res);
+    return (wrapped_stmt){ res };
+error:
+    return $invalid(wrapped_stmt, "unable to prepare object query");
+}
+
+wrapped_sql
+build_export_query(struct entity* e)
+{
+    // Every active record with all of its fields, AUTO fields are computed
+    // for the whole table at once the way lists compute them for a page.
+    sds                   sql   = NULL;
+    sds                   joins = NULL;
+    sds                   ids   = sdscatprintf(
+      sdsempty(), "SELECT Id FROM [%ss] WHERE _archived IS NULL", e->name);
+    struct formula_batch* batch = new_formula_batch(ids);
+    wrapped_sql           ref_joins = build_entity_query_joins(e, false);
+    $inspect(ref_joins, error);
+    wrapped_sql columns = build_entity_query_columns(e, false, false, batch);
+    $inspect(columns, error);
+    joins = formula_batch_joins(batch);
+    $check(sql = sdscatprintf(sdsempty(),
+                              "SELECT %s FROM [%ss]%s%s WHERE "
+                              "[%ss]._archived IS NULL ORDER BY [%ss].Id",
+                              columns.v,
+                              e->name,
+                              ref_joins.v,
+                              joins,
+                              e->name,
+                              e->name));
     sdsfree(columns.v);
+    sdsfree(ref_joins.v);
+    sdsfree(joins);
+    sdsfree(ids);
+    free_formula_batch(batch);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(ref_joins.v);
+    sdsfree(joins);
+    sdsfree(ids);
+    free_formula_batch(batch);
     return $invalid(wrapped_sql);
 }
 
-sds
-field_value_to_string(struct field* f, sqlite3_stmt* res, int index)
+const char*
+field_value_text(struct field* f,
+                 sqlite3_stmt* res,
+                 int           index,
+                 char*         buf,
+                 int*          len)
 {
-    sds    ret = sdsempty();
-    time_t s;
+    const char* ret = buf;
+    int         n   = 0;
     switch (f->type) {
-        case REF: {
-            struct entity* ref_entity;
-            $check(find_entity(g_entities, f->ref.eid, &ref_entity) == 0);
-            struct field* ref_field;
-            $check(find_field(ref_entity->fields, f->ref.fid, &ref_field) == 0);
-            sdsfree(ret);
-            ret = field_value_to_string(ref_field, res, index);
-        } break;
+        case REF:
+            return field_value_text(f->ref.field, res, index, buf, len);
         case TEXT:
-            ret = sdscatprintf(ret, "%s", sqlite3_column_text(res, index));
+            ret = (const char*)sqlite3_column_text(res, index);
+            n   = sqlite3_column_bytes(res, index);
+            if (ret == NULL) ret = "";
             break;
         case BOOLEAN:
-            ret = sdscatprintf(
-              ret, "%s", sqlite3_column_int(res, index) ? "X" : " ");
+            ret = sqlite3_column_int(res, index) ? "X" : " ";
+            n   = 1;
             break;
         case INTEGER:
-            ret = sdscatprintf(ret, "%d", sqlite3_column_int(res, index));
+            n = snprintf(
+              buf, FIELD_TEXT_SIZE, "%d", sqlite3_column_int(res, index));
             break;
         case DATE:
-            s = sqlite3_column_int(res, index);
-            struct tm ts;
-            char      buf[80];
-            ts = *localtime(&s);
-            strftime(buf, sizeof(buf), "%Y-%m-%d", &ts);
-            ret = sdscatprintf(ret, "%s", buf);
+            n = format_date(sqlite3_column_int64(res, index), buf);
             break;
         case REAL:
-            ret = sdscatprintf(ret, "%.2f", sqlite3_column_double(res, index));
+            n = snprintf(
+              buf, FIELD_TEXT_SIZE, "%.2f", sqlite3_column_double(res, index));
             break;
         case AUTO:
-            ret =
-              f->format
-                ? sdscatprintf(
-                    ret, f->format, sqlite3_column_double(res, index))
-                : sdscatprintf(ret, "%.2f", sqlite3_column_double(res, index));
-
+            n = f->format ? snprintf(buf,
+                                     FIELD_TEXT_SIZE,
+                                     f->format,
+                                     sqlite3_column_double(res, index))
+                          : snprintf(buf,
+                                     FIELD_TEXT_SIZE,
+                                     "%.2f",
+                                     sqlite3_column_double(res, index));
             break;
         default:
+            buf[0] = '\0';
             break;
     }
-error:
+    if (n < 0) n = 0;
+    if (ret == buf && n >= FIELD_TEXT_SIZE) n = FIELD_TEXT_SIZE - 1;
+    *len = n;
     return ret;
 }
 
 sds
-get_ref_value(sqlite3* db, int key, const char* ename, const char* efield)
+field_value_to_string(struct field* f, sqlite3_stmt* res, int index)
 {
-    sds ret  = sdsempty();
-    sds sql  = sdsempty();
-    sds join = sdsempty();
+    char        buf[FIELD_TEXT_SIZE];
+    int         n;
+    const char* text = field_value_text(f, res, index, buf, &n);
+    return sdsnewlen(text, n);
+}
 
-    struct entity* ref_entity;
-    struct field*  ref_field;
-    $check(find_entity(g_entities, ename, &ref_entity) == 0);
-    $check(find_field(ref_entity->fields, efield, &ref_field) == 0);
+wrapped_sql
+build_ref_value_query(struct entity* ref_entity, struct field* ref_field)
+{
+    const char* ename = ref_entity->name;
+    sds         sql   = sdsempty();
+    sds         join  = sdsempty();
     while (ref_field->type == REF) {
         $check(join = sdscatprintf(join,
                                    " INNER JOIN [%ss] ON [%ss].Id = [%ss].[%s]",
@@ -1005,31 +1221,136 @@ get_ref_value(sqlite3* db, int key, const char* ename, const char* efield)
                                    ref_field->ref.eid,
                                    ref_entity->name,
                                    ref_field->name));
-        $check(find_entity(g_entities, ref_field->ref.eid, &ref_entity) == 0);
-        $check(find_field(ref_entity->fields, ref_field->ref.fid, &ref_field) ==
-               0);
+        ref_entity = ref_field->ref.entity;
+        ref_field  = ref_field->ref.field;
+    }
+    $check(sql = sdscatprintf(
+             sql,
+             "SELECT [%ss].[%s] FROM [%ss] %s WHERE [%ss].[Id] = @id",
+             ref_entity->name,
+             ref_field->name,
+             ref_entity->name,
+             join,
+             ename));
+    sdsfree(join);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(join);
+    sdsfree(sql);
+    return $invalid(wrapped_sql);
+}
+
+wrapped_sql
+build_ref_key_query(struct entity* ref_entity, struct field* ref_field)
+{
+    // The reverse of build_ref_value_query: the first active record
+    // displaying the given value.
+    const char* ename = ref_entity->name;
+    sds         sql   = sdsempty();
+    sds         join  = sdsempty();
+    while (ref_field->type == REF) {
+        $check(join = sdscatprintf(join,
+                                   " INNER JOIN [%ss] ON [%ss].Id = [%ss].[%s]",
+                                   ref_field->ref.eid,
+                                   ref_field->ref.eid,
+                                   ref_entity->name,
+                                   ref_field->name));
+        ref_entity = ref_field->ref.entity;
+        ref_field  = ref_field->ref.field;
     }
+    $check(sql = sdscatprintf(sql,
+                              "SELECT [%ss].Id FROM [%ss] %s WHERE "
+                              "[%ss].[%s] = @value AND [%ss]._archived IS "
+                              "NULL ORDER BY [%ss].Id LIMIT 1",
+                              ename,
+                              ename,
+                              join,
+                              ref_entity->name,
+                              ref_field->name,
+                              ename,
+                              ename));
+    sdsfree(join);
+    return (wrapped_sql){ sql };
+error:
+    sdsfree(join);
+    sdsfree(sql);
+    return $invalid(wrapped_sql);
+}
 
-    sql = sdscatprintf(sql,
-                       "SELECT [%ss].[%s] FROM [%ss] %s WHERE [%ss].[Id] = @id",
-                       ref_entity->name,
-                       ref_field->name,
-                       ref_entity->name,
-                       join,
-                       ename);
+sds
+get_ref_value(sqlite3* db, int key, const struct fpath* ref)
+{
+    sds ret = sdsempty();
 
-    if (sql == NULL) return NULL;
-    sqlite3_stmt* res;
-    $check(sqlite3_prepare_v2(db, sql, -1, &res, 0) == SQLITE_OK,
-           sqlite3_errmsg(db),
-           error);
+    struct entity* ref_entity = ref->entity;
+    struct field*  ref_field  = ref->field;
+
+    const struct field_plan* fp = find_field_plan(ref_entity, ref_field);
+    $check(fp != NULL && fp->value_sql != NULL);
+    sds cached = find_ref_value(ref_entity, ref_field, key);
+    if (cached != NULL) {
+        sdsfree(ret);
+        return cached;
+    }
+    struct stmt_key sk  = { .e     = ref_entity,
+                           .kind  = STMT_REF,
+                           .field = ref_field };
+    sqlite3_stmt*   res = find_cached_stmt(db, &sk);
+    if (res == NULL) {
+        wrapped_stmt ws = cache_stmt(db, &sk, fp->value_sql);
+        res             = $unwrap(ws);
+    }
+    bind_as_of_date(res);
     int idx = sqlite3_bind_parameter_index(res, "@id");
     sqlite3_bind_int(res, idx, key);
     if (sqlite3_step(res) == SQLITE_ROW) {
-        ret = field_value_to_string(ref_field, res, 0);
+        sdsfree(ret);
+        ret = field_value_to_string(fp->value_field, res, 0);
+        cache_ref_value(
+          ref_entity, ref_field, key, ret, fp->value_field != ref_field);
     }
+    release_cached_stmt(res);
+error:
+    return ret;
+}
+
+wrapped_key
+get_ref_key(sqlite3* db, const char* value, const struct fpath* ref)
+{
+    wrapped_key    ret = $invalid(wrapped_key, "no record displays the value");
+    struct entity* ref_entity = ref->entity;
+    struct field*  ref_field  = ref->field;
+
+    const struct field_plan* fp = find_field_plan(ref_entity, ref_field);
+    $check(fp != NULL && fp->key_sql != NULL);
+    struct stmt_key sk  = { .e     = ref_entity,
+                           .kind  = STMT_REF_KEY,
+                           .field = ref_field };
+    sqlite3_stmt*   res = find_cached_stmt(db, &sk);
+    if (res == NULL) {
+        wrapped_stmt ws = cache_stmt(db, &sk, fp->key_sql);
+        res             = $unwrap(ws);
+    }
+    bind_as_of_date(res);
+
+    // Dates are displayed as text but stored as timestamps.
+    int idx = sqlite3_bind_parameter_index(res, "@value");
+    if (fp->value_field->type == DATE) {
+        wrapped_time_t wt = parse_date_field(value);
+        $ifvalid(wt)
+        {
+            sqlite3_bind_int64(res, idx, wt.v);
+        } else {
+            sqlite3_bind_null(res, idx);
+        }
+    } else {
+        sqlite3_bind_text(res, idx, value, strlen(value), SQLITE_TRANSIENT);
+    }
+    if (sqlite3_step(res) == SQLITE_ROW) {
+        ret = (wrapped_key){ sqlite3_column_int(res, 0) };
+    }
+    release_cached_stmt(res);
 error:
-    sdsfree(sql);
     return ret;
 }
 
@@ -1038,7 +1359,7 @@ create_insert_statement(struct entity* e)
 {
     sds buf  = sdsempty();
     sds buf2 = sdsempty();
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
         if (f->type == AUTO) continue;
         buf  = sdscatprintf(buf, "[%s],", f->name);
@@ -1057,7 +1378,7 @@ sds
 create_update_statement(struct entity* e)
 {
     sds tmp = sdsempty();
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
         if (f->type == AUTO) continue;
         tmp = sdscatprintf(tmp, "[%s]=@%s,", f->name, f->name);
@@ -1079,30 +1400,290 @@ create_archive_statement(struct entity* e)
     return final;
 }
 
-$typedef(time_t) wrapped_time_t;
+/* -- QUERY PLANS -- */
+
+static void
+cleanup_query_plan(struct query_plan* plan)
+{
+    if (plan == NULL) return;
+    for (int i = 0; i < plan->n_fields; i++) {
+        sdsfree(plan->fields[i].value_sql);
+        sdsfree(plan->fields[i].key_sql);
+        free_formula(plan->fields[i].formula);
+    }
+    free(plan->fields);
+    sdsfree(plan->list_select_sql);
+    sdsfree(plan->list_from_sql);
+    sdsfree(plan->list_batch_sql);
+    sdsfree(plan->list_batch_from_sql);
+    sdsfree(plan->search_sql);
+    sdsfree(plan->fts_sql);
+    sdsfree(plan->fts_insert_sql);
+    sdsfree(plan->obj_sql);
+    sdsfree(plan->insert_sql);
+    sdsfree(plan->update_sql);
+    sdsfree(plan->archive_sql);
+    free(plan);
+}
+
+$status
+compile_fulltext_queries(struct entity* e, struct query_plan* plan)
+{
+    // The search index covers the listed text columns, REF columns are
+    // indexed by the text they display.
+    sds         names   = sdsempty();
+    sds         columns = sdsempty();
+    wrapped_sql join    = build_entity_query_joins(e, true);
+    $inspect(join, error);
+    $foreach_field(f, e)
+    {
+        if (f->listed == false) continue;
+        struct entity* next_entity = e;
+        struct field*  next_field  = f;
+        while (next_field->type == REF) {
+            next_entity = next_field->ref.entity;
+            next_field  = next_field->ref.field;
+        }
+        if (next_field->type != TEXT) continue;
+        names   = sdscatprintf(names, ",[%s]", f->name);
+        columns = sdscatprintf(
+          columns, ",[%ss].[%s]", next_entity->name, next_field->name);
+    }
+    if (sdslen(names) == 0) {
+        $log_error("entity %s has no listed text fields to search", e->name);
+        goto error;
+    }
+    plan->fts_sql = sdscatprintf(
+      sdsempty(),
+      "CREATE VIRTUAL TABLE IF NOT EXISTS [%ss_fts] USING fts5(%s);",
+      e->name,
+      names + 1);
+    plan->fts_insert_sql =
+      sdscatprintf(sdsempty(),
+                   "INSERT INTO [%ss_fts](rowid%s) SELECT [%ss].Id%s FROM "
+                   "[%ss] %s WHERE [%ss]._archived IS NULL",
+                   e->name,
+                   names,
+                   e->name,
+                   columns,
+                   e->name,
+                   join.v,
+                   e->name);
+    sdsfree(names);
+    sdsfree(columns);
+    sdsfree(join.v);
+    return $okay;
+error:
+    sdsfree(names);
+    sdsfree(columns);
+    sdsfree(join.v);
+    return $error("unable to compile full-text queries");
+}
+
+$status
+compile_list_batch(struct entity* e, struct query_plan* plan)
+{
+    // Lists showing computed fields first pick the page of Ids, then
+    // compute the fields for the whole page with one grouped query per
+    // aggregated relation instead of a subquery per row.
+    struct formula_batch* batch = new_formula_batch("SELECT Id FROM [page]");
+    sds                   joins = NULL;
+    wrapped_sql           listed_joins = build_entity_query_joins(e, true);
+    $inspect(listed_joins, error);
+    wrapped_sql columns = build_entity_query_columns(e, true, false, batch);
+    $inspect(columns, error);
+    joins = formula_batch_joins(batch);
+    plan->list_select_sql =
+      sdscatprintf(sdsempty(), "SELECT [%ss].Id", e->name);
+    plan->list_batch_sql = sdscatprintf(sdsempty(), "SELECT %s", columns.v);
+    plan->list_batch_from_sql =
+      sdscatprintf(sdsempty(),
+                   " FROM [page] INNER JOIN [%ss] ON [%ss].Id = [page].Id%s%s",
+                   e->name,
+                   e->name,
+                   listed_joins.v,
+                   joins);
+    sdsfree(columns.v);
+    sdsfree(listed_joins.v);
+    sdsfree(joins);
+    free_formula_batch(batch);
+    return $okay;
+error:
+    sdsfree(listed_joins.v);
+    free_formula_batch(batch);
+    return $error("unable to compile list formulas");
+}
+
+$typedef(struct query_plan*) wrapped_plan;
+
+wrapped_plan
+compile_entity_plan(struct entity* e)
+{
+    struct query_plan* plan = calloc(1, sizeof(struct query_plan));
+    plan->n_fields          = e->n_fields;
+    plan->fields = calloc(plan->n_fields, sizeof(struct field_plan));
+
+    // Column positions mirror build_entity_query_columns: the Id comes
+    // first, listed fields make up the list query and every REF field takes
+    // three columns (key, archived flag, value) in the object query. Every
+    // field but AUTO ones binds the parameter of its position in the insert
+    // and update statements. Plans are indexed by field id.
+    int  list_column = 1;
+    int  obj_column  = 1;
+    int  param       = 1;
+    bool batched     = false;
+    $foreach_field(f, e)
+    {
+        struct field_plan* fp = &plan->fields[f->id];
+        fp->base              = f;
+        fp->list_column       = -1;
+        fp->obj_key           = -1;
+        fp->param             = f->type == AUTO ? 0 : param++;
+        if (f->listed) {
+            fp->list_column = list_column++;
+            batched = batched || (f->type == AUTO && !f->materialized);
+        }
+        if (f->type == REF) {
+            fp->obj_key = obj_column;
+            obj_column += 2;
+        }
+        fp->obj_column = obj_column++;
+        if (f->materialized) {
+            $check(
+              f->type == AUTO, "only AUTO fields can be materialized", error);
+            wrapped_formula fm = compile_formula(e, f);
+            $inspect(fm, error);
+            fp->formula = fm.v;
+        }
+        if (f->type != AUTO) {
+            wrapped_sql value = build_ref_value_query(e, f);
+            $inspect(value, error);
+            wrapped_sql key = build_ref_key_query(e, f);
+            $inspect(key, error);
+            fp->value_sql   = value.v;
+            fp->key_sql     = key.v;
+            fp->value_field = f;
+            while (fp->value_field->type == REF)
+                fp->value_field = fp->value_field->ref.field;
+        }
+    }
+
+    plan->n_list_columns = list_column;
+    wrapped_sql from     = build_list_query_from(e);
+    $inspect(from, error);
+    plan->list_from_sql = from.v;
+    if (batched) {
+        $onerror2(compile_list_batch(e, plan)) goto error;
+    } else {
+        wrapped_sql columns =
+          build_entity_query_columns(e, true, false, NULL);
+        $inspect(columns, error);
+        plan->list_select_sql =
+          sdscatprintf(sdsempty(), "SELECT %s", columns.v);
+        sdsfree(columns.v);
+    }
+    if (e->fulltext) {
+        $onerror2(compile_fulltext_queries(e, plan)) goto error;
+    }
+    wrapped_sql search = build_list_query_search(e);
+    $inspect(search, error);
+    plan->search_sql = search.v;
+    wrapped_sql obj = build_obj_query(e);
+    $inspect(obj, error);
+    plan->obj_sql     = obj.v;
+    plan->insert_sql  = create_insert_statement(e);
+    plan->update_sql  = create_update_statement(e);
+    plan->archive_sql = create_archive_statement(e);
+    return (wrapped_plan){ plan };
+error:
+    cleanup_query_plan(plan);
+    return $invalid(wrapped_plan);
+}
+
+$status
+compile_query_plans()
+{
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        wrapped_plan plan = compile_entity_plan(e);
+        $onerror(plan)
+        {
+            $log_error("unable to compile queries for entity %s", e->name);
+            return $error("failure compiling model queries");
+        }
+        e->plan = plan.v;
+    }
+    return $okay;
+}
+
+void
+cleanup_query_plans()
+{
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        cleanup_query_plan(e->plan);
+        e->plan = NULL;
+    }
+}
+
+const struct field_plan*
+find_field_plan(const struct entity* e, const struct field* f)
+{
+    if (f == NULL || f->entity != e || e->plan == NULL) return NULL;
+    return &e->plan->fields[f->id];
+}
+
 wrapped_time_t
 parse_date_field(const char* str)
 {
-    struct tm ti = { 0 };
-    if (sscanf(str, "%4d-%2d-%2d", &ti.tm_year, &ti.tm_mon, &ti.tm_mday) != 3) {
-        return $invalid(wrapped_time_t);
+    time_t t;
+    if (parse_date(str, &t) != 0) return $invalid(wrapped_time_t);
+    return (wrapped_time_t){ t };
+}
+
+/* -- ROLLING WINDOWS -- */
+
+static time_t g_as_of_date;
+
+void
+set_as_of_date(time_t t)
+{
+    g_as_of_date = t;
+}
+
+time_t
+get_as_of_date()
+{
+    return g_as_of_date;
+}
+
+void
+bind_as_of_date(sqlite3_stmt* res)
+{
+    int idx = sqlite3_bind_parameter_index(res, "@as_of");
+    if (idx == 0) return;
+    // Dates are stored as the local midnight of their day, today is parsed
+    // back from its local calendar date to match them.
+    time_t t = g_as_of_date;
+    if (t == 0) {
+        char      today[DATE_TEXT_SIZE];
+        struct tm tm;
+        time_t    now = time(NULL);
+        localtime_r(&now, &tm);
+        strftime(today, sizeof(today), "%Y-%m-%d", &tm);
+        parse_date(today, &t);
     }
-    ti.tm_year -= 1900;
-    ti.tm_mon -= 1;
-    ti.tm_isdst = -1;
-    return (wrapped_time_t){ mktime(&ti) };
+    sqlite3_bind_int64(res, idx, (sqlite3_int64)t);
 }
 
 $status
 bind_sql_params(struct entity_value* e, sqlite3_stmt* res, int key)
 {
-    $status ret   = $okay;
-    sds     fname = sdsempty();
-    $foreach_hashed(struct field_value*, f, e->fields)
-    {
-        if (f->base->type == AUTO) continue;
-        fname   = sdscatprintf(fname, "@%s", f->base->name);
-        int idx = sqlite3_bind_parameter_index(res, fname);
+    $status ret = $okay;
+    for (int i = 0; i < e->base->n_fields; i++) {
+        int                 idx = e->base->plan->fields[i].param;
+        struct field_value* f   = e->values[i];
+        if (idx == 0) continue;
         if (f->base->type == REF) {
             sqlite3_bind_int(res, idx, f->_kvalue);
         } else if (f->base->type == BOOLEAN) {
@@ -1118,15 +1699,12 @@ bind_sql_params(struct entity_value* e, sqlite3_stmt* res, int key)
                               strlen((char*)f->_ret_value),
                               SQLITE_TRANSIENT);
         }
-        sdsfree(fname);
-        fname = sdsempty();
     }
     if (key >= 0) {
         int idx = sqlite3_bind_parameter_index(res, "@id");
         sqlite3_bind_int(res, idx, key);
     }
 cleanup:
-    sdsfree(fname);
     return ret;
 }
 
@@ -1137,94 +1715,182 @@ init_fields(struct entity_value* e, sqlite3* db, int key)
 {
     $status ret = $okay;
     if (key <= 0) return $okay;
-    wrapped_sql sql = build_obj_query(e->base);
-    $inspect(sql, ret, exit);
-    sqlite3_stmt* res;
-    $check(sqlite3_prepare_v2(db, sql.v, -1, &res, 0) == SQLITE_OK,
-           sqlite3_errmsg(db),
-           error);
-    int idx = sqlite3_bind_parameter_index(res, "@id");
+    wrapped_stmt ws = prepare_obj_query(e->base, db);
+    $inspect(ws, ret, exit);
+    sqlite3_stmt* res = ws.v;
+    int           idx = sqlite3_bind_parameter_index(res, "@id");
     sqlite3_bind_int(res, idx, key);
-    while (sqlite3_step(res) == SQLITE_ROW) {
-        int i = 1;
+    int rc;
+    while ((rc = sqlite3_step(res)) == SQLITE_ROW) {
         $foreach_hashed(struct field_value*, f, e->fields)
         {
+            const struct field_plan* fp = find_field_plan(e->base, f->base);
             if (f->base->type == REF) {
-                f->_kvalue = sqlite3_column_int(res, i);
-                i++;
-                f->is_archived = (sqlite3_column_type(res, i) != SQLITE_NULL);
-                i++;
+                f->_kvalue = sqlite3_column_int(res, fp->obj_key);
+                f->is_archived =
+                  (sqlite3_column_type(res, fp->obj_key + 1) != SQLITE_NULL);
             }
-            sds v = field_value_to_string(f->base, res, i);
+            sds v = field_value_to_string(f->base, res, fp->obj_column);
             if (v != NULL) {
                 if (f->_init_value != NULL) free(f->_init_value);
                 f->_init_value = malloc(strlen((char*)v) + 1);
                 strcpy((char*)f->_init_value, (char*)v);
             }
             sdsfree(v);
-            i++;
         }
     }
-    sqlite3_reset(res);
-    sqlite3_finalize(res);
-    ret = $okay;
-error:
-    sdsfree(sql.v);
+    release_cached_stmt(res);
+    // An interrupted query leaves the fields half loaded.
+    if (rc != SQLITE_DONE) ret = $error("unable to load the record");
 exit:
     return ret;
 }
 
+$status
+sync_fulltext_rows(sqlite3*            db,
+                   struct entity*      e,
+                   const struct field* column,
+                   int                 key)
+{
+    // Rows are re-indexed by deleting whatever the index holds for them and
+    // inserting them back if they are still active. A column picks the rows
+    // whose REF chain goes through it, it belongs to the entity or to one
+    // of the entities its index joins.
+    sqlite3_stmt*   del;
+    sqlite3_stmt*   ins;
+    sds             cond = NULL;
+    struct stmt_key dk = { .e = e, .kind = STMT_FTS_DELETE, .field = column };
+    struct stmt_key ik = { .e = e, .kind = STMT_FTS_INSERT, .field = column };
+    $check(cond = sdscatprintf(sdsempty(),
+                               "[%ss].[%s] = @id",
+                               column == NULL ? e->name : column->entity->name,
+                               column == NULL ? "Id" : column->name));
+    if ((del = find_cached_stmt(db, &dk)) == NULL) {
+        wrapped_sql join = build_entity_query_joins(e, true);
+        $inspect(join, error);
+        sds sql = column == NULL
+                    ? sdscatprintf(sdsempty(),
+                                   "DELETE FROM [%ss_fts] WHERE rowid = @id",
+                                   e->name)
+                    : sdscatprintf(sdsempty(),
+                                   "DELETE FROM [%ss_fts] WHERE rowid IN "
+                                   "(SELECT [%ss].Id FROM [%ss] %s WHERE %s)",
+                                   e->name,
+                                   e->name,
+                                   e->name,
+                                   join.v,
+                                   cond);
+        sdsfree(join.v);
+        wrapped_stmt ws = cache_stmt(db, &dk, sql);
+        sdsfree(sql);
+        del = $unwrap(ws);
+    }
+    if ((ins = find_cached_stmt(db, &ik)) == NULL) {
+        sds sql = sdscatprintf(
+          sdsempty(), "%s AND %s", e->plan->fts_insert_sql, cond);
+        wrapped_stmt ws = cache_stmt(db, &ik, sql);
+        sdsfree(sql);
+        ins = $unwrap(ws);
+    }
+    sqlite3_bind_int(del, 1, key);
+    sqlite3_bind_int(ins, 1, key);
+    int drc = sqlite3_step(del);
+    int irc = sqlite3_step(ins);
+    release_cached_stmt(del);
+    release_cached_stmt(ins);
+    $check(drc == SQLITE_DONE && irc == SQLITE_DONE, sqlite3_errmsg(db), error);
+    sdsfree(cond);
+    return $okay;
+error:
+    sdsfree(cond);
+    return $error("unable to update full-text index");
+}
+
+$status
+sync_fulltext(sqlite3* db, struct entity* e, int key)
+{
+    if (e->fulltext) {
+        $status ret = sync_fulltext_rows(db, e, NULL, key);
+        if $iserror (ret) return ret;
+    }
+    // Records that display this one through a listed REF field carry its
+    // text in their own index rows, also when the field reaches it through
+    // other REF fields.
+    $foreach_hashed(struct entity*, d, g_entities)
+    {
+        if (d->fulltext == false) continue;
+        $foreach_field(f, d)
+        {
+            if (f->listed == false) continue;
+            for (struct field* r = f; r->type == REF; r = r->ref.field) {
+                if (r->ref.entity != e) continue;
+                $status ret = sync_fulltext_rows(db, d, r, key);
+                if $iserror (ret) return ret;
+            }
+        }
+    }
+    return $okay;
+}
+
 wrapped_key
 apply_form(struct entity_value* e, sqlite3* db, int key)
 {
-    wrapped_key ret;
-    sds         sql2;
-    if (key >= 0) {
-        sql2 = create_update_statement(e->base);
-    } else {
-        sql2 = create_insert_statement(e->base);
+    wrapped_key     ret;
+    struct stmt_key sk  = { .e    = e->base,
+                           .kind = key >= 0 ? STMT_UPDATE : STMT_INSERT };
+    sqlite3_stmt*   res = find_cached_stmt(db, &sk);
+    if (res == NULL) {
+        const char*  sql = key >= 0 ? e->base->plan->update_sql
+                                    : e->base->plan->insert_sql;
+        wrapped_stmt ws  = cache_stmt(db, &sk, sql);
+        res              = $unwrap(ws, ret.status, cleanup);
     }
-    sqlite3_stmt* res;
-    $check(sqlite3_prepare_v2(db, sql2, -1, &res, 0) == SQLITE_OK,
-           ret.status,
-           sqlite3_errmsg(db),
-           cleanup_sql);
     $onerror2(bind_sql_params(e, res, key))
     {
         ret = $invalid(wrapped_key);
         goto cleanup_sqlite;
     }
+    sqlite3_exec(db, "SAVEPOINT apply_form", 0, 0, 0);
     if (sqlite3_step(res) == SQLITE_DONE) {
         if (key <= 0) key = sqlite3_last_insert_rowid(db);
     }
     ret = (wrapped_key){ key };
+    $onerror2(sync_fulltext(db, e->base, key))
+    {
+        ret = $invalid(wrapped_key, "unable to update full-text index");
+        sqlite3_exec(db, "ROLLBACK TO apply_form", 0, 0, 0);
+    }
+    sqlite3_exec(db, "RELEASE apply_form", 0, 0, 0);
 cleanup_sqlite:
-    sqlite3_finalize(res);
-cleanup_sql:
-    sdsfree(sql2);
+    release_cached_stmt(res);
+cleanup:
     return ret;
 }
 
 wrapped_key
 archive_obj(struct entity* e, sqlite3* db, int key)
 {
-    wrapped_key ret;
-    sds         sql2;
-    sql2 = create_archive_statement(e);
-    sqlite3_stmt* res;
-    $check(sqlite3_prepare_v2(db, sql2, -1, &res, 0) == SQLITE_OK,
-           ret.status,
-           sqlite3_errmsg(db),
-           cleanup_sql);
+    wrapped_key     ret;
+    struct stmt_key sk  = { .e = e, .kind = STMT_ARCHIVE };
+    sqlite3_stmt*   res = find_cached_stmt(db, &sk);
+    if (res == NULL) {
+        wrapped_stmt ws = cache_stmt(db, &sk, e->plan->archive_sql);
+        res             = $unwrap(ws, ret.status, cleanup);
+    }
     int idx = sqlite3_bind_parameter_index(res, "@id");
     sqlite3_bind_int(res, idx, key);
-    $log_info("----------SQL DELETE\n%s key: %d", sql2, key);
+    sqlite3_exec(db, "SAVEPOINT archive_obj", 0, 0, 0);
     if (sqlite3_step(res) == SQLITE_DONE) {
         if (key <= 0) key = sqlite3_last_insert_rowid(db);
     }
     ret = (wrapped_key){ key };
-    sqlite3_finalize(res);
-cleanup_sql:
-    sdsfree(sql2);
+    $onerror2(sync_fulltext(db, e, key))
+    {
+        ret = $invalid(wrapped_key, "unable to update full-text index");
+        sqlite3_exec(db, "ROLLBACK TO archive_obj", 0, 0, 0);
+    }
+    sqlite3_exec(db, "RELEASE archive_obj", 0, 0, 0);
+    release_cached_stmt(res);
+cleanup:
     return ret;
 }
@@ -18,11 +18,17 @@
 #ifndef _TURBOBUILDER_MSQL_H_
 #define _TURBOBUILDER_MSQL_H_
 
+#include <time.h>
+
 #include "coastguard/coastguard.h"
 #include "sds/sds.h"
 #include "sqlite/sqlite3.h"
 
+#include "dates.h"
 #include "model.h"
+#include "stmtcache.h"
+
+#define FIELD_TEXT_SIZE 512
 
 $typedef(sds) wrapped_sql;
 
@@ -43,10 +49,13 @@ struct field_value
     UT_hash_handle hh;
 };
 
+/* Field values are hashed by name in fields and indexed by field id in
+ * values. */
 struct entity_value
 {
-    struct entity*      base;
-    struct field_value* fields;
+    struct entity*       base;
+    struct field_value*  fields;
+    struct field_value** values;
 };
 
 struct lookup_filter_data
@@ -59,18 +68,108 @@ struct lookup_filter_data
 
 struct context
 {
-    char* fname;
-    int   k;
+    struct field* field;
+    int           k;
+};
+
+/* -- QUERY PLANS -- */
+
+struct formula;
+
+struct field_plan
+{
+    struct field*   base;
+    int             list_column;
+    int             obj_key;
+    int             obj_column;
+    int             param;
+    char*           value_sql;
+    char*           key_sql;
+    struct field*   value_field;
+    struct formula* formula;
+};
+
+struct query_plan
+{
+    char*              list_select_sql;
+    char*              list_from_sql;
+    char*              list_batch_sql;
+    char*              list_batch_from_sql;
+    char*              search_sql;
+    char*              fts_sql;
+    char*              fts_insert_sql;
+    char*              obj_sql;
+    char*              insert_sql;
+    char*              update_sql;
+    char*              archive_sql;
+    int                n_list_columns;
+    int                n_fields;
+    struct field_plan* fields;
+};
+
+/* -- LIST PAGES -- */
+
+/* Lists are fetched in pages of up to `limit` rows, each page continues
+ * after the last row of the previous one. */
+struct list_page
+{
+    int            limit;
+    int            rows;
+    bool           more;
+    int            last_key;
+    sqlite3_value* last_order;
 };
 
+$status
+compile_query_plans();
+
+void
+cleanup_query_plans();
+
+const struct field_plan*
+find_field_plan(const struct entity* e, const struct field* f);
+
 $status
 create_tables_from_model(sqlite3* db);
 
+$status
+create_indexes_from_model(sqlite3* db);
+
 sds
-get_ref_value(sqlite3* db, int key, const char* ename, const char* efield);
+get_ref_value(sqlite3* db, int key, const struct fpath* ref);
 
 wrapped_sql
-build_list_query(struct entity* e, sqlite3* db, struct context* ctx, struct lookup_filter_data * ldf,struct order* order);
+build_list_query(struct entity*             e,
+                 struct context*            ctx,
+                 struct lookup_filter_data* ldf,
+                 struct order*              order,
+                 bool                       search);
+
+wrapped_stmt
+prepare_list_query(struct entity*             e,
+                   sqlite3*                   db,
+                   struct context*            ctx,
+                   struct lookup_filter_data* ldf,
+                   struct order*              order,
+                   const char*                search_term,
+                   const struct list_page*    page);
+
+void
+advance_list_page(struct entity* e, struct list_page* page, sqlite3_stmt* res);
+
+void
+reset_list_page(struct list_page* page);
+
+/* Returns the text shown for a field's value without allocating, along
+ * with its length in bytes. Formatted values are written into buf, which
+ * holds FIELD_TEXT_SIZE bytes, TEXT values point into the statement's row
+ * and are valid until it is stepped. */
+const char*
+field_value_text(struct field* f,
+                 sqlite3_stmt* res,
+                 int           index,
+                 char*         buf,
+                 int*          len);
 
 sds
 field_value_to_string(struct field* f, sqlite3_stmt* res, int index);
@@ -78,10 +177,44 @@ field_value_to_string(struct field* f, sqlite3_stmt* res, int index);
 wrapped_sql
 build_obj_query(struct entity* e);
 
+wrapped_stmt
+prepare_obj_query(struct entity* e, sqlite3* db);
+
+wrapped_sql
+build_export_query(struct entity* e);
+
 $status
 init_fields(struct entity_value* e, sqlite3* db, int key);
 
 $typedef(int) wrapped_key;
+$typedef(int) wrapped_rows;
+
+wrapped_key
+get_ref_key(sqlite3* db, const char* value, const struct fpath* ref);
+
+$typedef(time_t) wrapped_time_t;
+
+wrapped_time_t
+parse_date_field(const char* str);
+
+/* -- ROLLING WINDOWS -- */
+
+/* Rolling windows compare dates with @as_of, the start of the day they end
+ * on: the current local day, or the DATE value given here as
+ * parse_date_field returns it. */
+void
+set_as_of_date(time_t t);
+/* Returns the time given to set_as_of_date, 0 when windows end today. */
+time_t
+get_as_of_date();
+void
+bind_as_of_date(sqlite3_stmt* res);
+
+$status
+sync_fulltext_rows(sqlite3*            db,
+                   struct entity*      e,
+                   const struct field* column,
+                   int                 key);
 
 wrapped_key
 apply_form(struct entity_value* e, sqlite3* db, int key);
@@ -0,0 +1,213 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core/iterators.h"
+#include "ut/uthash.h"
+
+#include "querylog.h"
+
+#define QUERY_PLAN_DEPTH 64
+
+struct slow_query
+{
+    sds            sql;
+    int            runs;
+    double         total_ms;
+    double         max_ms;
+    int            vm_steps;
+    int            full_scans;
+    int            sorts;
+    int            autoindexes;
+    UT_hash_handle hh;
+};
+
+/* Statements of the query worker's connection are recorded from its own
+ * thread, the lock guards the recorded queries. */
+static struct
+{
+    int                threshold_ms;
+    bool               running;
+    bool               explaining;
+    pthread_mutex_t    lock;
+    struct slow_query* queries;
+} query_log = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* -- TRACING -- */
+
+static int
+counter(sqlite3_stmt* res, int op)
+{
+    return sqlite3_stmt_status(res, op, 1);
+}
+
+static int
+trace_statement(unsigned type, void* ctx, void* p, void* x)
+{
+    // The counters are reset on every run, so that cached statements do not
+    // add up their earlier runs.
+    sqlite3_stmt* res         = p;
+    double        ms          = *(sqlite3_int64*)x / 1e6;
+    int           vm_steps    = counter(res, SQLITE_STMTSTATUS_VM_STEP);
+    int           full_scans  = counter(res, SQLITE_STMTSTATUS_FULLSCAN_STEP);
+    int           sorts       = counter(res, SQLITE_STMTSTATUS_SORT);
+    int           autoindexes = counter(res, SQLITE_STMTSTATUS_AUTOINDEX);
+    if (query_log.explaining || ms < query_log.threshold_ms) return 0;
+
+    const char*        sql = sqlite3_sql(res);
+    struct slow_query* q;
+    pthread_mutex_lock(&query_log.lock);
+    HASH_FIND_STR(query_log.queries, sql, q);
+    if (q == NULL) {
+        q      = calloc(1, sizeof(struct slow_query));
+        q->sql = sdsnew(sql);
+        HASH_ADD_KEYPTR(hh, query_log.queries, q->sql, sdslen(q->sql), q);
+    }
+    q->runs++;
+    q->total_ms += ms;
+    if (ms >= q->max_ms) {
+        q->max_ms          = ms;
+        q->vm_steps        = vm_steps;
+        q->full_scans      = full_scans;
+        q->sorts           = sorts;
+        q->autoindexes     = autoindexes;
+    }
+    pthread_mutex_unlock(&query_log.lock);
+    return 0;
+}
+
+$status
+start_query_log(sqlite3* db, int threshold_ms)
+{
+    query_log.threshold_ms = threshold_ms;
+    query_log.running      = true;
+    if (sqlite3_trace_v2(
+          db, SQLITE_TRACE_PROFILE, trace_statement, NULL) != SQLITE_OK) {
+        $log_error("unable to trace statements: %s", sqlite3_errmsg(db));
+        return $error("unable to trace statements");
+    }
+    return $okay;
+}
+
+void
+trace_query_log(sqlite3* db)
+{
+    if (query_log.running) {
+        sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, trace_statement, NULL);
+    }
+}
+
+void
+stop_query_log(sqlite3* db)
+{
+    sqlite3_trace_v2(db, 0, NULL, NULL);
+    query_log.running = false;
+    struct slow_query *q, *tmp_q;
+    HASH_ITER(hh, query_log.queries, q, tmp_q)
+    {
+        HASH_DEL(query_log.queries, q);
+        sdsfree(q->sql);
+        free(q);
+    }
+}
+
+/* -- DESCRIPTION -- */
+
+static int
+compare_slow_queries(struct slow_query* a, struct slow_query* b)
+{
+    return (a->max_ms < b->max_ms) - (a->max_ms > b->max_ms);
+}
+
+static sds
+describe_query_plan(sqlite3* db, sds s, const char* sql)
+{
+    // Plan rows refer to their parent row, the nesting is kept in a stack
+    // of the ids above the current row.
+    sqlite3_stmt* res;
+    sds           eqp = sdscatprintf(sdsempty(), "EXPLAIN QUERY PLAN %s", sql);
+    query_log.explaining = true;
+    if (sqlite3_prepare_v2(db, eqp, -1, &res, 0) != SQLITE_OK) {
+        s = sdscatprintf(s, "  no query plan: %s\n", sqlite3_errmsg(db));
+    } else {
+        int ids[QUERY_PLAN_DEPTH];
+        int depth = 0;
+        while (sqlite3_step(res) == SQLITE_ROW) {
+            int id     = sqlite3_column_int(res, 0);
+            int parent = sqlite3_column_int(res, 1);
+            while (depth > 0 && ids[depth - 1] != parent)
+                depth--;
+            s = sdscatprintf(s,
+                             "  %*s|--%s\n",
+                             depth * 3,
+                             "",
+                             sqlite3_column_text(res, 3));
+            if (depth < QUERY_PLAN_DEPTH) ids[depth++] = id;
+        }
+        sqlite3_finalize(res);
+    }
+    query_log.explaining = false;
+    sdsfree(eqp);
+    return s;
+}
+
+sds
+describe_query_log(sqlite3* db)
+{
+    sds s = sdsempty();
+    pthread_mutex_lock(&query_log.lock);
+    HASH_SORT(query_log.queries, compare_slow_queries);
+    $foreach_hashed(struct slow_query*, q, query_log.queries)
+    {
+        s = sdscatprintf(s,
+                         "%.1f ms slowest, %.1f ms in %d runs\n"
+                         "  %d VM steps, %d full-scan steps, %d sorts, "
+                         "%d automatic indexes\n"
+                         "  %s\n",
+                         q->max_ms,
+                         q->total_ms,
+                         q->runs,
+                         q->vm_steps,
+                         q->full_scans,
+                         q->sorts,
+                         q->autoindexes,
+                         q->sql);
+        s = describe_query_plan(db, s, q->sql);
+        s = sdscat(s, "\n");
+    }
+    pthread_mutex_unlock(&query_log.lock);
+    return s;
+}
+
+$status
+write_query_log(sqlite3* db, const char* filename)
+{
+    FILE* out = fopen(filename, "w");
+    if (!out) {
+        $log_error("unable to write the slow-query log to %s", filename);
+        return $error("unable to write the slow-query log");
+    }
+    sds s = describe_query_log(db);
+    fputs(s, out);
+    sdsfree(s);
+    fclose(out);
+    return $okay;
+}
@@ -0,0 +1,52 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_QUERYLOG_H_
+#define _TURBOBUILDER_QUERYLOG_H_
+
+#include "coastguard/coastguard.h"
+#include "sds/sds.h"
+#include "sqlite/sqlite3.h"
+
+#define DEFAULT_SLOW_QUERY_MS 100
+
+/* -- SLOW-QUERY LOG -- */
+
+/* Times every statement run on the database and keeps those that ran for
+ * threshold_ms or longer, with the VM steps, full-scan steps, sorts and
+ * automatic indexes of their slowest run. */
+$status
+start_query_log(sqlite3* db, int threshold_ms);
+
+/* Times the statements of another connection to the same database as well,
+ * when the log was started. */
+void
+trace_query_log(sqlite3* db);
+
+/* Describes the slow statements, slowest first, each with its query plan.
+ * The string is empty when no statement was slow. */
+sds
+describe_query_log(sqlite3* db);
+
+$status
+write_query_log(sqlite3* db, const char* filename);
+
+/* Stops timing the statements and forgets the slow ones. */
+void
+stop_query_log(sqlite3* db);
+
+#endif
@@ -3,7 +3,9 @@
 %header {
 #include "model.h"
 struct t_parser {
-    FILE* in;
+    const char* buf;
+    size_t size;
+    size_t pos;
     char* ns;
     struct entity* e;
     struct relation* r;
@@ -13,6 +15,7 @@ struct t_parser {
     args_stack_element * head;
     int error;
     int col,line;
+    size_t base;
 };
 int get_character(struct t_parser* parser);
 
@@ -27,7 +30,6 @@ int get_character(struct t_parser* parser);
 #include "core/iterators.h"
 #include "sds/sds.h"
 #include "coastguard/coastguard.h"
-#include <wchar.h>
 
 #define PCC_GETCHAR(auxil) get_character(auxil)
 #define FOREACH_HASHED(T, V, HM) \
@@ -36,24 +38,88 @@ int get_character(struct t_parser* parser);
 int
 get_character(struct t_parser* parser)
 {
-    static int col = 0;
-    static int line = 0;
-    unsigned int c = fgetwc(parser->in);
+    if (parser->pos == parser->size)
+        return -1;
+    int c = (unsigned char)parser->buf[parser->pos++];
     if (c == '\n') {
-        line++;
-        col = 0;
+        parser->line++;
+        parser->col = 0;
     } else
-        col++;
-    parser->col = col;
-    parser->line = line;
-    if (c == WEOF)
-        return -1;
+        parser->col++;
     return c;
 }
 
+/* Finds the line and column of a position in the current compound, given
+ * relative to the parser's base. */
+static void
+locate(struct t_parser* parser, size_t pos, int* line, int* col)
+{
+    *line = 1;
+    *col = 1;
+    for (size_t i = 0; i < parser->base + pos && i < parser->size; i++) {
+        if (parser->buf[i] == '\n') {
+            (*line)++;
+            *col = 1;
+        } else
+            (*col)++;
+    }
+}
+
+/* Pops the arguments pushed since the last marker into a new function and
+ * pushes it as an argument of its own. Functions are checked against FUNCS,
+ * filters may only use FUNC_FILTER functions and formulas any other. */
+static void
+push_func(struct t_parser* parser, const char* name, size_t pos, bool filter)
+{
+    int line, col;
+    struct func * f = calloc(1, sizeof(struct func));
+    f->name = sdsnew(name);
+    f->op = find_func(name);
+    int nargs = 0;
+    for (args_stack_element * it = parser->head; it->arg != NULL; it = it->next)
+        nargs++;
+    f->n_args = nargs < MAX_ARGS ? nargs : MAX_ARGS;
+    for (int i = nargs-1; i >=0 ; --i) {
+        args_stack_element * item;
+        STACK_POP(parser->head, item);
+        if (i < MAX_ARGS)
+            f->args[i] = item->arg;
+        else {
+            sdsfree(item->arg->atfield);
+            sdsfree(item->arg->atentity);
+            free(item->arg);
+        }
+        free(item);
+    }
+    args_stack_element * marker;
+    STACK_POP(parser->head, marker);
+    free(marker);
+
+    if (f->op == OP_UNKNOWN || (FUNCS[f->op].kind == FUNC_FILTER) != filter) {
+        locate(parser, pos, &line, &col);
+        parser->error = 1;
+        printf("Unknown %s function '%s' at line %d, column %d ",
+               filter ? "filter" : "formula", name, line, col);
+    } else if (FUNCS[f->op].n_args != nargs) {
+        locate(parser, pos, &line, &col);
+        parser->error = 1;
+        printf("Function '%s' expects %d arguments, got %d at line %d, "
+               "column %d ", name, FUNCS[f->op].n_args, nargs, line, col);
+    }
+
+    args_stack_element * item = calloc(1, sizeof(args_stack_element));
+    item->arg = calloc(1, sizeof(struct arg));
+    item->arg->type = ATFUNC;
+    item->arg->atfunc = f;
+    STACK_PUSH(parser->head, item);
 }
 
-model <- _ e:compound {}
+}
+
+model <- _ e:compound {
+        struct t_parser * parser = auxil;
+        parser->base += $0e;
+    }
 
 compound <- 
     e:application { $$ = e; } /
@@ -184,6 +250,11 @@ entity_defs <- _ '}' {
     / _ e:relation _ entity_defs { 
         struct t_parser * parser = auxil;
     }
+    / _ 'fulltext' _ ':' _ b:identifier _ ';' _ entity_defs {
+        struct t_parser * parser = auxil;
+        if (parser->e == NULL) parser->e = create_entity();
+        if (strcmp(b, "true") == 0) parser->e->fulltext = true;
+    }
     / .* {
         struct t_parser * parser = auxil;
         parser->error = 1;
@@ -207,6 +278,10 @@ field_defs <- _ '}' {
         struct t_parser * parser = auxil;
         if (strcmp(b, "true") == 0) parser->f->bar = true;
     }
+    / _ 'materialized' _ ':' _ b:identifier _ ';' field_defs {
+        struct t_parser * parser = auxil;
+        if (strcmp(b, "true") == 0) parser->f->materialized = true;
+    }
     / _ 'ref' _ ':' _ c:identifier '.' a:identifier _ ';' field_defs { 
         struct t_parser * parser = auxil;
         parser->f->type = REF;
@@ -265,55 +340,17 @@ field_defs <- _ '}' {
         printf("Invalid field definition "); 
     }
 
-filter <-  fname:identifier _ '(' _ formula_args _ ')' _ {
-        struct t_parser * parser = auxil;
-        int nargs = 0;
-        if (strcmp(fname, "RefEq") == 0) nargs = 2;
-        struct func * f = calloc(1, sizeof(struct func));
-        f->name = sdsnew(fname);
-        f->n_args = nargs;
-        for (int i = nargs-1; i >=0 ; --i) {
-            args_stack_element * item;
-            STACK_POP(parser->head, item);
-            f->args[i] = item->arg;
-            free(item);
-        }
-        args_stack_element * item = calloc(1, sizeof(args_stack_element));
-        item->arg = calloc(1, sizeof(struct arg));
-        item->arg->type = ATFUNC;
-        item->arg->atfunc = f;
-        STACK_PUSH(parser->head, item);
+filter <-  fname:identifier _ args_open _ formula_args _ ')' _ {
+        push_func(auxil, fname, $0s, true);
     }
 
-formula <-  fname:identifier _ '(' _ formula_args _ ')' _ { 
-        struct t_parser * parser = auxil;
-        int nargs = 0;
-        if (strcmp(fname, "Get") == 0) nargs = 1;
-        if (strcmp(fname, "Sum") == 0) nargs = 1;
-        if (strcmp(fname, "Min") == 0) nargs = 1;
-        if (strcmp(fname, "Max") == 0) nargs = 1;
-        if (strcmp(fname, "Avg") == 0) nargs = 1;
-        if (strcmp(fname, "RollingDaysAvg") == 0) nargs = 3;
-        if (strcmp(fname, "RollingDaysSum") == 0) nargs = 3;
-        if (strcmp(fname, "AvgIfEq") == 0) nargs = 3;
-        if (strcmp(fname, "CountIfEq") == 0) nargs = 3;
-        if (strcmp(fname, "Count") == 0) nargs = 1;
-        if (strcmp(fname, "Sub") == 0) nargs = 2;
-        if (strcmp(fname, "Mul") == 0) nargs = 2;
-        if (strcmp(fname, "Div") == 0) nargs = 2;
-        struct func * f = calloc(1, sizeof(struct func));
-        f->name = sdsnew(fname);
-        f->n_args = nargs;
-        for (int i = nargs-1; i >=0 ; --i) {
-            args_stack_element * item;
-            STACK_POP(parser->head, item);
-            f->args[i] = item->arg;
-            free(item);
-        }
+formula <-  fname:identifier _ args_open _ formula_args _ ')' _ { 
+        push_func(auxil, fname, $0s, false);
+    }
+
+args_open <- '(' {
+        struct t_parser * parser = auxil;
         args_stack_element * item = calloc(1, sizeof(args_stack_element));
-        item->arg = calloc(1, sizeof(struct arg));
-        item->arg->type = ATFUNC;
-        item->arg->atfunc = f;
         STACK_PUSH(parser->head, item);
     }
 
@@ -0,0 +1,178 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/iterators.h"
+#include "ut/uthash.h"
+
+#include "refcache.h"
+
+struct ref_cache_key
+{
+    const struct entity* e;
+    const struct field*  f;
+    int                  key;
+};
+
+struct ref_cache_entry
+{
+    struct ref_cache_key k;
+    sds                  value;
+    bool                 chained;
+    UT_hash_handle       hh;
+};
+
+/* Entries are kept in the order they were last used, the oldest first.
+ * Lookups may come from the query worker thread, the update hook from the
+ * thread writing to the database. */
+static struct
+{
+    pthread_mutex_t         lock;
+    struct ref_cache_entry* entries;
+    int                     n_chained;
+} g_ref_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+set_cache_key(struct ref_cache_key* k,
+              const struct entity*  e,
+              const struct field*   f,
+              int                   key)
+{
+    memset(k, 0, sizeof(struct ref_cache_key));
+    k->e   = e;
+    k->f   = f;
+    k->key = key;
+}
+
+static void
+drop_entry(struct ref_cache_entry* r)
+{
+    HASH_DEL(g_ref_cache.entries, r);
+    if (r->chained) g_ref_cache.n_chained--;
+    sdsfree(r->value);
+    free(r);
+}
+
+sds
+find_ref_value(const struct entity* e, const struct field* f, int key)
+{
+    struct ref_cache_key    k;
+    struct ref_cache_entry* r;
+    sds                     value = NULL;
+    set_cache_key(&k, e, f, key);
+    pthread_mutex_lock(&g_ref_cache.lock);
+    HASH_FIND(hh, g_ref_cache.entries, &k, sizeof(k), r);
+    if (r != NULL) {
+        HASH_DEL(g_ref_cache.entries, r);
+        HASH_ADD(hh, g_ref_cache.entries, k, sizeof(k), r);
+        value = sdsdup(r->value);
+    }
+    pthread_mutex_unlock(&g_ref_cache.lock);
+    return value;
+}
+
+void
+cache_ref_value(const struct entity* e,
+                const struct field*  f,
+                int                  key,
+                const char*          value,
+                bool                 chained)
+{
+    struct ref_cache_entry* r = calloc(1, sizeof(struct ref_cache_entry));
+    struct ref_cache_entry* old;
+    set_cache_key(&r->k, e, f, key);
+    r->value   = sdsnew(value);
+    r->chained = chained;
+    pthread_mutex_lock(&g_ref_cache.lock);
+    HASH_FIND(hh, g_ref_cache.entries, &r->k, sizeof(r->k), old);
+    if (old != NULL) drop_entry(old);
+    if (HASH_COUNT(g_ref_cache.entries) >= REF_CACHE_ENTRIES) {
+        drop_entry(g_ref_cache.entries);
+    }
+    HASH_ADD(hh, g_ref_cache.entries, k, sizeof(r->k), r);
+    if (chained) g_ref_cache.n_chained++;
+    pthread_mutex_unlock(&g_ref_cache.lock);
+}
+
+/* -- INVALIDATION -- */
+
+static struct entity*
+find_table_entity(const char* table)
+{
+    // Tables are named after their entity with an "s" suffix.
+    $foreach_hashed(struct entity*, e, g_entities)
+    {
+        size_t n = strlen(e->name);
+        if (strncmp(table, e->name, n) == 0 && strcmp(table + n, "s") == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+invalidate_ref_values(void*         arg,
+                      int           op,
+                      const char*   db_name,
+                      const char*   table,
+                      sqlite3_int64 rowid)
+{
+    // Inserted rows were not cached yet. The values of a changed record
+    // are found by their field, chained values may display any record
+    // and are all dropped.
+    if (op == SQLITE_INSERT) return;
+    struct entity* e = find_table_entity(table);
+    if (e == NULL) return;
+    struct ref_cache_key    k;
+    struct ref_cache_entry* r;
+    pthread_mutex_lock(&g_ref_cache.lock);
+    $foreach_field(f, e)
+    {
+        set_cache_key(&k, e, f, rowid);
+        HASH_FIND(hh, g_ref_cache.entries, &k, sizeof(k), r);
+        if (r != NULL) drop_entry(r);
+    }
+    if (g_ref_cache.n_chained > 0) {
+        struct ref_cache_entry* tmp_r;
+        HASH_ITER(hh, g_ref_cache.entries, r, tmp_r)
+        {
+            if (r->chained) drop_entry(r);
+        }
+    }
+    pthread_mutex_unlock(&g_ref_cache.lock);
+}
+
+void
+watch_ref_values(sqlite3* db)
+{
+    sqlite3_update_hook(db, invalidate_ref_values, NULL);
+}
+
+void
+clear_ref_cache()
+{
+    struct ref_cache_entry *r, *tmp_r;
+    pthread_mutex_lock(&g_ref_cache.lock);
+    HASH_ITER(hh, g_ref_cache.entries, r, tmp_r)
+    {
+        drop_entry(r);
+    }
+    pthread_mutex_unlock(&g_ref_cache.lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_REFCACHE_H_
+#define _TURBOBUILDER_REFCACHE_H_
+
+#include <stdbool.h>
+
+#include "sds/sds.h"
+#include "sqlite/sqlite3.h"
+
+#include "model.h"
+
+/* Display values kept before the least recently used one is dropped. */
+#define REF_CACHE_ENTRIES 4096
+
+/* -- REF VALUE CACHE -- */
+
+/* Returns a copy of the value the field displays for the record, or NULL
+ * when it is not cached. */
+sds
+find_ref_value(const struct entity* e, const struct field* f, int key);
+
+/* Caches the value the field displays for the record. A chained value is
+ * displayed through a REF of the record to another entity. */
+void
+cache_ref_value(const struct entity* e,
+                const struct field*  f,
+                int                  key,
+                const char*          value,
+                bool                 chained);
+
+/* Drops the cached values of the records the connection changes. */
+void
+watch_ref_values(sqlite3* db);
+
+void
+clear_ref_cache();
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coastguard/coastguard.h"
+
+#include "stmtcache.h"
+
+/* Statements are hashed by the identity of the model objects their key
+ * names, orders by the field and direction they sort on. */
+struct stmt_id
+{
+    const struct entity* e;
+    const struct field*  field;
+    const struct field*  filter;
+    const struct field*  order;
+    int                  kind;
+    int                  asc;
+    int                  search;
+};
+
+struct cached_stmt
+{
+    UT_hash_handle hh;
+
+    struct stmt_id id;
+    sqlite3_stmt*  stmt;
+};
+
+struct stmt_cache
+{
+    UT_hash_handle hh;
+
+    sqlite3*            db;
+    struct cached_stmt* stmts;
+};
+
+/* Connections are used by one thread at a time, but the UI and the query
+ * worker look up their caches from different threads. */
+static struct stmt_cache* g_stmt_caches;
+static pthread_mutex_t    g_stmt_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+make_stmt_id(const struct stmt_key* key, struct stmt_id* id)
+{
+    // Padding is hashed along with the members.
+    const struct order* o = key->order;
+    memset(id, 0, sizeof(struct stmt_id));
+    id->e      = key->e;
+    id->field  = key->field;
+    id->filter = key->filter;
+    id->kind   = key->kind;
+    id->search = key->search;
+    if (o != NULL && o->fpath.field != NULL) {
+        id->order = o->fpath.field;
+        id->asc   = o->asc;
+    }
+}
+
+static struct stmt_cache*
+find_stmt_cache(sqlite3* db, bool create)
+{
+    struct stmt_cache* c;
+    pthread_mutex_lock(&g_stmt_caches_lock);
+    HASH_FIND_PTR(g_stmt_caches, &db, c);
+    if (c == NULL && create) {
+        c     = calloc(1, sizeof(struct stmt_cache));
+        c->db = db;
+        HASH_ADD_PTR(g_stmt_caches, db, c);
+    }
+    pthread_mutex_unlock(&g_stmt_caches_lock);
+    return c;
+}
+
+sqlite3_stmt*
+find_cached_stmt(sqlite3* db, const struct stmt_key* key)
+{
+    struct stmt_id      id;
+    struct cached_stmt* s;
+    struct stmt_cache*  c = find_stmt_cache(db, false);
+    if (c == NULL) return NULL;
+    make_stmt_id(key, &id);
+    HASH_FIND(hh, c->stmts, &id, sizeof(struct stmt_id), s);
+    return s != NULL ? s->stmt : NULL;
+}
+
+wrapped_stmt
+cache_stmt(sqlite3* db, const struct stmt_key* key, const char* sql)
+{
+    sqlite3_stmt*       res;
+    struct cached_stmt* s;
+    struct stmt_cache*  c = find_stmt_cache(db, true);
+    $check(sqlite3_prepare_v3(
+             db, sql, -1, SQLITE_PREPARE_PERSISTENT, &res, 0) == SQLITE_OK,
+           sqlite3_errmsg(db),
+           error);
+    s       = calloc(1, sizeof(struct cached_stmt));
+    s->stmt = res;
+    make_stmt_id(key, &s->id);
+    HASH_ADD(hh, c->stmts, id, sizeof(struct stmt_id), s);
+    return (wrapped_stmt){ res };
+error:
+    return $invalid(wrapped_stmt, "unable to prepare statement");
+}
+
+void
+release_cached_stmt(sqlite3_stmt* res)
+{
+    if (res == NULL) return;
+    sqlite3_reset(res);
+    sqlite3_clear_bindings(res);
+}
+
+void
+finalize_stmt_cache(sqlite3* db)
+{
+    struct stmt_cache* c = find_stmt_cache(db, false);
+    if (c == NULL) return;
+    struct cached_stmt *s, *tmp_s;
+    HASH_ITER(hh, c->stmts, s, tmp_s)
+    {
+        sqlite3_finalize(s->stmt);
+        HASH_DEL(c->stmts, s);
+        free(s);
+    }
+    pthread_mutex_lock(&g_stmt_caches_lock);
+    HASH_DEL(g_stmt_caches, c);
+    pthread_mutex_unlock(&g_stmt_caches_lock);
+    free(c);
+}
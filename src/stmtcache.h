@@ -0,0 +1,70 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_STMTCACHE_H_
+#define _TURBOBUILDER_STMTCACHE_H_
+
+#include "coastguard/coastguard.h"
+#include "sqlite/sqlite3.h"
+
+#include "model.h"
+
+/* -- STATEMENT KINDS -- */
+
+typedef enum
+{
+    STMT_LIST,
+    STMT_OBJ,
+    STMT_REF,
+    STMT_REF_KEY,
+    STMT_INSERT,
+    STMT_UPDATE,
+    STMT_ARCHIVE,
+    STMT_FTS_DELETE,
+    STMT_FTS_INSERT,
+    STMT_FIELD
+} stmt_kind;
+
+$typedef(sqlite3_stmt*) wrapped_stmt;
+
+/* Cached statements are identified by the entity they were generated for,
+ * the kind of statement, an optional field (the context of a list or the
+ * column a statement reads or matches on), an optional lookup filter
+ * field, an optional order and whether the statement filters by a search
+ * term. */
+struct stmt_key
+{
+    const struct entity* e;
+    stmt_kind            kind;
+    const struct field*  field;
+    const struct field*  filter;
+    const struct order*  order;
+    bool                 search;
+};
+
+/* -- STATEMENT CACHE -- */
+
+sqlite3_stmt*
+find_cached_stmt(sqlite3* db, const struct stmt_key* key);
+wrapped_stmt
+cache_stmt(sqlite3* db, const struct stmt_key* key, const char* sql);
+void
+release_cached_stmt(sqlite3_stmt* res);
+void
+finalize_stmt_cache(sqlite3* db);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "coastguard/coastguard.h"
+#include "sds/sds.h"
+
+#include "storage.h"
+
+/* -- STORAGE PROFILES -- */
+
+static const struct storage_profile PROFILES[] = {
+    { "interactive", "wal", "normal", 64, 256, false },
+    { "bulk", "wal", "off", 256, 256, false },
+    { "readonly", NULL, NULL, 64, 1024, true },
+};
+
+static const char* JOURNAL_MODES[] = { "delete", "truncate", "persist",
+                                       "memory", "wal",      "off" };
+
+static const char* SYNCHRONOUS_LEVELS[] = { "off", "normal", "full", "extra" };
+
+static bool
+is_one_of(const char* value, const char** values, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (strcmp(value, values[i]) == 0) return true;
+    }
+    return false;
+}
+
+wrapped_storage_profile
+find_storage_profile(const char* name)
+{
+    for (size_t i = 0; i < sizeof(PROFILES) / sizeof(PROFILES[0]); i++) {
+        if (strcmp(PROFILES[i].name, name) == 0) {
+            return (wrapped_storage_profile){ PROFILES[i] };
+        }
+    }
+    $log_error("unknown storage profile %s", name);
+    return $invalid(wrapped_storage_profile, "unknown storage profile");
+}
+
+/* -- BACKGROUND CHECKPOINTS -- */
+
+/* Commits only signal the checkpointer once the WAL grows past the
+ * threshold, the checkpoint itself runs on a connection of its own in a
+ * separate thread. */
+static struct
+{
+    sqlite3*        db;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    bool            pending;
+    bool            running;
+} g_checkpointer = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                     .wake = PTHREAD_COND_INITIALIZER };
+
+static int
+signal_checkpointer(void* arg, sqlite3* db, const char* name, int pages)
+{
+    if (pages < STORAGE_CHECKPOINT_PAGES) return SQLITE_OK;
+    pthread_mutex_lock(&g_checkpointer.lock);
+    g_checkpointer.pending = true;
+    pthread_cond_signal(&g_checkpointer.wake);
+    pthread_mutex_unlock(&g_checkpointer.lock);
+    return SQLITE_OK;
+}
+
+static void*
+run_checkpointer(void* arg)
+{
+    pthread_mutex_lock(&g_checkpointer.lock);
+    while (g_checkpointer.running) {
+        if (!g_checkpointer.pending) {
+            pthread_cond_wait(&g_checkpointer.wake, &g_checkpointer.lock);
+            continue;
+        }
+        g_checkpointer.pending = false;
+        pthread_mutex_unlock(&g_checkpointer.lock);
+        // Passive checkpoints never wait for readers or writers, frames
+        // they cannot copy yet are left for the next one.
+        sqlite3_wal_checkpoint_v2(
+          g_checkpointer.db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+        pthread_mutex_lock(&g_checkpointer.lock);
+    }
+    pthread_mutex_unlock(&g_checkpointer.lock);
+    return NULL;
+}
+
+static $status
+start_checkpointer(sqlite3* db)
+{
+    const char* filename = sqlite3_db_filename(db, "main");
+    if (filename == NULL || filename[0] == '\0') return $okay;
+    // The connection only checkpoints once it has seen the database in WAL
+    // mode itself.
+    if (sqlite3_open_v2(
+          filename, &g_checkpointer.db, SQLITE_OPEN_READWRITE, NULL) !=
+          SQLITE_OK ||
+        sqlite3_exec(g_checkpointer.db, "PRAGMA journal_mode = wal", 0, 0, 0) !=
+          SQLITE_OK) {
+        $log_error("%s", sqlite3_errmsg(g_checkpointer.db));
+        sqlite3_close(g_checkpointer.db);
+        g_checkpointer.db = NULL;
+        return $error("unable to open checkpoint connection");
+    }
+    g_checkpointer.running = true;
+    if (pthread_create(&g_checkpointer.thread, NULL, run_checkpointer, NULL) !=
+        0) {
+        g_checkpointer.running = false;
+        sqlite3_close(g_checkpointer.db);
+        g_checkpointer.db = NULL;
+        return $error("unable to start checkpoint thread");
+    }
+    // Replaces the automatic checkpoint run by the committing connection.
+    sqlite3_wal_hook(db, signal_checkpointer, NULL);
+    return $okay;
+}
+
+void
+stop_storage_checkpoints()
+{
+    if (!g_checkpointer.running) return;
+    pthread_mutex_lock(&g_checkpointer.lock);
+    g_checkpointer.running = false;
+    pthread_cond_signal(&g_checkpointer.wake);
+    pthread_mutex_unlock(&g_checkpointer.lock);
+    pthread_join(g_checkpointer.thread, NULL);
+    sqlite3_close(g_checkpointer.db);
+    g_checkpointer.db = NULL;
+}
+
+/* -- PROFILE APPLICATION -- */
+
+static int
+read_journal_mode(void* arg, int argc, char** argv, char** columns)
+{
+    *(bool*)arg = argc > 0 && argv[0] != NULL && strcmp(argv[0], "wal") == 0;
+    return 0;
+}
+
+$status
+apply_storage_profile(sqlite3* db, const struct storage_profile* p)
+{
+    $status ret = $okay;
+    char*   err = NULL;
+    bool    wal = false;
+    sds     sql = sdsempty();
+    if (p->journal != NULL) {
+        int n = sizeof(JOURNAL_MODES) / sizeof(JOURNAL_MODES[0]);
+        $check(is_one_of(p->journal, JOURNAL_MODES, n),
+               ret,
+               "unknown journal mode",
+               cleanup);
+        sql = sdscatprintf(sql, "PRAGMA journal_mode = %s;", p->journal);
+        if (sqlite3_exec(db, sql, read_journal_mode, &wal, &err) != SQLITE_OK)
+            goto error_sqlite;
+        sdsclear(sql);
+    }
+    if (p->synchronous != NULL) {
+        int n = sizeof(SYNCHRONOUS_LEVELS) / sizeof(SYNCHRONOUS_LEVELS[0]);
+        $check(is_one_of(p->synchronous, SYNCHRONOUS_LEVELS, n),
+               ret,
+               "unknown synchronous level",
+               cleanup);
+        sql = sdscatprintf(sql, "PRAGMA synchronous = %s;", p->synchronous);
+    }
+    // A negative cache size is in KiB rather than in pages.
+    sql = sdscatprintf(sql,
+                       "PRAGMA cache_size = %d; PRAGMA mmap_size = %lld;",
+                       -p->cache_size * 1024,
+                       (long long)p->mmap_size * 1024 * 1024);
+    if (p->query_only) sql = sdscat(sql, "PRAGMA query_only = ON;");
+    if (sqlite3_exec(db, sql, 0, 0, &err) != SQLITE_OK) goto error_sqlite;
+    if (wal) ret = start_checkpointer(db);
+cleanup:
+    sdsfree(sql);
+    return ret;
+error_sqlite:
+    $log_error("unable to apply storage profile: %s", err);
+    sqlite3_free(err);
+    ret = $error("unable to apply storage profile");
+    goto cleanup;
+}
@@ -0,0 +1,60 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_STORAGE_H_
+#define _TURBOBUILDER_STORAGE_H_
+
+#include <stdbool.h>
+
+#include "coastguard/coastguard.h"
+#include "sqlite/sqlite3.h"
+
+/* WAL pages written before the background checkpoint runs. */
+#define STORAGE_CHECKPOINT_PAGES 1000
+
+/* -- STORAGE PROFILES -- */
+
+/* A storage profile sets how the database is journaled and synced and how
+ * much of it is cached in memory. A NULL journal or synchronous level
+ * keeps the one the database already has. Sizes are in MiB. */
+struct storage_profile
+{
+    const char* name;
+    const char* journal;
+    const char* synchronous;
+    int         cache_size;
+    int         mmap_size;
+    bool        query_only;
+};
+
+$typedef(struct storage_profile) wrapped_storage_profile;
+
+/* Finds one of the predefined profiles: interactive, bulk or readonly. */
+wrapped_storage_profile
+find_storage_profile(const char* name);
+
+/* Applies the profile to a freshly opened database. WAL databases are
+ * checkpointed by a background thread instead of by the commit that
+ * crosses the checkpoint threshold. */
+$status
+apply_storage_profile(sqlite3* db, const struct storage_profile* p);
+
+/* Stops the background checkpoints, before closing the database. */
+void
+stop_storage_checkpoints();
+
+#endif
@@ -15,10 +15,12 @@
  * You should have received a copy of the GNU General Public License along with
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <wchar.h>
 
@@ -27,6 +29,8 @@
 
 #include "model.h"
 #include "msql.h"
+#include "querylog.h"
+#include "worker.h"
 #include "tui.h"
 
 #define COLOR_ERROR 1
@@ -38,7 +42,14 @@
         va_start(args, fmt);                                                   \
         sds msg = sdsempty();                                                  \
         msg     = sdscatvprintf(msg, fmt, args);                               \
-        newtWinMessage(#LEVEL, "close", "%s", msg);                            \
+        if (tui_active && pthread_equal(pthread_self(), tui_thread))           \
+            newtWinMessage(#LEVEL, "close", "%s", msg);                        \
+        else if (tui_active) {                                                 \
+            pthread_mutex_lock(&output_lock);                                  \
+            output_buffer = sdscat(output_buffer, msg);                        \
+            pthread_mutex_unlock(&output_lock);                                \
+        } else                                                                 \
+            fputs(msg, stderr);                                                \
         sdsfree(msg);                                                          \
         va_end(args);                                                          \
     }
@@ -48,13 +59,21 @@
     {                                                                          \
         va_list args;                                                          \
         va_start(args, fmt);                                                   \
+        pthread_mutex_lock(&output_lock);                                      \
+        if (output_buffer == NULL) output_buffer = sdsempty();                 \
         output_buffer = sdscatvprintf(output_buffer, fmt, args);               \
+        pthread_mutex_unlock(&output_lock);                                    \
         va_end(args);                                                          \
     }
 
-OUTPUT_IN_MESSAGE_BOX(error);
+/* Messages of the query worker thread cannot open a window, they are kept
+ * in the output buffer instead. Both threads append to it, under the lock. */
+static bool            tui_active;
+static pthread_t       tui_thread;
+static sds             output_buffer;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static sds output_buffer;
+OUTPUT_IN_MESSAGE_BOX(error);
 
 OUTPUT_IN_BUFFER(info);
 OUTPUT_IN_BUFFER(debug);
@@ -81,6 +100,8 @@ struct window_size
 };
 
 static const unsigned int MAX_SEARCH_TERM_SIZE = 1024 + 1;
+static const int          LOOKUP_PAGE_SCREENS  = 3;
+static const int          QUERY_JOB_WINDOW_MS  = 200;
 
 typedef struct
 {
@@ -99,6 +120,58 @@ typedef struct
     int           exit;
 } generic_form;
 
+struct lookup_row
+{
+    intptr_t    key;
+    const char* text;
+};
+
+/* A listed field, padded to width screen columns. */
+struct list_column
+{
+    struct field* field;
+    int           index;
+    int           width;
+};
+
+/* Row texts are borrowed by the listbox. They are kept in blocks that never
+ * move, and are released together when the listbox is cleared. */
+struct row_block
+{
+    struct row_block* next;
+    size_t            used;
+    size_t            size;
+    char              text[];
+};
+
+/* A lookup list holds only the rows fetched so far, the next page is
+ * fetched once the cursor reaches the last screen of loaded rows. Pages
+ * are fetched by the query worker into rows, and appended to the listbox
+ * once it is done. */
+struct lookup_list
+{
+    struct entity*             e;
+    sqlite3*                   db;
+    struct context*            ctx;
+    struct lookup_filter_data* lfd;
+    struct order*              order;
+    const char*                search_term;
+    newtComponent              listbox;
+    struct list_page           page;
+    int                        tail_rows;
+    intptr_t*                  tail;
+    bool                       fetching;
+    intptr_t                   until_key;
+    int                        n_rows;
+    int                        alloced_rows;
+    struct lookup_row*         rows;
+    int                        n_columns;
+    struct list_column*        columns;
+    char*                      row;
+    size_t                     row_size;
+    struct row_block*          blocks;
+};
+
 $typedef(struct entity_value_tui*) wrapped_entity_value;
 
 wrapped_entity_value
@@ -109,14 +182,17 @@ create_entity_value(struct entity* e)
     ee->base                       = e;
     eetui->ee                      = ee;
 
-    $foreach_hashed(struct field*, f, e->fields)
+    ee->values = calloc(e->n_fields, sizeof(struct field_value*));
+
+    $foreach_field(f, e)
     {
         struct field_value*     ef = calloc(1, sizeof(struct field_value));
         struct field_value_tui* eftui =
           calloc(1, sizeof(struct field_value_tui));
-        ef->base     = f;
-        ef->is_valid = true;
-        eftui->ef    = ef;
+        ef->base          = f;
+        ef->is_valid      = true;
+        eftui->ef         = ef;
+        ee->values[f->id] = ef;
         HASH_ADD_STR(ee->fields, base->name, ef);
         HASH_ADD_STR(eetui->fields_tui, ef->base->name, eftui);
     }
@@ -140,10 +216,60 @@ destroy_entity_value(struct entity_value_tui* eetui)
         HASH_DEL(eetui->fields_tui, fvtui);
         free(fvtui);
     }
+    free(eetui->ee->values);
     free(eetui->ee);
     free(eetui);
 }
 
+/* -- QUERY JOBS -- */
+
+/* Waits for a job posted to the query worker. A window offers to cancel it
+ * once it takes long enough to notice. */
+$status
+run_query_job(query_job job, void* data)
+{
+    post_query_job(job, data);
+    if (!wait_query_job(QUERY_JOB_WINDOW_MS)) {
+        newtCenteredWindow(24, 3, "Working");
+        newtComponent label  = newtLabel(1, 0, "Esc to cancel");
+        newtComponent cancel = newtCompactButton(7, 2, "Cancel");
+        newtComponent form   = newtForm(NULL, NULL, 0);
+        newtFormAddComponents(form, label, cancel, NULL);
+        newtFormAddHotKey(form, NEWT_KEY_ESCAPE);
+        newtFormWatchFd(form, query_worker_fd(), NEWT_FD_READ);
+        newtRefresh();
+        struct newtExitStruct ee;
+        do {
+            newtFormRun(form, &ee);
+            if (ee.reason != NEWT_EXIT_FDREADY) cancel_query_job();
+        } while (ee.reason != NEWT_EXIT_FDREADY);
+        newtFormDestroy(form);
+        newtPopWindow();
+    }
+    return finish_query_job();
+}
+
+struct fields_job
+{
+    struct entity_value* ev;
+    int                  key;
+};
+
+static $status
+run_fields_job(sqlite3* db, void* data)
+{
+    struct fields_job* j = data;
+    return init_fields(j->ev, db, j->key);
+}
+
+$status
+load_fields(struct entity_value* ev, int key)
+{
+    if (key <= 0) return $okay;
+    struct fields_job j = { ev, key };
+    return run_query_job(run_fields_job, &j);
+}
+
 int
 show_lookup_form(const char*                title,
                  struct entity*             e,
@@ -162,12 +288,12 @@ ref_field_filter(newtComponent entry, void* data, int ch, int cursor)
         return 13;
     }
     struct entity* e     = f->_data;
-    sds            title = sdscatprintf(sdsempty(), "%s Lookup", _TR(e->name));
+    sds            title = sdscatprintf(sdsempty(), "%s Lookup", e->label);
     int            key   = show_lookup_form(
       title, f->_data, fvt->lfd.db, NULL, &fvt->lfd, &f->base->order, true);
     if (key == -2) return 0;
     f->_kvalue = key;
-    sds v = get_ref_value(fvt->lfd.db, key, f->base->ref.eid, f->base->ref.fid);
+    sds v = get_ref_value(fvt->lfd.db, key, &f->base->ref);
     newtEntrySet(entry, v, 1);
     sdsfree(v);
     return 0;
@@ -320,7 +446,7 @@ get_ideal_list_window_size(struct entity* e)
     unsigned int max_width = wcols * 0.8;
     height                 = wrows * 0.7;
 
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
         if (f->listed) {
             width = width + f->length + 1;
@@ -343,7 +469,7 @@ get_ideal_form_window_size(struct entity* e)
     int          row   = 1;
     unsigned int col   = 1;
     unsigned int maxlw = 0;
-    $foreach_hashed(struct field*, f, e->fields)
+    $foreach_field(f, e)
     {
         if (f->hidden) continue;
         if (col + strlen(f->name) + 2 + f->length + 1 > max_width) {
@@ -391,7 +517,7 @@ add_form_fields(struct entity_value_tui* e,
             row = row + 2;
         }
         char label[1024];
-        snprintf(label, 1024, "%s: ", _TR(f->ef->base->name));
+        snprintf(label, 1024, "%s: ", f->ef->base->label);
         f->field_label = newtLabel(col, row, label);
         col            = col + strlen(label);
         const char* defv =
@@ -431,9 +557,7 @@ add_form_fields(struct entity_value_tui* e,
         }
         if (f->ef->base->type == REF) {
 
-            struct entity* r_entity;
-            find_entity(g_entities, f->ef->base->ref.eid, &r_entity);
-            f->ef->_data = r_entity;
+            f->ef->_data = f->ef->base->ref.entity;
             f->lfd.db    = db;
             f->lfd.k     = ctx->k;
             f->lfd.fv    = f->ef;
@@ -445,43 +569,32 @@ add_form_fields(struct entity_value_tui* e,
     }
 }
 
-$typedef(struct field_value*) wrapped_field_value;
-
-wrapped_field_value
-find_field_value(struct field_value* fs, const char* name)
-{
-    wrapped_field_value result;
-    HASH_FIND_STR(fs, name, result.v);
-    $certify(result.v != NULL, result.status);
-    return result;
-}
-
 void
 init_context(struct entity_value* e, sqlite3* db, struct context* ctx)
 {
     if (ctx == NULL) return;
-    wrapped_field_value wef = find_field_value(e->fields, ctx->fname);
-    struct field_value* f   = $unwrap(wef);
-    f->_kvalue              = ctx->k;
-    sds v = get_ref_value(db, ctx->k, f->base->ref.eid, f->base->ref.fid);
+    if (ctx->field->entity != e->base) {
+        $log_error("Unable to find editable field %s in entity %s",
+                   ctx->field->name,
+                   e->base->name);
+        return;
+    }
+    struct field_value* f = e->values[ctx->field->id];
+    f->_kvalue            = ctx->k;
+    sds v = get_ref_value(db, ctx->k, &f->base->ref);
     if (v != NULL) {
         if (f->_init_value != NULL) free(f->_init_value);
         f->_init_value = malloc(strlen((char*)v) + 1);
         strcpy((char*)f->_init_value, (char*)v);
     }
     sdsfree(v);
-    return;
-error:
-    $log_error("Unable to find editable field %s in entity %s",
-               ctx->fname,
-               e->base->name);
 }
 
 struct window_size
 create_form_window(struct entity* e)
 {
     struct window_size s = get_ideal_form_window_size(e);
-    newtCenteredWindow(s.w, s.h + 4, _TR(e->name));
+    newtCenteredWindow(s.w, s.h + 4, e->label);
     return s;
 }
 
@@ -499,7 +612,7 @@ add_relations_hotkeys(struct entity* e, newtComponent f)
     $foreach_hashed(struct relation*, r, e->relations)
     {
         newtFormAddHotKey(f, RELATION_KEYS[i]);
-        helpline = sdscatprintf(helpline, "F%d-%ss ", i + 1, _TR(r->fk.eid));
+        helpline = sdscatprintf(helpline, "F%d-%ss ", i + 1, r->label);
         if (++i == sizeof(RELATION_KEYS) / sizeof(int)) break;
     }
     return helpline;
@@ -528,13 +641,13 @@ show_relation_list_view(newtComponent    parent,
 {
     int            px, py;
     sds            title = sdsempty();
-    struct entity* re;
+    struct entity* re = r->fk.entity;
     struct context ctx;
 
-    $check(find_entity(g_entities, r->fk.eid, &re) == 0);
+    $check(r->fk.field != NULL);
     newtComponentGetPosition(parent, &px, &py);
-    title     = sdscatprintf(title, "%s %ss", _TR(e->name), _TR(r->fk.eid));
-    ctx.fname = r->fk.fid;
+    title     = sdscatprintf(title, "%s %ss", e->label, r->label);
+    ctx.field = r->fk.field;
     ctx.k     = key;
     show_lookup_form(title, re, db, &ctx, NULL, &r->order, false);
     sdsfree(title);
@@ -613,7 +726,7 @@ show_entity_form_view(struct entity_value_tui* e,
                     exit = 1;
                     show_relation_list_view(form, e->ee->base, r.v, key, db);
                     // Refresh
-                    if ($isokay(init_fields(e->ee, db, key))) {
+                    if ($isokay(load_fields(e->ee, key))) {
                         exit = 1;
                         $foreach_hashed(
                           struct field_value_tui*, f, e->fields_tui)
@@ -648,9 +761,10 @@ show_entity_edit_form(struct entity*  e,
     wrapped_entity_value     wee   = create_entity_value(e);
     struct entity_value_tui* eetui = $unwrap(wee);
 
-    init_fields(eetui->ee, db, key);
-    init_context(eetui->ee, db, ctx);
-    ret = show_entity_form_view(eetui, db, add_form_fields, key);
+    if $isokay (load_fields(eetui->ee, key)) {
+        init_context(eetui->ee, db, ctx);
+        ret = show_entity_form_view(eetui, db, add_form_fields, key);
+    }
     destroy_entity_value(eetui);
 
 error:
@@ -659,69 +773,219 @@ error:
 
 /* -- LOOKUP FORM -- */
 
-$status
-append_row_to_listbox(struct entity* e,
-                      sqlite3_stmt*  res,
-                      newtComponent  entities_listbox)
+#define ROW_BLOCK_SIZE 65536
+
+static struct list_column*
+list_columns(struct entity* e, int* n_columns)
 {
-    $status status      = $okay;
-    sds     val         = sdsempty();
-    int     field_index = 0;
+    struct list_column* columns =
+      calloc(e->plan->n_fields, sizeof(struct list_column));
+    int n = 0;
+    for (int i = 0; i < e->plan->n_fields; i++) {
+        const struct field_plan* fp = &e->plan->fields[i];
+        if (fp->list_column < 0) continue;
+        columns[n++] = (struct list_column){ .field = fp->base,
+                                             .index = fp->list_column,
+                                             .width = fp->base->length };
+    }
+    *n_columns = n;
+    return columns;
+}
 
-    $foreach_hashed(struct field*, f, e->fields)
-    {
-        if (f->listed) {
-            sds value = field_value_to_string(f, res, field_index + 1);
-            val       = sdscatprintf(val, " %-*s", f->length, value);
-            sdsfree(value);
+static int
+text_width(const char* s, int len)
+{
+    // ASCII takes a screen column per byte, other characters are measured
+    // the way newt draws them, so wide ones take two.
+    mbstate_t ps;
+    int       width = 0;
+    memset(&ps, 0, sizeof(mbstate_t));
+    while (len > 0) {
+        if ((unsigned char)*s < 0x80) {
+            width++;
+            s++;
+            len--;
+            continue;
         }
-        field_index++;
+        wchar_t wc;
+        size_t  n = mbrtowc(&wc, s, len, &ps);
+        if (n == 0 || n > (size_t)len) break;
+        int w = wcwidth(wc);
+        if (w > 0) width += w;
+        s += n;
+        len -= n;
     }
-    intptr_t key = sqlite3_column_int(res, 0);
-    newtListboxAppendEntry(entities_listbox, val, (void*)key);
-    sdsfree(val);
+    return width;
+}
 
+static void
+reserve_row(struct lookup_list* l, size_t size)
+{
+    if (size <= l->row_size) return;
+    l->row_size = size * 2;
+    l->row      = realloc(l->row, l->row_size);
+}
+
+static size_t
+format_list_row(struct lookup_list* l, sqlite3_stmt* res)
+{
+    // Formats into the list's row buffer. Values are padded to their
+    // column's width, longer ones are kept whole.
+    char   value[FIELD_TEXT_SIZE];
+    size_t n = 0;
+    reserve_row(l, 1);
+    for (int i = 0; i < l->n_columns; i++) {
+        const struct list_column* c = &l->columns[i];
+        int                       len;
+        const char*               text =
+          field_value_text(c->field, res, c->index, value, &len);
+        int pad = c->width - text_width(text, len);
+        if (pad < 0) pad = 0;
+        reserve_row(l, n + 1 + len + pad + 1);
+        l->row[n++] = ' ';
+        memcpy(l->row + n, text, len);
+        n += len;
+        memset(l->row + n, ' ', pad);
+        n += pad;
+    }
+    l->row[n] = '\0';
+    return n;
+}
+
+static const char*
+keep_row_text(struct lookup_list* l, size_t len)
+{
+    struct row_block* b = l->blocks;
+    if (b == NULL || b->size - b->used <= len) {
+        size_t size = len < ROW_BLOCK_SIZE ? ROW_BLOCK_SIZE : len + 1;
+        b           = malloc(sizeof(struct row_block) + size);
+        b->next     = l->blocks;
+        b->used     = 0;
+        b->size     = size;
+        l->blocks   = b;
+    }
+    char* text = memcpy(b->text + b->used, l->row, len + 1);
+    b->used += len + 1;
+    return text;
+}
+
+static void
+free_row_blocks(struct lookup_list* l, bool keep_one)
+{
+    struct row_block* b = l->blocks;
+    l->blocks           = NULL;
+    if (keep_one && b) {
+        l->blocks       = b;
+        b->used         = 0;
+        b               = b->next;
+        l->blocks->next = NULL;
+    }
+    while (b) {
+        struct row_block* next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+static $status
+fetch_lookup_rows(sqlite3* db, void* data)
+{
+    // Runs on the query worker: fetches the next page, or every page up to
+    // the one holding until_key when a specific row needs to be selected.
+    struct lookup_list* l      = data;
+    $status             status = $okay;
+    bool                found  = l->until_key < 0;
+
+    while (l->page.more) {
+        wrapped_stmt maybe_list_query = prepare_list_query(
+          l->e, db, l->ctx, l->lfd, l->order, l->search_term, &l->page);
+        sqlite3_stmt* res =
+          $unwrap(maybe_list_query, status, query_build_error);
+        int fetched = 0;
+        int rc;
+        while ((rc = sqlite3_step(res)) == SQLITE_ROW) {
+            if (l->n_rows == l->alloced_rows) {
+                l->alloced_rows = l->alloced_rows * 2 + l->page.limit;
+                l->rows         = realloc(
+                  l->rows, l->alloced_rows * sizeof(struct lookup_row));
+            }
+            intptr_t key              = sqlite3_column_int(res, 0);
+            l->rows[l->n_rows].key    = key;
+            l->rows[l->n_rows++].text =
+              keep_row_text(l, format_list_row(l, res));
+            l->tail[l->page.rows % l->tail_rows] = key;
+            found = found || key == l->until_key;
+            advance_list_page(l->e, &l->page, res);
+            fetched++;
+        }
+        release_cached_stmt(res);
+        if (rc != SQLITE_DONE) {
+            status = $error("list query failed");
+            break;
+        }
+        l->page.more = fetched == l->page.limit;
+        if (found) break;
+    }
+query_build_error:
     return status;
 }
 
+void
+start_lookup_fetch(struct lookup_list* l, intptr_t until_key)
+{
+    if (l->fetching || l->page.more == false) return;
+    l->fetching  = true;
+    l->until_key = until_key;
+    post_query_job(fetch_lookup_rows, l);
+}
+
 $status
-query_in_listbox(struct entity*             e,
-                 sqlite3*                   db,
-                 newtComponent              entities_listbox,
-                 const char*                search_term,
-                 struct context*            ctx,
-                 struct lookup_filter_data* lfd,
-                 struct order*              order)
-{
-    $status       status       = $okay;
-    sds           search_query = sdsempty();
-    sqlite3_stmt* res;
-
-    wrapped_sql maybe_list_query = build_list_query(e, db, ctx, lfd, order);
-    sds query_sql = $unwrap(maybe_list_query, status, query_build_error);
-    $check(sqlite3_prepare_v2(db, query_sql, -1, &res, 0) == SQLITE_OK,
-           "",
-           sqlite_prepare_error);
-    int idx      = sqlite3_bind_parameter_index(res, "@name");
-    search_query = sdscatprintf(search_query, "%%%s%%", search_term);
-    $check(SQLITE_OK ==
-             sqlite3_bind_text(
-               res, idx, search_query, sdslen(search_query), SQLITE_TRANSIENT),
-           status,
-           bind_error);
-    while (sqlite3_step(res) == SQLITE_ROW) {
-        append_row_to_listbox(e, res, entities_listbox);
-    }
-
-bind_error:
-    sqlite3_finalize(res);
-sqlite_prepare_error:
-    sdsfree(query_sql);
-query_build_error:
-    sdsfree(search_query);
+finish_lookup_fetch(struct lookup_list* l)
+{
+    $status status = finish_query_job();
+    for (int i = 0; i < l->n_rows; i++) {
+        newtListboxAppendBorrowedEntry(
+          l->listbox, l->rows[i].text, (void*)l->rows[i].key);
+    }
+    l->n_rows   = 0;
+    l->fetching = false;
+    if ($isokay(status) && l->until_key >= 0) {
+        newtListboxSetCurrentByKey(l->listbox, (void*)l->until_key);
+    }
     return status;
 }
 
+void
+stop_lookup_fetch(struct lookup_list* l)
+{
+    if (!l->fetching) return;
+    cancel_query_job();
+    finish_lookup_fetch(l);
+}
+
+void
+lookup_list_scrolled(newtComponent co, void* data)
+{
+    struct lookup_list* l = data;
+    if (l->fetching || l->page.more == false) return;
+    intptr_t key = (intptr_t)newtListboxGetCurrent(co);
+    for (int i = 0; i < l->tail_rows; i++) {
+        if (l->tail[i] == key) {
+            start_lookup_fetch(l, -1);
+            break;
+        }
+    }
+}
+
+void
+reset_lookup_list(struct lookup_list* l)
+{
+    newtListboxClear(l->listbox);
+    free_row_blocks(l, true);
+    reset_list_page(&l->page);
+    memset(l->tail, 0, l->tail_rows * sizeof(intptr_t));
+}
+
 void
 lookup_form_setup(newt_lookup_form* f, int cols, int rows)
 {
@@ -765,28 +1029,58 @@ show_lookup_form(const char*                title,
     newtCenteredWindow(size.w, size.h, title);
     newt_lookup_form f = { .search_term_buffer = "" };
     lookup_form_setup(&f, size.w, size.h);
-    int      exit  = 0;
-    intptr_t ret   = -2;
-    intptr_t resel = -1;
+    // Tiny terminals still page through at least a row at a time.
+    int                visible_rows = size.h > 5 ? size.h - 4 : 1;
+    struct lookup_list l            = {
+        .e           = e,
+        .db          = db,
+        .ctx         = ctx,
+        .lfd         = lfd,
+        .order       = order,
+        .search_term = f.search_term_buffer,
+        .listbox     = f.entities_listbox,
+        .page        = { .limit = visible_rows * LOOKUP_PAGE_SCREENS },
+        .tail_rows   = visible_rows,
+        .tail        = calloc(visible_rows, sizeof(intptr_t)),
+    };
+    l.columns = list_columns(e, &l.n_columns);
+    newtComponentAddCallback(f.entities_listbox, lookup_list_scrolled, &l);
+    newtFormWatchFd(f.form, query_worker_fd(), NEWT_FD_READ);
+    int      exit   = 0;
+    intptr_t ret    = -2;
+    intptr_t resel  = -1;
+    bool     reload = true;
     while (exit != 1) {
-        newtListboxClear(f.entities_listbox);
-        if ($iserror(query_in_listbox(e,
-                                      db,
-                                      f.entities_listbox,
-                                      f.search_term_buffer,
-                                      ctx,
-                                      lfd,
-                                      order))) {
-            break;
+        if (reload) {
+            reset_lookup_list(&l);
+            start_lookup_fetch(&l, resel);
+            reload = false;
         }
-        if (resel != -1)
-            newtListboxSetCurrentByKey(f.entities_listbox, (void*)resel);
         struct newtExitStruct ee;
         newtFormRun(f.form, &ee);
+        if (ee.reason == NEWT_EXIT_FDREADY) {
+            // Errors of the worker only reach the output buffer, the lookup
+            // says why it closes.
+            $status fetched = finish_lookup_fetch(&l);
+            if $iserror (fetched) {
+                newtWinMessage("error",
+                               "close",
+                               "Unable to load %s records: %s",
+                               e->label,
+                               fetched.message);
+                break;
+            }
+            continue;
+        }
+        // Anything else reloads the list, the rows still being fetched
+        // are no longer needed, e.g. for a new search term.
+        stop_lookup_fetch(&l);
+        reload = true;
         if (ee.reason == NEWT_EXIT_COMPONENT) {
             newtComponent last = ee.u.co;
             if (last == f.search_entry) {
                 strcpy(f.search_term_buffer, f.value);
+                resel = -1;
                 newtFormSetCurrent(f.form, f.entities_listbox);
             }
             if (last == f.entities_listbox) {
@@ -818,20 +1112,28 @@ show_lookup_form(const char*                title,
                                   "Are you sure you want to"
                                   " archive this record?") == 1) {
                     archive_obj(e, db, k);
+                    resel = -1;
                 }
             }
             if (ee.u.key == NEWT_KEY_F12) exit = 1;
             if (ee.u.key == NEWT_KEY_ESCAPE) exit = 1;
         }
     }
+    stop_lookup_fetch(&l);
     newtFormDestroy(f.form);
     newtPopHelpLine();
     newtPopWindow();
+    reset_list_page(&l.page);
+    free_row_blocks(&l, false);
+    free(l.rows);
+    free(l.tail);
+    free(l.columns);
+    free(l.row);
     return ret;
 }
 
 void
-show_output_buffer_view()
+show_output_buffer_view(sqlite3* db)
 {
     int wcols, wrows;
 
@@ -843,11 +1145,20 @@ show_output_buffer_view()
       0, 0, wcols - 2, wrows, NEWT_TEXTBOX_WRAP | NEWT_TEXTBOX_SCROLL);
     newtComponent form = newtForm(NULL, NULL, 0);
     newtFormAddComponents(form, tb, NULL);
-    newtTextboxSetText(tb, output_buffer);
+    sds slow = describe_query_log(db);
+    pthread_mutex_lock(&output_lock);
+    sds text = sdsdup(output_buffer);
+    pthread_mutex_unlock(&output_lock);
+    if (sdslen(slow) > 0) {
+        text = sdscatprintf(text, "\nSLOW QUERIES\n\n%s", slow);
+    }
+    newtTextboxSetText(tb, text);
     struct newtExitStruct iee;
     newtFormRun(form, &iee);
     newtFormDestroy(form);
     newtPopWindow();
+    sdsfree(text);
+    sdsfree(slow);
 }
 
 void
@@ -859,7 +1170,7 @@ show_entities_form(sqlite3* db)
         entities_listbox = newtListbox(0, 0, 9, NEWT_FLAG_RETURNEXIT);
         $foreach_hashed(struct entity*, e, g_entities)
         {
-            newtListboxAppendEntry(entities_listbox, _TR(e->name), e);
+            newtListboxAppendEntry(entities_listbox, e->label, e);
         }
         newtListboxSetWidth(entities_listbox, 20);
         newtOpenWindow(1, 1, 20, 10, "Entities");
@@ -872,11 +1183,11 @@ show_entities_form(sqlite3* db)
         if (ee.reason == NEWT_EXIT_COMPONENT) {
             struct entity* sel = newtListboxGetCurrent(entities_listbox);
             int            r   = show_lookup_form(
-              _TR(sel->name), sel, db, NULL, NULL, NULL, false);
+              sel->label, sel, db, NULL, NULL, NULL, false);
         }
         if (ee.reason == NEWT_EXIT_HOTKEY) {
             if (ee.u.key == NEWT_KEY_F1) {
-                show_output_buffer_view();
+                show_output_buffer_view(db);
             } else
                 exit = 1;
         }
@@ -903,8 +1214,10 @@ draw_background()
 void
 init_tui()
 {
-    output_buffer = sdsempty();
+    if (output_buffer == NULL) output_buffer = sdsempty();
     newtInit();
+    tui_active = true;
+    tui_thread = pthread_self();
     newtSetColor(NEWT_COLORSET_ROOTTEXT, "color025", "blue");
     newtSetColor(NEWT_COLORSET_CUSTOM(COLOR_ERROR), "white", "color124");
     newtSetColor(NEWT_COLORSET_DISENTRY, "white", "color104");
@@ -922,5 +1235,9 @@ void
 shutdown_tui()
 {
     newtFinished();
+    tui_active = false;
+    pthread_mutex_lock(&output_lock);
     sdsfree(output_buffer);
+    output_buffer = NULL;
+    pthread_mutex_unlock(&output_lock);
 }
@@ -0,0 +1,188 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "coastguard/coastguard.h"
+
+#include "querylog.h"
+#include "stmtcache.h"
+#include "worker.h"
+
+/* Jobs are handed to the worker under the lock, their completion is
+ * written to a pipe so that the UI can wait for it in its own select
+ * loop. */
+static struct
+{
+    sqlite3*        db;
+    bool            own_db;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    int             done[2];
+    query_job       job;
+    void*           data;
+    $status         status;
+    bool            running;
+} g_worker = { .lock = PTHREAD_MUTEX_INITIALIZER,
+               .wake = PTHREAD_COND_INITIALIZER,
+               .done = { -1, -1 } };
+
+static void*
+run_query_worker(void* arg)
+{
+    pthread_mutex_lock(&g_worker.lock);
+    while (g_worker.running) {
+        if (g_worker.job == NULL) {
+            pthread_cond_wait(&g_worker.wake, &g_worker.lock);
+            continue;
+        }
+        query_job job  = g_worker.job;
+        void*     data = g_worker.data;
+        pthread_mutex_unlock(&g_worker.lock);
+        $status status = job(g_worker.db, data);
+        pthread_mutex_lock(&g_worker.lock);
+        g_worker.job    = NULL;
+        g_worker.status = status;
+        char c          = 0;
+        if (write(g_worker.done[1], &c, 1) != 1) {
+            $log_error("unable to signal a finished query job");
+        }
+    }
+    pthread_mutex_unlock(&g_worker.lock);
+    return NULL;
+}
+
+static $status
+open_worker_db(sqlite3* db)
+{
+    const char* filename = sqlite3_db_filename(db, "main");
+    if (filename == NULL || filename[0] == '\0') {
+        g_worker.db = db;
+        return $okay;
+    }
+    // Without WAL a write of the UI connection locks readers out, the busy
+    // timeout waits for it instead of failing the job.
+    if (sqlite3_open_v2(filename, &g_worker.db, SQLITE_OPEN_READWRITE, NULL) !=
+          SQLITE_OK ||
+        sqlite3_exec(g_worker.db, "PRAGMA query_only = 1", 0, 0, 0) !=
+          SQLITE_OK) {
+        $log_error("%s", sqlite3_errmsg(g_worker.db));
+        sqlite3_close(g_worker.db);
+        g_worker.db = NULL;
+        return $error("unable to open query worker connection");
+    }
+    sqlite3_busy_timeout(g_worker.db, 5000);
+    g_worker.own_db = true;
+    trace_query_log(g_worker.db);
+    return $okay;
+}
+
+static void
+close_worker_db()
+{
+    if (g_worker.own_db) {
+        finalize_stmt_cache(g_worker.db);
+        sqlite3_close(g_worker.db);
+    }
+    g_worker.db     = NULL;
+    g_worker.own_db = false;
+}
+
+$status
+start_query_worker(sqlite3* db)
+{
+    $status ret = $okay;
+    if (pipe(g_worker.done) != 0) return $error("unable to create pipe");
+    ret = open_worker_db(db);
+    if $iserror (ret) goto error;
+    g_worker.running = true;
+    if (pthread_create(&g_worker.thread, NULL, run_query_worker, NULL) != 0) {
+        g_worker.running = false;
+        close_worker_db();
+        ret = $error("unable to start query worker");
+        goto error;
+    }
+    return ret;
+error:
+    close(g_worker.done[0]);
+    close(g_worker.done[1]);
+    g_worker.done[0] = g_worker.done[1] = -1;
+    return ret;
+}
+
+void
+stop_query_worker()
+{
+    if (!g_worker.running) return;
+    pthread_mutex_lock(&g_worker.lock);
+    g_worker.running = false;
+    pthread_cond_signal(&g_worker.wake);
+    pthread_mutex_unlock(&g_worker.lock);
+    pthread_join(g_worker.thread, NULL);
+    close_worker_db();
+    close(g_worker.done[0]);
+    close(g_worker.done[1]);
+    g_worker.done[0] = g_worker.done[1] = -1;
+}
+
+/* -- JOBS -- */
+
+void
+post_query_job(query_job job, void* data)
+{
+    pthread_mutex_lock(&g_worker.lock);
+    g_worker.job  = job;
+    g_worker.data = data;
+    pthread_cond_signal(&g_worker.wake);
+    pthread_mutex_unlock(&g_worker.lock);
+}
+
+int
+query_worker_fd()
+{
+    return g_worker.done[0];
+}
+
+bool
+wait_query_job(int timeout_ms)
+{
+    struct pollfd p = { .fd = g_worker.done[0], .events = POLLIN };
+    return poll(&p, 1, timeout_ms) > 0;
+}
+
+$status
+finish_query_job()
+{
+    char c;
+    if (read(g_worker.done[0], &c, 1) != 1) {
+        return $error("unable to wait for the query job");
+    }
+    pthread_mutex_lock(&g_worker.lock);
+    $status status = g_worker.status;
+    pthread_mutex_unlock(&g_worker.lock);
+    return status;
+}
+
+void
+cancel_query_job()
+{
+    sqlite3_interrupt(g_worker.db);
+}
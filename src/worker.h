@@ -0,0 +1,60 @@
+/*
+ * TURBOBUILDER
+ * Copyright (C) 2020 Ithai Levi
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TURBOBUILDER_WORKER_H_
+#define _TURBOBUILDER_WORKER_H_
+
+#include <stdbool.h>
+
+#include "coastguard/coastguard.h"
+#include "sqlite/sqlite3.h"
+
+/* -- QUERY WORKER -- */
+
+/* A query job runs on the worker thread against the worker's connection. */
+typedef $status (*query_job)(sqlite3* db, void* data);
+
+/* Starts the worker thread with a read-only connection of its own to the
+ * database. In-memory databases cannot be opened twice, their jobs run on
+ * the given connection instead. */
+$status
+start_query_worker(sqlite3* db);
+
+void
+stop_query_worker();
+
+/* Runs one job at a time, the previous one must have been finished. */
+void
+post_query_job(query_job job, void* data);
+
+/* Becomes readable once the posted job is done, e.g. for newtFormWatchFd. */
+int
+query_worker_fd();
+
+/* Waits up to timeout_ms for the posted job, returns whether it is done. */
+bool
+wait_query_job(int timeout_ms);
+
+/* Waits for the posted job and returns its status. */
+$status
+finish_query_job();
+
+/* Interrupts the statement the posted job runs, the job then fails. */
+void
+cancel_query_job();
+
+#endif